@@ -0,0 +1,1486 @@
+/**
+ *  ESP Sync host build, protocol master
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncMaster.h"
+#include "ESPSyncChecksum.h"
+#include "ESPSyncLZ.h"
+#include "ESPSyncPosixStream.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#define STX       (0x02)
+#define ACK       (0x06)
+#define NAK       (0x15)
+
+#define CMD_SET_TIME (0x60)
+#define CMD_FORMAT   (0x61)
+#define CMD_LIST     (0x62)
+#define CMD_REMOVE   (0x63)
+#define CMD_RENAME   (0x64)
+#define CMD_FILE     (0x65)
+#define CMD_SESSION  (0x66)
+#define CMD_SIGNATURE (0x67)
+#define CMD_DELTA    (0x68)
+#define CMD_FILE_LZ  (0x69)
+#define CMD_HASH     (0x6A)
+#define CMD_BATCH    (0x6B)
+#define CMD_BAUD     (0x6C)
+#define CMD_STATS    (0x6D)
+#define CMD_RESUME   (0x6E)
+#define CMD_CONTINUE (0x6F)
+
+#define RPL_TIME_SET (0x70)
+#define RPL_FORMATED (0x71)
+#define RPL_LISTING  (0x72)
+#define RPL_REMOVED  (0x73)
+#define RPL_RENAMED  (0x74)
+#define RPL_RECEIVED (0x75)
+#define RPL_SESSION  (0x76)
+#define RPL_SIGNATURE (0x77)
+#define RPL_HASH     (0x7A)
+#define RPL_BATCH    (0x7B)
+#define RPL_BAUD     (0x7C)
+#define RPL_STATS    (0x7D)
+#define RPL_RESUME   (0x7E)
+
+#define CMD_CHUNKED  (0x80)
+#define CMD_CHUNK    (0x81)
+#define CMD_GET      (0x82)
+#define CMD_COPY     (0x83)
+#define RPL_CHUNKED  (0x90)
+#define RPL_CHUNK    (0x91)
+#define RPL_FILE     (0x92)
+
+#define NAK_TIMEOUT  (0x21)
+#define NAK_CHKSUM   (0x22)
+#define NAK_FNOTF    (0x25)
+
+#define DELTA_OP_COPY    (0x01)
+#define DELTA_OP_LITERAL (0x02)
+#define ADLER_MOD        (65521)
+
+#define CHUNKED_RESTART  (0x01)
+#define CHUNK_RETRIES    (8)     /* Failures in a row, before giving up */
+
+#define LZ_FLAG_STORE    (0x01)
+#define LZ_MIN_MATCH     (3)
+#define LZ_MAX_MATCH     (3 + 15 + 255)
+#define LZ_HASH_BITS     (12)
+#define LZ_MAX_CHAIN     (32)  /* Earlier matches tried, at each byte */
+
+/* Bytes sent at once, when pacing to a line rate */
+#define TX_PACE_BYTES (64)
+
+/* ms idle before agreeing the checksum again, well inside the slave's 5 s */
+#define SESSION_RENEW (2000)
+
+#define BAUD_PATTERN  (56)  /* Test bytes sent at a new line rate */
+#define BAUD_DEFAULT  (115200)
+
+#define TX_CMN(X) ((X)+0x20)
+#define RX_CMN(X) ((X)+0x40)
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+ESPSyncMaster::ESPSyncMaster(int fd)
+{
+    _fd = fd;
+    _cmn = 0;
+    _sent = 0;
+    _window = 1;
+    _lzbits = ESPSYNC_LZ_WINDOW_BITS;
+    _csum = CSUM_ADLER32;
+    _fscaps = 0;
+    _asked = 1;
+    _offered = 1 << CSUM_ADLER32;
+    _last_tx = 0;
+    _queued_rc = MASTER_OK;
+    _timeout = 250;
+    _fault = MASTER_FAULT_NONE;
+    _baud = 0;
+    _line = BAUD_DEFAULT;
+    _tx_bytes = 0;
+    _noise = 0;
+    _noise_seed = 1;
+    _rxhead = 0;
+    _rxlen = 0;
+}
+
+void ESPSyncMaster::setTimeout(uint32_t timeout)
+{
+    _timeout = timeout;
+}
+
+void ESPSyncMaster::setFault(int fault)
+{
+    _fault = fault;
+}
+
+void ESPSyncMaster::setLineRate(uint32_t baud)
+{
+    _baud = baud;
+}
+
+void ESPSyncMaster::setNoise(uint32_t oneIn)
+{
+    _noise = oneIn;
+}
+
+void ESPSyncMaster::TX_Raw(const uint8_t *data, uint32_t length)
+{
+    std::vector<uint8_t> noisy;
+
+    if (_noise != 0) {
+        /* Flip a bit of about one byte in _noise, the same ones each run */
+        noisy.assign(data, data + length);
+        for (uint32_t x = 0; x < length; x++) {
+            _noise_seed ^= _noise_seed << 13;
+            _noise_seed ^= _noise_seed >> 17;
+            _noise_seed ^= _noise_seed << 5;
+            if ((_noise_seed % _noise) == 0) {
+                noisy[x] ^= 1 << (_noise_seed >> 29);
+            }
+        }
+        data = noisy.data();
+    }
+
+    while (length > 0) {
+        uint32_t chunk = length;
+        if (_baud != 0) {
+            /* A UART FIFO's worth at a time, taking as long as the line would */
+            if (chunk > TX_PACE_BYTES) {
+                chunk = TX_PACE_BYTES;
+            }
+            usleep(((uint64_t)chunk * 10 * 1000000) / _baud);
+        }
+        ssize_t wr = write(_fd, data, chunk);
+        if (wr < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN)) {
+                continue;
+            }
+            return;
+        }
+        data += wr;
+        length -= wr;
+        _tx_bytes += wr;
+    }
+}
+
+uint64_t ESPSyncMaster::txBytes(void)
+{
+    return _tx_bytes;
+}
+
+void ESPSyncMaster::TX_Header(uint8_t func, uint32_t size)
+{
+    uint8_t  header[8];
+    uint16_t csum = 0;
+
+    _sent = _cmn;
+    _cmn = (_cmn + 1) & 0x1F;
+    _last_tx = now_ms();
+
+    header[0] = STX;
+    header[1] = TX_CMN(_sent);
+    header[2] = func;
+    header[3] = (size >> 16) & 0xFF;
+    header[4] = (size >> 8) & 0xFF;
+    header[5] = size & 0xFF;
+    for (int x = 0; x < 6; x++) {
+        fletcher16(&csum, header[x]);
+    }
+    header[6] = csum >> 8;
+    header[7] = csum & 0xFF;
+    TX_Raw(header, 8);
+}
+
+/**
+ * The CHK2 of a message.  Session, its reply, and messages carrying file
+ * data are always Adler-32, the rest use what the session agreed.
+ */
+const ESPSyncCsum *ESPSyncMaster::CSUM_For(uint8_t func)
+{
+    switch (func) {
+        case CMD_SESSION:
+        case RPL_SESSION:
+        case CMD_FILE:
+        case CMD_DELTA:
+        case CMD_FILE_LZ:
+        case CMD_BATCH:
+        case CMD_CONTINUE:
+        case CMD_CHUNK:
+            return &espsync_csums[CSUM_ADLER32];
+        default:
+            return &espsync_csums[_csum];
+    }
+}
+
+void ESPSyncMaster::TX_Message(uint8_t func, const uint8_t *data, uint32_t length)
+{
+    const ESPSyncCsum *ck = CSUM_For(func);
+    uint32_t csum = ck->update(ck->init, data, length);
+    uint8_t  chk[4] = { (uint8_t)(csum >> 24), (uint8_t)(csum >> 16),
+                        (uint8_t)(csum >> 8),  (uint8_t)csum };
+
+    TX_Header(func, length + 4);
+    TX_Raw(data, length);
+    TX_Raw(chk, 4);
+}
+
+int ESPSyncMaster::RX_Byte(uint32_t timeout)
+{
+    if (_rxhead == _rxlen) {
+        struct pollfd pfd;
+        pfd.fd = _fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) <= 0) {
+            return -1;
+        }
+        ssize_t rd = read(_fd, _rxbuf, sizeof(_rxbuf));
+        if (rd <= 0) {
+            return -1;
+        }
+        _rxhead = 0;
+        _rxlen = rd;
+    }
+    return _rxbuf[_rxhead++];
+}
+
+/**
+ * Scan for a valid reply header, for any CMN.
+ */
+int ESPSyncMaster::RX_Header(uint8_t header[8], uint32_t deadline)
+{
+    int byte;
+
+    for (;;) {
+        uint32_t now = now_ms();
+        if ((int32_t)(deadline - now) <= 0) {
+            return MASTER_TIMEOUT;
+        }
+
+        byte = RX_Byte(deadline - now);
+        if (byte < 0) {
+            return MASTER_TIMEOUT;
+        }
+        if (byte != STX) {
+            continue; /* Not ours, Eg, console output */
+        }
+
+        header[0] = byte;
+        uint16_t csum = 0;
+        fletcher16(&csum, header[0]);
+        for (int x = 1; x < 8; x++) {
+            byte = RX_Byte(_timeout);
+            if (byte < 0) {
+                return MASTER_TIMEOUT;
+            }
+            header[x] = byte;
+            if (x < 6) {
+                fletcher16(&csum, header[x]);
+            }
+        }
+        if ((header[1] >= RX_CMN(0)) && (header[1] <= RX_CMN(0x1F)) &&
+            (header[6] == (csum >> 8)) && (header[7] == (csum & 0xFF))) {
+            return MASTER_OK;
+        }
+    }
+}
+
+/**
+ * Read and check the data body of a reply.
+ */
+int ESPSyncMaster::RX_Body(uint32_t size, const ESPSyncCsum *ck, std::vector<uint8_t> *body)
+{
+    if (body != NULL) {
+        body->clear();
+    }
+    if (size == 0) {
+        return MASTER_OK;
+    }
+    if (size < 4) {
+        return MASTER_BADREPLY;
+    }
+
+    std::vector<uint8_t> data(size);
+    for (uint32_t x = 0; x < size; x++) {
+        int byte = RX_Byte(_timeout);
+        if (byte < 0) {
+            return MASTER_TIMEOUT;
+        }
+        data[x] = byte;
+    }
+    uint32_t rx_csum = (data[size-4] << 24) | (data[size-3] << 16) |
+                       (data[size-2] << 8) | data[size-1];
+    if (ck->update(ck->init, data.data(), size-4) != rx_csum) {
+        return MASTER_BADREPLY;
+    }
+    if (body != NULL) {
+        body->assign(data.begin(), data.end()-4);
+    }
+    return MASTER_OK;
+}
+
+/**
+ * Wait for the reply to the request sent with cmn.
+ * ACKs extend the wait by the time the slave asks for.
+ */
+int ESPSyncMaster::RX_For(uint8_t cmn, uint8_t func, std::vector<uint8_t> *body)
+{
+    uint32_t deadline = now_ms() + _timeout;
+    uint8_t  header[8];
+    uint32_t size;
+
+    for (;;) {
+        if (RX_Header(header, deadline) != MASTER_OK) {
+            return MASTER_TIMEOUT;
+        }
+        size = (header[3] << 16) | (header[4] << 8) | header[5];
+        if (header[1] != RX_CMN(cmn)) {
+            /* A late reply to something else, skip it */
+            if ((header[2] != ACK) && (header[2] != NAK)) {
+                RX_Body(size, CSUM_For(header[2]), NULL);
+            }
+            continue;
+        }
+        if (header[2] != ACK) {
+            break;
+        }
+        deadline = now_ms() + (size >> 8) + 1;
+    }
+
+    if (header[2] == NAK) {
+        return (size >> 16);
+    }
+    if (header[2] != func) {
+        return MASTER_BADREPLY;
+    }
+    return RX_Body(size, CSUM_For(func), body);
+}
+
+/**
+ * Wait up to timeout ms for an ACK to the request sent with cmn, while
+ * part way through sending it.  wait gets the time the ACK asks for.
+ */
+int ESPSyncMaster::RX_Ack(uint8_t cmn, uint32_t timeout, uint32_t *wait)
+{
+    uint32_t deadline = now_ms() + timeout;
+    uint8_t  header[8];
+    uint32_t size;
+
+    for (;;) {
+        if (RX_Header(header, deadline) != MASTER_OK) {
+            return MASTER_TIMEOUT;
+        }
+        size = (header[3] << 16) | (header[4] << 8) | header[5];
+        if ((header[2] != ACK) && (header[2] != NAK)) {
+            RX_Body(size, CSUM_For(header[2]), NULL);
+        }
+        if (header[1] == RX_CMN(cmn)) {
+            break;
+        }
+    }
+
+    if (header[2] == NAK) {
+        return (size >> 16);
+    }
+    if (header[2] != ACK) {
+        return MASTER_BADREPLY;
+    }
+    *wait = (size >> 8) + 1;
+    return MASTER_OK;
+}
+
+/**
+ * Wait for the reply to the last request sent.
+ */
+int ESPSyncMaster::RX_Reply(uint8_t func, std::vector<uint8_t> *body)
+{
+    return RX_For(_sent, func, body);
+}
+
+/**
+ * Wait for the reply to the oldest outstanding request.
+ * The slave handles requests in order, so replies come in order, but
+ * each is still matched to its request by CMN.
+ */
+int ESPSyncMaster::RX_Oldest(void)
+{
+    outstanding_t want = _outstanding.front();
+    int rc;
+
+    _outstanding.pop_front();
+    rc = RX_For(want.cmn, want.func, NULL);
+    if ((rc != MASTER_OK) && (_queued_rc == MASTER_OK)) {
+        _queued_rc = rc;
+    }
+    return rc;
+}
+
+int ESPSyncMaster::drain(void)
+{
+    while (!_outstanding.empty()) {
+        RX_Oldest();
+    }
+    int rc = _queued_rc;
+    _queued_rc = MASTER_OK;
+    if (rc == MASTER_OK) {
+        rc = TX_Renew();
+    }
+    return rc;
+}
+
+int ESPSyncMaster::session(uint8_t window, uint8_t csums)
+{
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    _asked = window;
+    _offered = csums;
+    return TX_Session();
+}
+
+/**
+ * The slave goes back to Adler-32 once it has gone ESPSYNC_SESSION_IDLE
+ * ms without a message.  After a pause, agree the checksum again before
+ * the next request, in case it has.
+ */
+int ESPSyncMaster::TX_Renew(void)
+{
+    if ((_csum == CSUM_ADLER32) || ((uint32_t)(now_ms() - _last_tx) < SESSION_RENEW)) {
+        return MASTER_OK;
+    }
+    _csum = CSUM_ADLER32;
+    return TX_Session();
+}
+
+int ESPSyncMaster::TX_Session(void)
+{
+    std::vector<uint8_t> reply;
+    uint8_t body[3] = { 1, _asked, _offered };
+    uint8_t csums = _offered;
+    int rc;
+
+    TX_Message(CMD_SESSION, body, 3);
+    rc = RX_Reply(RPL_SESSION, &reply);
+    if (rc == MASTER_OK) {
+        if ((reply.size() < 2) || (reply[1] == 0)) {
+            return MASTER_BADREPLY;
+        }
+        _window = reply[1];
+        /* Slaves before compression did not send the window bits */
+        if ((reply.size() >= 3) &&
+            (reply[2] >= ESPSYNC_LZ_MIN_BITS) && (reply[2] <= ESPSYNC_LZ_MAX_BITS)) {
+            _lzbits = reply[2];
+        }
+        /* Nor the checksum, they only have Adler-32 */
+        _csum = CSUM_ADLER32;
+        if ((reply.size() >= 4) && (reply[3] < CSUM_ALGORITHMS) &&
+            (csums & (1 << reply[3]))) {
+            _csum = reply[3];
+        }
+        /* Nor what its filesystem can do */
+        _fscaps = (reply.size() >= 5) ? reply[4] : 0;
+    }
+    return rc;
+}
+
+int ESPSyncMaster::setBaud(uint32_t baud)
+{
+    std::vector<uint8_t> reply;
+    uint8_t body[4 + BAUD_PATTERN];
+    uint32_t old = _line;
+    uint32_t confirm;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+
+    body[0] = baud >> 24;
+    body[1] = baud >> 16;
+    body[2] = baud >> 8;
+    body[3] = baud;
+    TX_Message(CMD_BAUD, body, 4);
+    if ((rc = RX_Reply(RPL_BAUD, &reply)) != MASTER_OK) {
+        return rc;
+    }
+    if ((reply.size() < 6) || (((uint32_t)(reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3]) != baud)) {
+        return MASTER_BADREPLY;
+    }
+    confirm = (reply[4] << 8) | reply[5];
+
+    if (!posix_set_baud(_fd, baud)) {
+        /* The slave goes back by itself, once the confirm time is up */
+        usleep((confirm + 50) * 1000);
+        return MASTER_BADREPLY;
+    }
+    _line = baud;
+    if (_baud != 0) {
+        _baud = baud;
+    }
+
+    /* Every bit pattern a marginal line tends to get wrong */
+    for (uint32_t x = 0; x < BAUD_PATTERN; x++) {
+        static const uint8_t pattern[4] = { 0x55, 0xAA, 0x00, 0xFF };
+        body[4 + x] = pattern[x % 4] ^ ((x / 4) & 0x0F);
+    }
+    uint32_t timeout = _timeout;
+    if (_timeout > confirm) {
+        _timeout = confirm;
+    }
+    TX_Message(CMD_BAUD, body, sizeof(body));
+    rc = RX_Reply(RPL_BAUD, &reply);
+    _timeout = timeout;
+    if ((rc == MASTER_OK) &&
+        ((reply.size() != sizeof(body)) || (memcmp(reply.data(), body, sizeof(body)) != 0))) {
+        rc = MASTER_BADREPLY;
+    }
+
+    if (rc != MASTER_OK) {
+        /* Wait for the slave to give up on the new rate, then go back too */
+        usleep((confirm + 50) * 1000);
+        posix_set_baud(_fd, old);
+        _line = old;
+        if (_baud != 0) {
+            _baud = old;
+        }
+        _rxhead = _rxlen = 0;
+        if (ping() != MASTER_OK) {
+            return MASTER_TIMEOUT;
+        }
+        if (rc <= MASTER_OK) {
+            rc = MASTER_BADREPLY;
+        }
+    }
+    return rc;
+}
+
+int ESPSyncMaster::probeBaud(const uint32_t *rates, uint8_t count, uint32_t *chosen)
+{
+    int rc = MASTER_BADREPLY;
+
+    for (uint8_t x = 0; x < count; x++) {
+        rc = setBaud(rates[x]);
+        if (rc == MASTER_OK) {
+            *chosen = rates[x];
+            break;
+        }
+        if (rc == MASTER_TIMEOUT) {
+            /* Lost the slave even at the old rate, no point going on */
+            break;
+        }
+    }
+    return rc;
+}
+
+int ESPSyncMaster::stats(bool reset, ESPSyncStats *stats)
+{
+    std::vector<uint8_t> reply;
+    uint8_t opt = reset ? 0x01 : 0x00;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    TX_Message(CMD_STATS, &opt, 1);
+    if ((rc = RX_Reply(RPL_STATS, &reply)) != MASTER_OK) {
+        return rc;
+    }
+    if ((reply.size() != 2 + sizeof(ESPSyncStats)) ||
+        (reply[0] != ESPSYNC_STATS_BUCKETS) || (reply[1] != ESPSYNC_STATS_COMMANDS)) {
+        return MASTER_BADREPLY;
+    }
+    uint32_t *words = (uint32_t*)stats;
+    for (uint32_t x = 0; x < ESPSYNC_STATS_WORDS; x++) {
+        const uint8_t *w = &reply[2 + (x * 4)];
+        words[x] = ((uint32_t)w[0] << 24) | (w[1] << 16) | (w[2] << 8) | w[3];
+    }
+    return MASTER_OK;
+}
+
+uint8_t ESPSyncMaster::window(void)
+{
+    return _window;
+}
+
+uint8_t ESPSyncMaster::csum(void)
+{
+    return _csum;
+}
+
+uint8_t ESPSyncMaster::fsCaps(void)
+{
+    return _fscaps;
+}
+
+int ESPSyncMaster::ping(void)
+{
+    uint8_t header[8];
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+
+    /* The reply to a ping is an ACK, so it can't go through RX_Reply */
+    TX_Header(ACK, 0x00005A);
+    uint32_t deadline = now_ms() + _timeout;
+    do {
+        if (RX_Header(header, deadline) != MASTER_OK) {
+            return MASTER_TIMEOUT;
+        }
+    } while (header[1] != RX_CMN(_sent));
+    return (header[2] == ACK) ? MASTER_OK : MASTER_BADREPLY;
+}
+
+int ESPSyncMaster::setTime(const uint8_t date[6])
+{
+    int rc;
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    TX_Message(CMD_SET_TIME, date, 6);
+    return RX_Reply(RPL_TIME_SET, NULL);
+}
+
+int ESPSyncMaster::format(void)
+{
+    int rc;
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    TX_Header(CMD_FORMAT, 0);
+    return RX_Reply(RPL_FORMATED, NULL);
+}
+
+int ESPSyncMaster::list(uint8_t options, std::vector<uint8_t> *listing)
+{
+    int rc;
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    TX_Message(CMD_LIST, &options, 1);
+    return RX_Reply(RPL_LISTING, listing);
+}
+
+int ESPSyncMaster::remove(const char *name)
+{
+    int rc;
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    TX_Message(CMD_REMOVE, (const uint8_t*)name, strlen(name));
+    return RX_Reply(RPL_REMOVED, NULL);
+}
+
+int ESPSyncMaster::rename(const char *from, const char *to)
+{
+    std::vector<uint8_t> body;
+    int rc;
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    body.push_back(strlen(from));
+    body.insert(body.end(), from, from+strlen(from));
+    body.push_back(strlen(to));
+    body.insert(body.end(), to, to+strlen(to));
+
+    TX_Message(CMD_RENAME, body.data(), body.size());
+    return RX_Reply(RPL_RENAMED, NULL);
+}
+
+/**
+ * Send a whole File message, but do not wait for the reply.  From an
+ * offset, it is a Continue message with the rest of the file.
+ */
+void ESPSyncMaster::TX_File(const char *name, const uint8_t *data, uint32_t length,
+                            uint32_t offset)
+{
+    static const uint8_t date[6] = { 1, 1, 0, 0, 0, 0 };
+    std::vector<uint8_t> head;
+
+    head.push_back(strlen(name));
+    head.insert(head.end(), name, name+strlen(name));
+    head.insert(head.end(), date, date+6);
+    if (offset > 0) {
+        uint32_t fchk = adler32_update(ADLER32_INIT, data, length);
+        head.push_back(offset >> 24);
+        head.push_back((offset >> 16) & 0xFF);
+        head.push_back((offset >> 8) & 0xFF);
+        head.push_back(offset & 0xFF);
+        head.push_back(fchk >> 24);
+        head.push_back((fchk >> 16) & 0xFF);
+        head.push_back((fchk >> 8) & 0xFF);
+        head.push_back(fchk & 0xFF);
+        data += offset;
+        length -= offset;
+    }
+
+    uint32_t csum = adler32_update(ADLER32_INIT, head.data(), head.size());
+    csum = adler32_update(csum, data, length);
+    uint8_t chk[4] = { (uint8_t)(csum >> 24), (uint8_t)(csum >> 16),
+                       (uint8_t)(csum >> 8),  (uint8_t)csum };
+
+    if (_fault == MASTER_FAULT_CHKSUM) {
+        chk[3] ^= 0xFF;
+    }
+
+    TX_Header((offset > 0) ? CMD_CONTINUE : CMD_FILE, head.size() + length + 4);
+    TX_Raw(head.data(), head.size());
+    if (_fault == MASTER_FAULT_TRUNCATE) {
+        TX_Raw(data, length / 2);
+    } else {
+        TX_Raw(data, length);
+        TX_Raw(chk, 4);
+    }
+    _fault = MASTER_FAULT_NONE;
+}
+
+int ESPSyncMaster::putFile(const char *name, const uint8_t *data, uint32_t length)
+{
+    int rc;
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    TX_File(name, data, length);
+    return RX_Reply(RPL_RECEIVED, NULL);
+}
+
+int ESPSyncMaster::getFile(const char *name, uint32_t offset, uint32_t length,
+                           std::vector<uint8_t> *data, uint32_t *size)
+{
+    std::vector<uint8_t> req(8 + strlen(name));
+    std::vector<uint8_t> reply;
+    uint32_t fsize, at;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    data->clear();
+    do {
+        req[0] = offset >> 24; req[1] = offset >> 16; req[2] = offset >> 8; req[3] = offset;
+        req[4] = length >> 24; req[5] = length >> 16; req[6] = length >> 8; req[7] = length;
+        memcpy(&req[8], name, strlen(name));
+        TX_Message(CMD_GET, req.data(), req.size());
+        if ((rc = RX_Reply(RPL_FILE, &reply)) != MASTER_OK) {
+            return rc;
+        }
+        if (reply.size() < 8) {
+            return MASTER_BADREPLY;
+        }
+        fsize = (reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3];
+        at    = (reply[4] << 24) | (reply[5] << 16) | (reply[6] << 8) | reply[7];
+        if ((at != offset) && (reply.size() > 8)) {
+            return MASTER_BADREPLY;
+        }
+        data->insert(data->end(), reply.begin() + 8, reply.end());
+        offset += reply.size() - 8;
+        if (length != 0xFFFFFFFF) {
+            length -= reply.size() - 8;
+        }
+        /* One reply is up to 16MB, ask again for the rest */
+    } while ((reply.size() > 8) && (length > 0) && (offset < fsize));
+
+    if (size != NULL) {
+        *size = fsize;
+    }
+    return MASTER_OK;
+}
+
+int ESPSyncMaster::resumable(const char *name, uint32_t *offset, uint32_t *total,
+                             uint32_t *csum)
+{
+    std::vector<uint8_t> reply;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    TX_Message(CMD_RESUME, (const uint8_t*)name, strlen(name));
+    if ((rc = RX_Reply(RPL_RESUME, &reply)) != MASTER_OK) {
+        return rc;
+    }
+    if (reply.size() != 12) {
+        return MASTER_BADREPLY;
+    }
+    *offset = (reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3];
+    *total  = (reply[4] << 24) | (reply[5] << 16) | (reply[6] << 8) | reply[7];
+    *csum   = (reply[8] << 24) | (reply[9] << 16) | (reply[10] << 8) | reply[11];
+    return MASTER_OK;
+}
+
+int ESPSyncMaster::putFileResume(const char *name, const uint8_t *data, uint32_t length,
+                                 uint32_t *offset)
+{
+    uint32_t kept = 0, total = 0, csum = 0;
+    int rc = resumable(name, &kept, &total, &csum);
+
+    if (offset != NULL) {
+        *offset = 0;
+    }
+    if (rc < MASTER_OK) {
+        return rc;
+    }
+
+    /* Only continue if what was kept is the start of this data */
+    if ((rc == MASTER_OK) && (total == length) && (kept > 0) && (kept <= length) &&
+        (adler32_update(ADLER32_INIT, data, kept) == csum)) {
+        TX_File(name, data, length, kept);
+        rc = RX_Reply(RPL_RECEIVED, NULL);
+        if ((rc <= MASTER_OK) || (rc == NAK_TIMEOUT)) {
+            if (offset != NULL) {
+                *offset = kept;
+            }
+            return rc;
+        }
+        /* Otherwise the slave would not continue it, so start again */
+    }
+    return putFile(name, data, length);
+}
+
+/**
+ * Send one chunk, but do not wait for the reply.
+ */
+void ESPSyncMaster::TX_Chunk(uint32_t offset, const uint8_t *data, uint32_t length)
+{
+    uint8_t head[4] = { (uint8_t)(offset >> 24), (uint8_t)(offset >> 16),
+                        (uint8_t)(offset >> 8),  (uint8_t)offset };
+    uint32_t csum = adler32_update(adler32_update(ADLER32_INIT, head, 4), data, length);
+    uint8_t  chk[4] = { (uint8_t)(csum >> 24), (uint8_t)(csum >> 16),
+                        (uint8_t)(csum >> 8),  (uint8_t)csum };
+
+    TX_Header(CMD_CHUNK, 4 + length + 4);
+    TX_Raw(head, 4);
+    TX_Raw(data, length);
+    TX_Raw(chk, 4);
+}
+
+int ESPSyncMaster::putFileChunked(const char *name, const uint8_t *data, uint32_t length,
+                                  uint16_t chunk, uint32_t *resent)
+{
+    static const uint8_t date[6] = { 1, 1, 0, 0, 0, 0 };
+    typedef struct {
+        uint8_t  cmn;
+        uint32_t end;   /* Offset after the chunk */
+    } inflight_t;
+    std::deque<inflight_t> flight;
+    std::vector<uint8_t> body, reply;
+    uint32_t fchk = adler32_update(ADLER32_INIT, data, length);
+    uint32_t offset = 0, csum, acked, next;
+    uint16_t csize = 0;
+    uint8_t  failures = 0;
+    int rc;
+
+    if (resent != NULL) {
+        *resent = 0;
+    }
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    if ((length == 0) || (chunk == 0)) {
+        return putFile(name, data, length);
+    }
+
+    /* Start it, or carry on with what the slave kept if it is the start of data */
+    for (uint8_t flags = 0; ; flags = CHUNKED_RESTART) {
+        body.clear();
+        body.push_back(strlen(name));
+        body.insert(body.end(), name, name+strlen(name));
+        body.insert(body.end(), date, date+6);
+        body.push_back(length >> 24);
+        body.push_back((length >> 16) & 0xFF);
+        body.push_back((length >> 8) & 0xFF);
+        body.push_back(length & 0xFF);
+        body.push_back(fchk >> 24);
+        body.push_back((fchk >> 16) & 0xFF);
+        body.push_back((fchk >> 8) & 0xFF);
+        body.push_back(fchk & 0xFF);
+        body.push_back(chunk >> 8);
+        body.push_back(chunk & 0xFF);
+        body.push_back(flags);
+
+        TX_Message(CMD_CHUNKED, body.data(), body.size());
+        if ((rc = RX_Reply(RPL_CHUNKED, &reply)) != MASTER_OK) {
+            return rc;
+        }
+        if (reply.size() != 10) {
+            return MASTER_BADREPLY;
+        }
+        csize  = (reply[0] << 8) | reply[1];
+        offset = (reply[2] << 24) | (reply[3] << 16) | (reply[4] << 8) | reply[5];
+        csum   = (reply[6] << 24) | (reply[7] << 16) | (reply[8] << 8) | reply[9];
+        if ((csize == 0) || (offset > length)) {
+            return MASTER_BADREPLY;
+        }
+        if ((offset == 0) || (adler32_update(ADLER32_INIT, data, offset) == csum)) {
+            break;
+        }
+        if (flags != 0) {
+            return MASTER_BADREPLY;
+        }
+    }
+
+    /**
+     * Go back N.  Up to a window of chunks are in flight, the slave only
+     * takes the next one, so after one is lost or NAK'd, it and every
+     * chunk sent after it are sent again.
+     */
+    acked = next = offset;
+    while (acked < length) {
+        while ((next < length) && (flight.size() < _window)) {
+            uint32_t n = ((length - next) < csize) ? (length - next) : csize;
+            TX_Chunk(next, data + next, n);
+            flight.push_back({ _sent, next + n });
+            next += n;
+        }
+
+        inflight_t c = flight.front();
+        flight.pop_front();
+        rc = RX_For(c.cmn, RPL_CHUNK, &reply);
+        if ((rc == MASTER_OK) && (reply.size() != 4)) {
+            rc = MASTER_BADREPLY;
+        }
+        if (rc == MASTER_OK) {
+            uint32_t want = (reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3];
+            if (want == c.end) {
+                acked = want;
+                failures = 0;
+                continue;
+            }
+            if ((want > acked) && (want <= length)) {
+                acked = want;
+            }
+        } else if ((rc > MASTER_OK) && (rc != NAK_CHKSUM)) {
+            /* Not a damaged chunk, the upload itself has failed */
+            failures = CHUNK_RETRIES;
+        }
+
+        /* Wait out the rest of the window, sent after the one that failed */
+        while (!flight.empty()) {
+            if (RX_For(flight.front().cmn, RPL_CHUNK, &reply) == MASTER_OK) {
+                uint32_t want = (reply.size() == 4) ?
+                    ((reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3]) : 0;
+                if ((want > acked) && (want <= length)) {
+                    acked = want;
+                }
+            }
+            flight.pop_front();
+        }
+        if (++failures > CHUNK_RETRIES) {
+            return (rc == MASTER_OK) ? MASTER_BADREPLY : rc;
+        }
+        if (resent != NULL) {
+            *resent += next - acked;
+        }
+        next = acked;
+    }
+    return MASTER_OK;
+}
+
+int ESPSyncMaster::putBatch(const ESPSyncMasterFile *files, uint8_t count, uint8_t *status)
+{
+    static const uint8_t date[6] = { 1, 1, 0, 0, 0, 0 };
+    std::vector<uint8_t> body, reply;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+
+    for (uint8_t x = 0; x < count; x++) {
+        size_t   start = body.size();
+        uint32_t length = files[x].length;
+
+        body.push_back(strlen(files[x].name));
+        body.insert(body.end(), files[x].name, files[x].name + strlen(files[x].name));
+        body.insert(body.end(), date, date+6);
+        body.push_back(length >> 24);
+        body.push_back((length >> 16) & 0xFF);
+        body.push_back((length >> 8) & 0xFF);
+        body.push_back(length & 0xFF);
+        body.insert(body.end(), files[x].data, files[x].data + length);
+
+        uint32_t rchk = adler32_update(ADLER32_INIT, &body[start], body.size() - start);
+        if ((x == 0) && (_fault == MASTER_FAULT_CHKSUM)) {
+            rchk ^= 0xFF;
+        }
+        body.push_back(rchk >> 24);
+        body.push_back((rchk >> 16) & 0xFF);
+        body.push_back((rchk >> 8) & 0xFF);
+        body.push_back(rchk & 0xFF);
+    }
+    _fault = MASTER_FAULT_NONE;
+
+    TX_Message(CMD_BATCH, body.data(), body.size());
+    rc = RX_Reply(RPL_BATCH, &reply);
+    if (rc != MASTER_OK) {
+        return rc;
+    }
+    if ((reply.size() != 9u + count) || (reply[8] != count)) {
+        return MASTER_BADREPLY;
+    }
+    memcpy(status, &reply[9], count);
+    return MASTER_OK;
+}
+
+int ESPSyncMaster::queueFile(const char *name, const uint8_t *data, uint32_t length)
+{
+    outstanding_t sent;
+    int rc;
+
+    while (_outstanding.size() >= _window) {
+        RX_Oldest();
+    }
+    if (_outstanding.empty() && ((rc = TX_Renew()) != MASTER_OK)) {
+        return rc;
+    }
+    TX_File(name, data, length);
+
+    sent.cmn  = _sent;
+    sent.func = RPL_RECEIVED;
+    _outstanding.push_back(sent);
+    return _queued_rc;
+}
+
+int ESPSyncMaster::hash(const char **prefixes, uint8_t count, uint8_t options,
+                        uint32_t *files, uint32_t *hashes)
+{
+    std::vector<uint8_t> body, reply;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    body.push_back(options);
+    for (uint8_t x = 0; x < count; x++) {
+        body.push_back(strlen(prefixes[x]));
+        body.insert(body.end(), prefixes[x], prefixes[x]+strlen(prefixes[x]));
+    }
+
+    TX_Message(CMD_HASH, body.data(), body.size());
+    rc = RX_Reply(RPL_HASH, &reply);
+    if (rc != MASTER_OK) {
+        return rc;
+    }
+    if (reply.size() != (count + 1) * 8u) {
+        return MASTER_BADREPLY;
+    }
+    for (uint8_t x = 0; x <= count; x++) {
+        const uint8_t *r = &reply[x * 8];
+        files[x]  = (r[0] << 24) | (r[1] << 16) | (r[2] << 8) | r[3];
+        hashes[x] = (r[4] << 24) | (r[5] << 16) | (r[6] << 8) | r[7];
+    }
+    return MASTER_OK;
+}
+
+int ESPSyncMaster::signature(const char *name, uint16_t block,
+                             std::vector<uint32_t> *sums, uint32_t *size)
+{
+    std::vector<uint8_t> body, reply;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    body.push_back(block >> 8);
+    body.push_back(block & 0xFF);
+    body.insert(body.end(), name, name+strlen(name));
+
+    TX_Message(CMD_SIGNATURE, body.data(), body.size());
+    rc = RX_Reply(RPL_SIGNATURE, &reply);
+    if (rc != MASTER_OK) {
+        return rc;
+    }
+    if ((reply.size() < 6) || (((reply.size() - 6) % 8) != 0)) {
+        return MASTER_BADREPLY;
+    }
+
+    *size = (reply[0] << 24) | (reply[1] << 16) | (reply[2] << 8) | reply[3];
+    sums->clear();
+    for (size_t x = 6; x < reply.size(); x += 4) {
+        sums->push_back((reply[x] << 24) | (reply[x+1] << 16) |
+                        (reply[x+2] << 8) | reply[x+3]);
+    }
+    return MASTER_OK;
+}
+
+static void delta_literal(std::vector<uint8_t> *ops, const uint8_t *data, uint32_t length)
+{
+    while (length > 0) {
+        uint32_t n = (length > 0xFFFF) ? 0xFFFF : length;
+        ops->push_back(DELTA_OP_LITERAL);
+        ops->push_back(n >> 8);
+        ops->push_back(n & 0xFF);
+        ops->insert(ops->end(), data, data + n);
+        data += n;
+        length -= n;
+    }
+}
+
+/**
+ * Add a COPY of one block, run on to the last op if that was a COPY
+ * of the block before.  last is the offset of the last COPY in ops,
+ * or ops->size() when the last op was not one.
+ */
+static void delta_copy(std::vector<uint8_t> *ops, uint32_t index, size_t *last)
+{
+    if (*last < ops->size()) {
+        uint8_t *op = ops->data() + *last;
+        uint32_t first = (op[1] << 24) | (op[2] << 16) | (op[3] << 8) | op[4];
+        uint32_t count = (op[5] << 8) | op[6];
+        if ((first + count == index) && (count < 0xFFFF)) {
+            count++;
+            op[5] = count >> 8;
+            op[6] = count & 0xFF;
+            return;
+        }
+    }
+    *last = ops->size();
+    ops->push_back(DELTA_OP_COPY);
+    ops->push_back(index >> 24);
+    ops->push_back((index >> 16) & 0xFF);
+    ops->push_back((index >> 8) & 0xFF);
+    ops->push_back(index & 0xFF);
+    ops->push_back(0);
+    ops->push_back(1);
+}
+
+/**
+ * Work out the ops that rebuild data from a base with the given block
+ * sums, rsync style.  The weak sum is rolled along data a byte at a
+ * time, and only a weak match has its strong sum checked.
+ */
+static void delta_encode(const uint8_t *data, uint32_t length,
+                         const std::vector<uint32_t> &sums, uint32_t bsize,
+                         uint16_t block, std::vector<uint8_t> *ops)
+{
+    std::unordered_multimap<uint32_t, uint32_t> weak;
+    uint32_t blocks = sums.size() / 2;
+    uint32_t tail   = bsize % block; /* Length of a short last block */
+    uint32_t full   = bsize / block;
+    uint32_t pos = 0, lit = 0;
+    uint32_t a = 0, b = 0;
+    bool     rolling = false;
+    size_t   last;
+
+    for (uint32_t x = 0; x < full; x++) {
+        weak.insert(std::make_pair(sums[x*2], x));
+    }
+    ops->clear();
+    last = ops->size();
+
+    while ((block <= length) && (pos <= length - block)) {
+        if (!rolling) {
+            uint32_t s = adler32_update(ADLER32_INIT, data + pos, block);
+            a = s & 0xFFFF;
+            b = s >> 16;
+            rolling = true;
+        }
+
+        auto range = weak.equal_range((b << 16) | a);
+        if (range.first != range.second) {
+            uint32_t strong = crc32_update(CRC32_INIT, data + pos, block);
+            bool     found = false;
+            for (auto m = range.first; m != range.second; ++m) {
+                if (sums[(m->second * 2) + 1] == strong) {
+                    if (pos > lit) {
+                        delta_literal(ops, data + lit, pos - lit);
+                        last = ops->size();
+                    }
+                    delta_copy(ops, m->second, &last);
+                    pos += block;
+                    lit = pos;
+                    rolling = false;
+                    found = true;
+                    break;
+                }
+            }
+            if (found) {
+                continue;
+            }
+        }
+
+        /* Roll the window on a byte */
+        if (pos + block < length) {
+            int64_t out = data[pos];
+            int64_t in  = data[pos + block];
+            int64_t na  = ((int64_t)a - out + in) % ADLER_MOD;
+            if (na < 0) {
+                na += ADLER_MOD;
+            }
+            int64_t nb  = ((int64_t)b - ((block * out) % ADLER_MOD) + na - 1) % ADLER_MOD;
+            if (nb < 0) {
+                nb += ADLER_MOD;
+            }
+            a = na;
+            b = nb;
+        }
+        pos++;
+    }
+
+    /* The short last block of the base can only match the end of data */
+    if ((tail > 0) && (blocks == full + 1) && (length >= tail) &&
+        (length - tail >= lit) &&
+        (adler32_update(ADLER32_INIT, data + length - tail, tail) == sums[full*2]) &&
+        (crc32_update(CRC32_INIT, data + length - tail, tail) == sums[(full*2)+1])) {
+        if (length - tail > lit) {
+            delta_literal(ops, data + lit, length - tail - lit);
+            last = ops->size();
+        }
+        delta_copy(ops, full, &last);
+        lit = length;
+    }
+
+    if (length > lit) {
+        delta_literal(ops, data + lit, length - lit);
+    }
+}
+
+int ESPSyncMaster::putDelta(const char *name, const uint8_t *data, uint32_t length,
+                            const char *base, uint16_t block)
+{
+    static const uint8_t date[6] = { 1, 1, 0, 0, 0, 0 };
+    std::vector<uint32_t> sums;
+    std::vector<uint8_t>  body, ops;
+    uint32_t bsize;
+    int rc;
+
+    rc = signature(base, block, &sums, &bsize);
+    if (rc == NAK_FNOTF) {
+        return putFile(name, data, length);
+    }
+    if (rc != MASTER_OK) {
+        return rc;
+    }
+
+    delta_encode(data, length, sums, bsize, block, &ops);
+
+    uint32_t fcsum = adler32_update(ADLER32_INIT, data, length);
+    body.push_back(strlen(name));
+    body.insert(body.end(), name, name+strlen(name));
+    body.insert(body.end(), date, date+6);
+    body.push_back(block >> 8);
+    body.push_back(block & 0xFF);
+    body.push_back(fcsum >> 24);
+    body.push_back((fcsum >> 16) & 0xFF);
+    body.push_back((fcsum >> 8) & 0xFF);
+    body.push_back(fcsum & 0xFF);
+    body.push_back(strlen(base));
+    body.insert(body.end(), base, base+strlen(base));
+    size_t from = 0;
+    size_t at = body.size();
+    body.insert(body.end(), ops.begin(), ops.end());
+
+    uint32_t csum = adler32_update(ADLER32_INIT, body.data(), body.size());
+    uint8_t chk[4] = { (uint8_t)(csum >> 24), (uint8_t)(csum >> 16),
+                       (uint8_t)(csum >> 8),  (uint8_t)csum };
+
+    /**
+     * The slave does not read the line while it copies the blocks of a
+     * COPY, so stop after each one, until it ACKs that it has started
+     * and, with however long it asked for, that it is done.
+     */
+    TX_Header(CMD_DELTA, body.size() + 4);
+    while (at < body.size()) {
+        if (body[at] != DELTA_OP_COPY) {
+            at += 3 + ((body[at+1] << 8) | body[at+2]);
+            continue;
+        }
+        at += 7;
+        TX_Raw(body.data() + from, at - from);
+        from = at;
+
+        uint32_t wait = 0;
+        rc = RX_Ack(_sent, _timeout, &wait);
+        if (rc == MASTER_OK) {
+            rc = RX_Ack(_sent, wait, &wait);
+        }
+        if (rc > MASTER_OK) {
+            /* The slave throws away the rest of a NAK'd message */
+            TX_Raw(body.data() + from, body.size() - from);
+            TX_Raw(chk, 4);
+        }
+        if (rc != MASTER_OK) {
+            return rc;
+        }
+    }
+    TX_Raw(body.data() + from, body.size() - from);
+    TX_Raw(chk, 4);
+    return RX_Reply(RPL_RECEIVED, NULL);
+}
+
+int ESPSyncMaster::putCopy(const char *name, const uint8_t *data, uint32_t length,
+                           const char *source)
+{
+    static const uint8_t date[6] = { 1, 1, 0, 0, 0, 0 };
+    std::vector<uint8_t> body;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+
+    uint32_t fcsum = adler32_update(ADLER32_INIT, data, length);
+    body.push_back(strlen(name));
+    body.insert(body.end(), name, name+strlen(name));
+    body.insert(body.end(), date, date+6);
+    body.push_back(fcsum >> 24);
+    body.push_back((fcsum >> 16) & 0xFF);
+    body.push_back((fcsum >> 8) & 0xFF);
+    body.push_back(fcsum & 0xFF);
+    body.push_back(strlen(source));
+    body.insert(body.end(), source, source+strlen(source));
+
+    TX_Message(CMD_COPY, body.data(), body.size());
+    rc = RX_Reply(RPL_RECEIVED, NULL);
+    if ((rc == NAK_FNOTF) || (rc == NAK_CHKSUM)) {
+        /* Not there, or not the same, after all */
+        return putFile(name, data, length);
+    }
+    return rc;
+}
+
+static uint32_t lz_hash(const uint8_t *data)
+{
+    uint32_t v = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Compress data into the ESPSyncLZ format, never referring back more
+ * than 2^bits bytes.  Greedy, taking the longest of the last few
+ * matches with the same hash.
+ */
+static void lz_compress(const uint8_t *data, uint32_t length, uint8_t bits,
+                        std::vector<uint8_t> *out)
+{
+    std::vector<int32_t> head(1 << LZ_HASH_BITS, -1);
+    std::vector<int32_t> prev(length, -1);
+    uint32_t window = 1 << bits;
+    size_t   flagpos = 0;
+    uint8_t  nflags = 8;
+    uint32_t pos = 0;
+
+    out->clear();
+    while (pos < length) {
+        uint32_t best = 0;
+        uint32_t boff = 0;
+
+        if (pos + LZ_MIN_MATCH <= length) {
+            uint32_t limit = length - pos;
+            int32_t  cand  = head[lz_hash(data + pos)];
+            if (limit > LZ_MAX_MATCH) {
+                limit = LZ_MAX_MATCH;
+            }
+            for (uint32_t chain = 0; (cand >= 0) && (pos - cand <= window) &&
+                                     (chain < LZ_MAX_CHAIN); chain++) {
+                uint32_t len = 0;
+                while ((len < limit) && (data[cand + len] == data[pos + len])) {
+                    len++;
+                }
+                if (len > best) {
+                    best = len;
+                    boff = pos - cand;
+                    if (len == limit) {
+                        break;
+                    }
+                }
+                cand = prev[cand];
+            }
+        }
+
+        if (nflags == 8) {
+            flagpos = out->size();
+            out->push_back(0);
+            nflags = 0;
+        }
+        if (best >= LZ_MIN_MATCH) {
+            uint32_t l = best - LZ_MIN_MATCH;
+            uint32_t o = boff - 1;
+            (*out)[flagpos] |= 1 << nflags;
+            if (l >= 15) {
+                out->push_back(0xF0 | (o >> 8));
+                out->push_back(o & 0xFF);
+                out->push_back(l - 15);
+            } else {
+                out->push_back((l << 4) | (o >> 8));
+                out->push_back(o & 0xFF);
+            }
+        } else {
+            out->push_back(data[pos]);
+            best = 1;
+        }
+        nflags++;
+
+        for (uint32_t x = 0; x < best; x++, pos++) {
+            if (pos + LZ_MIN_MATCH <= length) {
+                uint32_t h = lz_hash(data + pos);
+                prev[pos] = head[h];
+                head[h] = pos;
+            }
+        }
+    }
+}
+
+int ESPSyncMaster::putFileLZ(const char *name, const uint8_t *data, uint32_t length,
+                             bool store)
+{
+    static const uint8_t date[6] = { 1, 1, 0, 0, 0, 0 };
+    std::vector<uint8_t> head, packed;
+    int rc;
+
+    if ((rc = drain()) != MASTER_OK) {
+        return rc;
+    }
+    lz_compress(data, length, _lzbits, &packed);
+
+    head.push_back(strlen(name));
+    head.insert(head.end(), name, name+strlen(name));
+    head.insert(head.end(), date, date+6);
+    head.push_back(store ? LZ_FLAG_STORE : 0);
+    head.push_back(_lzbits);
+    head.push_back(length >> 24);
+    head.push_back((length >> 16) & 0xFF);
+    head.push_back((length >> 8) & 0xFF);
+    head.push_back(length & 0xFF);
+
+    /* The checksum is of the file, not what is sent */
+    uint32_t csum = adler32_update(ADLER32_INIT, head.data(), head.size());
+    csum = adler32_update(csum, data, length);
+    uint8_t chk[4] = { (uint8_t)(csum >> 24), (uint8_t)(csum >> 16),
+                       (uint8_t)(csum >> 8),  (uint8_t)csum };
+
+    TX_Header(CMD_FILE_LZ, head.size() + packed.size() + 4);
+    TX_Raw(head.data(), head.size());
+    TX_Raw(packed.data(), packed.size());
+    TX_Raw(chk, 4);
+    return RX_Reply(RPL_RECEIVED, NULL);
+}
@@ -0,0 +1,272 @@
+/**
+ *  ESP Sync host build, protocol master
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCMASTER_H_
+#define __ESPSYNCMASTER_H_
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+#include "ESPSyncStats.h"
+#include "ESPSyncChecksum.h"
+
+/* Results, any positive result is the NAK code the slave replied with */
+#define MASTER_OK       (0)
+#define MASTER_TIMEOUT  (-1)
+#define MASTER_BADREPLY (-2)
+
+/* Faults that can be injected into the next upload, to test the slave */
+#define MASTER_FAULT_NONE     (0)
+#define MASTER_FAULT_CHKSUM   (1) /* Send a wrong CHK2 */
+#define MASTER_FAULT_TRUNCATE (2) /* Stop half way through the data */
+
+/* A file to send in a batch */
+typedef struct {
+    const char    *name;
+    const uint8_t *data;
+    uint32_t       length;
+} ESPSyncMasterFile;
+
+/**
+ * The master end of the protocol, the same role as extras/espsync.py.
+ * Used by the host tools to drive the real ESPSync class over a
+ * file descriptor.
+ */
+class ESPSyncMaster
+{
+    public:
+        ESPSyncMaster(int fd);
+
+        void setTimeout(uint32_t timeout);
+        /*
+         * Milliseconds to wait for a reply, before any ACK extends it.
+         */
+
+        void setLineRate(uint32_t baud);
+        /*
+         * Pace transmission as if over a UART at this baud rate,
+         * 10 bits per byte.  0 sends as fast as the descriptor allows.
+         */
+
+        void setFault(int fault);
+        /*
+         * Break the next putFile() or putFileResume() in the given way.
+         */
+
+        int ping(void);
+        int setTime(const uint8_t date[6]);
+        int format(void);
+        int list(uint8_t options, std::vector<uint8_t> *listing);
+        int remove(const char *name);
+        int rename(const char *from, const char *to);
+        int putFile(const char *name, const uint8_t *data, uint32_t length);
+        /*
+         * Each command waits for its reply.
+         * Returns MASTER_OK, a NAK code, or a negative error.
+         * Any queued uploads are drained first.
+         */
+
+        int hash(const char **prefixes, uint8_t count, uint8_t options,
+                 uint32_t *files, uint32_t *hashes);
+        /*
+         * Get the hash of every file on the slave, and of the files
+         * starting with each prefix.  files and hashes get count + 1
+         * results, everything first.  See manifest_hash().
+         */
+
+        int signature(const char *name, uint16_t block,
+                      std::vector<uint32_t> *sums, uint32_t *size);
+        /*
+         * Get the block checksums of a file on the slave.  sums gets
+         * the weak (Adler-32) and strong (CRC-32) sum of each block, in turn.
+         */
+
+        int putDelta(const char *name, const uint8_t *data, uint32_t length,
+                     const char *base, uint16_t block);
+        /*
+         * Upload a file as a delta against base, a file already on the
+         * slave, sending only the blocks of data that base does not have.
+         * base may be name itself.  Falls back to putFile() if base is
+         * not on the slave.
+         */
+
+        int putCopy(const char *name, const uint8_t *data, uint32_t length,
+                    const char *source);
+        /*
+         * Upload a file the slave already has as source, Eg, found by
+         * its checksum in a listing, by having the slave copy source to
+         * name.  Only the names and the checksum of data are sent.
+         * Falls back to putFile() if source is gone, or is not data.
+         */
+
+        int putFileLZ(const char *name, const uint8_t *data, uint32_t length,
+                      bool store = false);
+        /*
+         * Upload a file compressed, with the largest window the slave
+         * reported in its session reply.  With store, the slave keeps it
+         * compressed, see ESPSyncLZ.
+         */
+
+        int putBatch(const ESPSyncMasterFile *files, uint8_t count, uint8_t *status);
+        /*
+         * Upload up to ESPSYNC_BATCH_FILES files in one message.  status
+         * gets the ACK, or NAK code, the slave replied with for each.
+         * MASTER_OK only means the message got through, check status.
+         * A checksum fault breaks the first file's record, not the message.
+         */
+
+        int setBaud(uint32_t baud);
+        /*
+         * Change the line rate, at both ends.  The new rate is only kept
+         * if a test pattern gets through it intact, otherwise both ends
+         * go back to the old rate, and a NAK code or MASTER_BADREPLY is
+         * returned.  MASTER_TIMEOUT means the slave was lost altogether.
+         * Pacing, see setLineRate(), follows the new rate.
+         */
+
+        int probeBaud(const uint32_t *rates, uint8_t count, uint32_t *chosen);
+        /*
+         * Try each rate in turn, fastest first, keeping the first that
+         * works.  chosen gets it.  MASTER_OK if any rate worked.
+         */
+
+        int getFile(const char *name, uint32_t offset, uint32_t length,
+                    std::vector<uint8_t> *data, uint32_t *size = NULL);
+        /*
+         * Download length bytes of name from offset, 0xFFFFFFFF for all of
+         * the rest.  Fewer if the file is shorter, none if offset is at or
+         * past its end.  size gets the size of the whole file, so a log
+         * can be followed by asking from where the last download ended.
+         */
+
+        int resumable(const char *name, uint32_t *offset, uint32_t *total, uint32_t *csum);
+        /*
+         * How much of an interrupted upload of name the slave kept,
+         * the size of the whole file, and the Adler-32 of what was kept.
+         * NAK code 0x25 if it has nothing kept for name.
+         */
+
+        int putFileResume(const char *name, const uint8_t *data, uint32_t length,
+                          uint32_t *offset = NULL);
+        /*
+         * As putFile(), but when the slave kept the start of an upload
+         * of this data, only the rest is sent.  offset gets where the
+         * upload started from, 0 if it was sent whole.
+         */
+
+        int putFileChunked(const char *name, const uint8_t *data, uint32_t length,
+                           uint16_t chunk, uint32_t *resent = NULL);
+        /*
+         * Upload a file in chunks of up to chunk bytes, fewer if the slave
+         * says so.  Each chunk is checked and answered on its own, and up
+         * to window() of them are in flight.  A chunk that is lost or
+         * NAK'd is sent again, with those sent after it.  resent gets the
+         * bytes sent again.  Carries on from an upload the slave kept, if
+         * it is the start of this data.
+         */
+
+        void setNoise(uint32_t oneIn);
+        /*
+         * Damage about one byte in every oneIn sent, to model a noisy
+         * line.  0 turns it off.
+         */
+
+        int stats(bool reset, ESPSyncStats *stats);
+        /*
+         * Get the slave's statistics, then optionally reset them.
+         */
+
+        uint64_t txBytes(void);
+        /*
+         * Bytes sent, in total.
+         */
+
+        int session(uint8_t window, uint8_t csums = (1 << CSUM_ADLER32));
+        /*
+         * Start a session, asking for up to window requests in flight.
+         * The slave may grant fewer, see window().  csums has a bit for
+         * each CSUM_ number the master will use for CHK2, the slave picks
+         * the strongest it also has, see csum().
+         */
+
+        uint8_t window(void);
+        uint8_t csum(void);
+        uint8_t fsCaps(void);
+        /*
+         * What the session agreed, and the ESPSYNC_FS_ flags of the
+         * slave's filesystem, 0 if it did not say.
+         */
+
+        int queueFile(const char *name, const uint8_t *data, uint32_t length);
+        int drain(void);
+        /*
+         * Windowed uploads.  queueFile() sends without waiting for the
+         * reply, unless the window is full, when it first waits for the
+         * oldest.  drain() waits for every reply still outstanding.
+         * Both return the first failure since the last drain().
+         */
+
+    private:
+        int      _fd;
+        uint8_t  _cmn;      /* CMN of the next request */
+        uint8_t  _sent;     /* CMN of the last request sent */
+        uint8_t  _window;
+        uint8_t  _lzbits;
+        uint8_t  _csum;     /* CHK2 the session agreed on, a CSUM_ number */
+        uint8_t  _fscaps;
+        uint8_t  _asked;    /* Window and checksums the session asked for */
+        uint8_t  _offered;
+        uint32_t _last_tx;  /* ms the last message was sent */
+        int      _queued_rc;
+
+        typedef struct {
+            uint8_t cmn;
+            uint8_t func;   /* The reply expected */
+        } outstanding_t;
+        std::deque<outstanding_t> _outstanding;
+        uint32_t _timeout;
+        int      _fault;
+        uint32_t _baud;
+        uint32_t _line;     /* Rate the line is set to, if a tty */
+        uint64_t _tx_bytes;
+        uint32_t _noise;
+        uint32_t _noise_seed;
+
+        uint8_t  _rxbuf[256];
+        uint32_t _rxhead;
+        uint32_t _rxlen;
+
+        void TX_Header(uint8_t func, uint32_t size);
+        void TX_Message(uint8_t func, const uint8_t *data, uint32_t length);
+        void TX_Raw(const uint8_t *data, uint32_t length);
+        int  RX_Byte(uint32_t timeout);
+        int  RX_Header(uint8_t header[8], uint32_t deadline);
+        int  RX_Body(uint32_t size, const ESPSyncCsum *ck, std::vector<uint8_t> *body);
+        const ESPSyncCsum *CSUM_For(uint8_t func);
+        int  TX_Session(void);
+        int  TX_Renew(void);
+        int  RX_For(uint8_t cmn, uint8_t func, std::vector<uint8_t> *body);
+        int  RX_Reply(uint8_t func, std::vector<uint8_t> *body);
+        int  RX_Ack(uint8_t cmn, uint32_t timeout, uint32_t *wait);
+        int  RX_Oldest(void);
+        void TX_File(const char *name, const uint8_t *data, uint32_t length,
+                     uint32_t offset = 0);
+        void TX_Chunk(uint32_t offset, const uint8_t *data, uint32_t length);
+};
+
+#endif
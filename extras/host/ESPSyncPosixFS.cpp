@@ -0,0 +1,395 @@
+/**
+ *  ESP Sync host build, directory backed filesystem
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncPosixFS.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define PRIVATE_DIR "/.espsync"
+
+/**
+ * Total size of all files under a host directory.
+ */
+static uint64_t tree_usage(const char *path)
+{
+    uint64_t used = 0;
+    char child[PATH_MAX];
+    struct stat st;
+    struct dirent *de;
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        if (lstat(child, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            used += tree_usage(child);
+        } else {
+            used += st.st_size;
+        }
+    }
+    closedir(dir);
+    return used;
+}
+
+/**
+ * Remove everything under a host directory, but not the directory itself.
+ */
+static bool tree_clear(const char *path)
+{
+    bool ok = true;
+    char child[PATH_MAX];
+    struct stat st;
+    struct dirent *de;
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return false;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        if (lstat(child, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            ok = tree_clear(child) && ok;
+            ok = (rmdir(child) == 0) && ok;
+        } else {
+            ok = (unlink(child) == 0) && ok;
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+/**
+ * Create every missing parent directory of a host path.
+ */
+static void make_parents(char *host)
+{
+    for (char *sep = strchr(host+1, '/'); sep != NULL; sep = strchr(sep+1, '/')) {
+        *sep = 0x00;
+        mkdir(host, 0755);
+        *sep = '/';
+    }
+}
+
+ESPSyncPosixFS::ESPSyncPosixFS(const char *root, uint32_t totalBytes)
+{
+    strncpy(_root, root, sizeof(_root)-1);
+    _root[sizeof(_root)-1] = 0x00;
+    _total = totalBytes;
+    _write_delay = 0;
+    _depth = 0;
+    for (int fh = 0; fh < ESPSYNC_MAX_OPEN; fh++) {
+        _files[fh] = -1;
+    }
+}
+
+/**
+ * Map a filesystem name to a path in the host directory.
+ * Rejects names that could escape the root directory.
+ */
+bool ESPSyncPosixFS::hostPath(const char *path, char *host, bool create)
+{
+    if ((path == NULL) || (path[0] != '/') || (strstr(path, "..") != NULL)) {
+        return false;
+    }
+
+    int len;
+    if (path[1] == '/') {
+        while (*path == '/') {
+            path++;
+        }
+        len = snprintf(host, PATH_MAX, "%s" PRIVATE_DIR "/%s", _root, path);
+    } else {
+        len = snprintf(host, PATH_MAX, "%s%s", _root, path);
+    }
+    if ((len < 0) || (len >= PATH_MAX)) {
+        return false;
+    }
+
+    if (create) {
+        make_parents(host);
+    }
+    return true;
+}
+
+bool ESPSyncPosixFS::begin(void)
+{
+    struct stat st;
+    return (stat(_root, &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+bool ESPSyncPosixFS::info(ESPSyncFSInfo *info)
+{
+    uint64_t used = tree_usage(_root);
+
+    info->totalBytes    = _total;
+    info->usedBytes     = (used > _total) ? _total : (uint32_t)used;
+    info->pageSize      = POSIXFS_PAGE_SIZE;
+    info->maxPathLength = POSIXFS_MAX_PATH;
+    return true;
+}
+
+bool ESPSyncPosixFS::format(void)
+{
+    for (int fh = 0; fh < ESPSYNC_MAX_OPEN; fh++) {
+        close(fh);
+    }
+    return tree_clear(_root);
+}
+
+bool ESPSyncPosixFS::exists(const char *path)
+{
+    char host[PATH_MAX];
+    struct stat st;
+    return hostPath(path, host, false) && (stat(host, &st) == 0) && S_ISREG(st.st_mode);
+}
+
+/**
+ * Remove the directories a file was in, as far as they are now empty,
+ * as LittleFS does.  Directories only exist to hold files.
+ */
+void ESPSyncPosixFS::prune(char *host)
+{
+    size_t root = strlen(_root);
+    char  *sep;
+
+    while (((sep = strrchr(host, '/')) != NULL) && ((size_t)(sep - host) > root)) {
+        *sep = 0x00;
+        if (rmdir(host) != 0) {
+            break;
+        }
+    }
+}
+
+bool ESPSyncPosixFS::remove(const char *path)
+{
+    char host[PATH_MAX];
+    if (!hostPath(path, host, false) || (unlink(host) != 0)) {
+        return false;
+    }
+    prune(host);
+    return true;
+}
+
+bool ESPSyncPosixFS::rename(const char *from, const char *to)
+{
+    char hfrom[PATH_MAX];
+    char hto[PATH_MAX];
+    if (!hostPath(from, hfrom, false) || !hostPath(to, hto, true) ||
+        (::rename(hfrom, hto) != 0)) {
+        return false;
+    }
+    prune(hfrom);
+    return true;
+}
+
+uint8_t ESPSyncPosixFS::caps(void)
+{
+    return ESPSYNC_FS_DIRS | ESPSYNC_FS_MTIME;
+}
+
+bool ESPSyncPosixFS::getTime(const char *path, uint8_t *date)
+{
+    char host[PATH_MAX];
+    struct stat st;
+    return hostPath(path, host, false) && (stat(host, &st) == 0) &&
+           espsync_time_date(st.st_mtime, date);
+}
+
+bool ESPSyncPosixFS::setTime(const char *path, const uint8_t *date)
+{
+    char host[PATH_MAX];
+    struct timespec ts[2];
+    time_t t;
+
+    if (!hostPath(path, host, false) || !espsync_date_time(date, &t)) {
+        return false;
+    }
+    ts[0].tv_sec = ts[1].tv_sec = t;
+    ts[0].tv_nsec = ts[1].tv_nsec = 0;
+    return utimensat(AT_FDCWD, host, ts, 0) == 0;
+}
+
+int ESPSyncPosixFS::open(const char *path, const char *mode)
+{
+    char host[PATH_MAX];
+    int flags;
+
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        return ESPSYNC_NO_FILE;
+    }
+
+    for (int fh = 0; fh < ESPSYNC_MAX_OPEN; fh++) {
+        if (_files[fh] < 0) {
+            if (!hostPath(path, host, (flags & O_CREAT) != 0)) {
+                break;
+            }
+            _files[fh] = ::open(host, flags, 0644);
+            if (_files[fh] < 0) {
+                break;
+            }
+            return fh;
+        }
+    }
+    return ESPSYNC_NO_FILE;
+}
+
+int32_t ESPSyncPosixFS::read(int fh, uint8_t *buffer, uint32_t length)
+{
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || (_files[fh] < 0)) {
+        return -1;
+    }
+    return ::read(_files[fh], buffer, length);
+}
+
+int32_t ESPSyncPosixFS::write(int fh, const uint8_t *buffer, uint32_t length)
+{
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || (_files[fh] < 0)) {
+        return -1;
+    }
+
+    if (_write_delay > 0) {
+        usleep(_write_delay);
+    }
+
+    uint32_t done = 0;
+    while (done < length) {
+        ssize_t wr = ::write(_files[fh], buffer+done, length-done);
+        if (wr < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += wr;
+    }
+    return done;
+}
+
+bool ESPSyncPosixFS::seek(int fh, uint32_t position)
+{
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || (_files[fh] < 0)) {
+        return false;
+    }
+    return lseek(_files[fh], position, SEEK_SET) == (off_t)position;
+}
+
+int32_t ESPSyncPosixFS::size(int fh)
+{
+    struct stat st;
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || (_files[fh] < 0) ||
+        (fstat(_files[fh], &st) != 0)) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+void ESPSyncPosixFS::close(int fh)
+{
+    if ((fh >= 0) && (fh < ESPSYNC_MAX_OPEN) && (_files[fh] >= 0)) {
+        ::close(_files[fh]);
+        _files[fh] = -1;
+    }
+}
+
+void ESPSyncPosixFS::setWriteDelay(uint32_t us)
+{
+    _write_delay = us;
+}
+
+bool ESPSyncPosixFS::openDir(void)
+{
+    while (_depth > 0) {
+        closedir(_dir[--_depth]);
+    }
+    _dirname[0] = 0x00;
+    _dirlen[0] = 0;
+    if ((_dir[0] = opendir(_root)) != NULL) {
+        _depth = 1;
+    }
+    return (_depth > 0);
+}
+
+bool ESPSyncPosixFS::nextEntry(ESPSyncDirEntry *entry)
+{
+    char name[PATH_MAX];
+    char host[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    int len;
+
+    /**
+     * NOTE: Walks every directory, depth first, to ESPSYNC_MAX_DEPTH.
+     * Skips hidden files and directories, Eg, the private one, and names
+     * too long to list.
+     */
+    while (_depth > 0) {
+        if ((de = readdir(_dir[_depth-1])) == NULL) {
+            closedir(_dir[--_depth]);
+            if (_depth > 0) {
+                _dirname[_dirlen[_depth-1]] = 0x00;
+            }
+            continue;
+        }
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        len = snprintf(name, sizeof(name), "%s/%s", _dirname, de->d_name);
+        if ((len >= (int)sizeof(name)) ||
+            (snprintf(host, sizeof(host), "%s%s", _root, name) >= (int)sizeof(host)) ||
+            (stat(host, &st) != 0)) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if ((_depth < ESPSYNC_MAX_DEPTH) && ((_dir[_depth] = opendir(host)) != NULL)) {
+                strcpy(_dirname, name);
+                _dirlen[_depth++] = len;
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || (len + 1 >= POSIXFS_MAX_PATH)) {
+            continue;
+        }
+        strcpy(entry->name, name);
+        entry->size = st.st_size;
+        return true;
+    }
+    return false;
+}
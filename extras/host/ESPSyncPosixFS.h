@@ -0,0 +1,84 @@
+/**
+ *  ESP Sync host build, directory backed filesystem
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCPOSIXFS_H_
+#define __ESPSYNCPOSIXFS_H_
+
+#include "ESPSyncFS.h"
+
+#include <dirent.h>
+#include <limits.h>
+
+/* Geometry reported to the protocol, the same as a default ESP8266 SPIFFS */
+#define POSIXFS_PAGE_SIZE  (256)
+#define POSIXFS_MAX_PATH   (32)
+
+/**
+ * Stores the files of the synced filesystem in a host directory.
+ *
+ * File "/name" is stored as <root>/name.  Names starting with "//" are
+ * private to the library (Eg, "///TEMP") and are stored under
+ * <root>/.espsync so they can never collide with a synced file.
+ * "/dir/name" is stored in a real directory, made as it is needed and
+ * removed once it is empty, and files keep the date they were sent with.
+ */
+class ESPSyncPosixFS : public ESPSyncFS
+{
+    public:
+        ESPSyncPosixFS(const char *root, uint32_t totalBytes);
+
+        bool begin(void);
+        bool info(ESPSyncFSInfo *info);
+        uint8_t caps(void);
+        bool getTime(const char *path, uint8_t *date);
+        bool setTime(const char *path, const uint8_t *date);
+        bool format(void);
+        bool exists(const char *path);
+        bool remove(const char *path);
+        bool rename(const char *from, const char *to);
+
+        int open(const char *path, const char *mode);
+        int32_t read(int fh, uint8_t *buffer, uint32_t length);
+        int32_t write(int fh, const uint8_t *buffer, uint32_t length);
+        bool seek(int fh, uint32_t position);
+        int32_t size(int fh);
+        void close(int fh);
+
+        bool openDir(void);
+        bool nextEntry(ESPSyncDirEntry *entry);
+
+        void setWriteDelay(uint32_t us);
+        /*
+         * Make every write take this much longer, to stand in for
+         * flash page programming and erase stalls.
+         */
+
+    private:
+        char     _root[PATH_MAX];
+        uint32_t _total;
+        uint32_t _write_delay;
+        int      _files[ESPSYNC_MAX_OPEN];
+        DIR     *_dir[ESPSYNC_MAX_DEPTH];    /* Being walked, the root first */
+        int      _dirlen[ESPSYNC_MAX_DEPTH]; /* Length of _dirname for each */
+        uint8_t  _depth;
+        char     _dirname[PATH_MAX];         /* Of the innermost, "" for the root */
+
+        bool hostPath(const char *path, char *host, bool create);
+        void prune(char *host);
+};
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ *  ESP Sync host build, file descriptor stream
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncPosixStream.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#include <vector>
+
+typedef struct {
+    uint32_t baud;
+    speed_t  speed;
+} tty_rate_t;
+
+static const tty_rate_t tty_rates[] = {
+    { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+    { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+    { 500000, B500000 }, { 921600, B921600 }, { 1000000, B1000000 },
+    { 1500000, B1500000 }, { 2000000, B2000000 }, { 3000000, B3000000 }
+};
+
+bool posix_set_baud(int fd, uint32_t baud)
+{
+    struct termios tio;
+    size_t x;
+
+    if (!isatty(fd)) {
+        return true;
+    }
+    for (x = 0; x < sizeof(tty_rates) / sizeof(tty_rates[0]); x++) {
+        if (tty_rates[x].baud == baud) {
+            break;
+        }
+    }
+    return (x < sizeof(tty_rates) / sizeof(tty_rates[0])) &&
+           (tcdrain(fd) == 0) && (tcgetattr(fd, &tio) == 0) &&
+           (cfsetspeed(&tio, tty_rates[x].speed) == 0) &&
+           (tcsetattr(fd, TCSANOW, &tio) == 0);
+}
+
+ESPSyncPosixStream::ESPSyncPosixStream(int fd)
+{
+    _fd = fd;
+    _timeout = 1000; /* Same default as the Arduino Stream */
+    _baud = 115200;
+    _limit = 0;
+    _writes = 0;
+
+    struct termios tio;
+    if (isatty(_fd) && (tcgetattr(_fd, &tio) == 0)) {
+        for (size_t x = 0; x < sizeof(tty_rates) / sizeof(tty_rates[0]); x++) {
+            if (tty_rates[x].speed == cfgetospeed(&tio)) {
+                _baud = tty_rates[x].baud;
+            }
+        }
+    }
+}
+
+bool ESPSyncPosixStream::garbled(void)
+{
+    return (_limit != 0) && (_baud > _limit);
+}
+
+int ESPSyncPosixStream::available(void)
+{
+    int pending = 0;
+    if (ioctl(_fd, FIONREAD, &pending) < 0) {
+        return 0;
+    }
+    return pending;
+}
+
+int ESPSyncPosixStream::read(void)
+{
+    uint8_t byte;
+    if ((available() > 0) && (::read(_fd, &byte, 1) == 1)) {
+        return garbled() ? 0xFF : byte;
+    }
+    return -1;
+}
+
+bool ESPSyncPosixStream::wait(unsigned long timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = _fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int rc;
+    do {
+        rc = poll(&pfd, 1, (int)timeout);
+    } while ((rc < 0) && (errno == EINTR));
+
+    return (rc > 0) && (pfd.revents & POLLIN);
+}
+
+size_t ESPSyncPosixStream::readBytes(uint8_t *buffer, size_t length)
+{
+    size_t got = 0;
+
+    while (got < length) {
+        if (!wait(_timeout)) {
+            break;
+        }
+        ssize_t rd = ::read(_fd, buffer+got, length-got);
+        if (rd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        } else if (rd == 0) {
+            break; /* Other end closed */
+        }
+        got += rd;
+    }
+    if (garbled()) {
+        memset(buffer, 0xFF, got);
+    }
+    return got;
+}
+
+void ESPSyncPosixStream::setTimeout(unsigned long timeout)
+{
+    _timeout = timeout;
+}
+
+size_t ESPSyncPosixStream::write(uint8_t byte)
+{
+    return write(&byte, 1);
+}
+
+size_t ESPSyncPosixStream::write(const uint8_t *buffer, size_t size)
+{
+    size_t sent = 0;
+    std::vector<uint8_t> noise;
+
+    _writes++;
+    if (garbled()) {
+        noise.assign(size, 0xFF);
+        buffer = noise.data();
+    }
+
+    while (sent < size) {
+        ssize_t wr = ::write(_fd, buffer+sent, size-sent);
+        if (wr < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN)) {
+                continue;
+            }
+            break;
+        }
+        sent += wr;
+    }
+    return sent;
+}
+
+uint32_t ESPSyncPosixStream::baud(void)
+{
+    return _baud;
+}
+
+bool ESPSyncPosixStream::setBaud(uint32_t baud)
+{
+    if (!posix_set_baud(_fd, baud)) {
+        return false;
+    }
+    _baud = baud;
+    return true;
+}
+
+uint32_t ESPSyncPosixStream::writeCalls(void)
+{
+    return _writes;
+}
+
+void ESPSyncPosixStream::setLineLimit(uint32_t baud)
+{
+    _limit = baud;
+}
@@ -0,0 +1,79 @@
+/**
+ *  ESP Sync host build, file descriptor stream
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCPOSIXSTREAM_H_
+#define __ESPSYNCPOSIXSTREAM_H_
+
+#include "ESPSyncStream.h"
+
+#include <atomic>
+
+bool posix_set_baud(int fd, uint32_t baud);
+/*
+ * Set a tty's line rate, once everything written has been sent.
+ * Does nothing, successfully, for a descriptor that is not a tty.
+ */
+
+/**
+ * An ESPSyncStream over any readable/writable file descriptor.
+ * Eg, a pty master or one end of a socketpair.
+ */
+class ESPSyncPosixStream : public ESPSyncStream
+{
+    public:
+        ESPSyncPosixStream(int fd);
+
+        int available(void);
+        int read(void);
+        size_t readBytes(uint8_t *buffer, size_t length);
+        void setTimeout(unsigned long timeout);
+        size_t write(uint8_t byte);
+        size_t write(const uint8_t *buffer, size_t size);
+        uint32_t baud(void);
+        bool setBaud(uint32_t baud);
+        /*
+         * A tty's line rate.  Any other descriptor, Eg, a socket, only
+         * pretends to have one, starting at 115200.
+         */
+
+        void setLineLimit(uint32_t baud);
+        /*
+         * Above this rate, every byte read or written becomes 0xFF, like
+         * a line that can not run that fast.  0 (the default) is no limit.
+         */
+
+        uint32_t writeCalls(void);
+        /*
+         * Number of calls to write(), to see how replies are framed.
+         */
+
+        bool wait(unsigned long timeout);
+        /*
+         * Wait up to timeout ms for data to be available.
+         */
+
+    private:
+        int           _fd;
+        unsigned long _timeout;
+        uint32_t      _baud;
+        uint32_t      _limit;
+        std::atomic<uint32_t> _writes;
+
+        bool garbled(void);
+};
+
+#endif
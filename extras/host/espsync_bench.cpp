@@ -0,0 +1,1836 @@
+/**
+ *  ESP Sync host build, protocol throughput benchmark
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Runs the real ESPSync class on one end of a socketpair, with a
+ * temporary directory as its filesystem, and drives it from the other
+ * end with ESPSyncMaster.  Every operation is checked, so a non zero
+ * exit status means the protocol is broken, not just slow.
+ */
+#include "ESPSync.h"
+#include "ESPSyncPosixStream.h"
+#include "ESPSyncPosixFS.h"
+#include "ESPSyncMaster.h"
+#include "ESPSyncChecksum.h"
+#include "ESPSyncLZ.h"
+
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_CYCLES
+#endif
+
+#include <dirent.h>
+#include <new>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/**
+ * Counts what a device thread takes from the heap.  Once it is running,
+ * ESPSync should take nothing, all its buffers are part of the object.
+ * Every form of new and delete is replaced, so each pointer is freed by
+ * the allocator it came from.  They are not inlined, or the compiler
+ * sees a free() of what it knows as an operator new pointer.
+ */
+static thread_local std::atomic<uint32_t> *heap_allocs = NULL;
+
+static __attribute__((noinline)) void *heap_take(size_t size, bool nothrow)
+{
+    void *p;
+
+    if (heap_allocs != NULL) {
+        (*heap_allocs)++;
+    }
+    if (((p = malloc(size ? size : 1)) == NULL) && !nothrow) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+static __attribute__((noinline)) void heap_give(void *p)
+{
+    free(p);
+}
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    return heap_take(size, false);
+}
+
+__attribute__((noinline)) void *operator new[](size_t size)
+{
+    return heap_take(size, false);
+}
+
+__attribute__((noinline)) void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return heap_take(size, true);
+}
+
+__attribute__((noinline)) void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return heap_take(size, true);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    heap_give(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+    heap_give(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    heap_give(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    heap_give(p);
+}
+
+#if defined(__cpp_sized_deallocation)
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    heap_give(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+    heap_give(p);
+}
+#endif
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static uint32_t adler32(const uint8_t *data, uint32_t length)
+{
+    uint32_t lo = 1;
+    uint32_t hi = 0;
+    while (length--) {
+        lo = (lo + *data++) % 65521;
+        hi = (hi + lo) % 65521;
+    }
+    return (hi << 16) | lo;
+}
+
+/**
+ * Check the block Adler-32 kernel against the byte at a time reference,
+ * over odd lengths, alignments and split points, then time both.
+ */
+static bool adler32_kernel(uint32_t length)
+{
+    std::vector<uint8_t> data(length + 64);
+    for (uint32_t x = 0; x < data.size(); x++) {
+        data[x] = (x & 1) ? 0xFF : rand();
+    }
+
+    for (uint32_t x = 0; x < 2000; x++) {
+        uint32_t align = rand() % 16;
+        uint32_t len   = rand() % ((x & 1) ? 64 : 20000);
+        uint32_t split = (len > 0) ? rand() % len : 0;
+        if (align + len > data.size()) {
+            len = data.size() - align;
+            split = 0;
+        }
+        const uint8_t *buf = data.data() + align;
+        uint32_t csum = adler32_update(ADLER32_INIT, buf, split);
+        csum = adler32_update(csum, buf + split, len - split);
+        if (csum != adler32(buf, len)) {
+            return false;
+        }
+    }
+
+    volatile uint32_t sink;
+    double t = now_s();
+    sink = adler32(data.data(), length);
+    double t_ref = now_s() - t;
+    t = now_s();
+    sink = adler32_update(ADLER32_INIT, data.data(), length);
+    double t_blk = now_s() - t;
+    (void)sink;
+
+    printf("adler32 : %u bytes, %.1f MB/s per byte, %.1f MB/s block\n",
+           length, length / (t_ref * 1e6), length / (t_blk * 1e6));
+    return true;
+}
+
+static uint32_t crc_bitwise(uint32_t poly, const uint8_t *data, uint32_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    while (length--) {
+        crc ^= *data++;
+        for (uint8_t k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ poly : (crc >> 1);
+        }
+    }
+    return ~crc;
+}
+
+/**
+ * Check the CRC-32 and CRC-32C kernels against a bit at a time reference,
+ * and their standard check values, then time each CHK2 a session can
+ * agree on, in bytes per cycle where the TSC can be read.
+ */
+static bool csum_kernels(uint32_t length)
+{
+    static const uint32_t polys[CSUM_ALGORITHMS] = { 0, 0xEDB88320, 0x82F63B78 };
+    static const char *names[CSUM_ALGORITHMS] = { "adler32", "crc32", "crc32c" };
+    std::vector<uint8_t> data(length + 64);
+    for (uint32_t x = 0; x < data.size(); x++) {
+        data[x] = rand();
+    }
+
+    if ((crc32_update(CRC32_INIT, (const uint8_t*)"123456789", 9) != 0xCBF43926) ||
+        (crc32c_update(CRC32_INIT, (const uint8_t*)"123456789", 9) != 0xE3069283)) {
+        return false;
+    }
+    for (uint8_t c = CSUM_CRC32; c < CSUM_ALGORITHMS; c++) {
+        const ESPSyncCsum *ck = &espsync_csums[c];
+        for (uint32_t x = 0; x < 500; x++) {
+            uint32_t align = rand() % 16;
+            uint32_t len   = rand() % ((x & 1) ? 64 : 4096);
+            uint32_t split = (len > 0) ? rand() % len : 0;
+            const uint8_t *buf = data.data() + align;
+            uint32_t crc = ck->update(ck->init, buf, split);
+            crc = ck->update(crc, buf + split, len - split);
+            if (crc != crc_bitwise(polys[c], buf, len)) {
+                return false;
+            }
+        }
+    }
+
+    printf("csums   : %u bytes,", length);
+    for (uint8_t c = 0; c < CSUM_ALGORITHMS; c++) {
+        const ESPSyncCsum *ck = &espsync_csums[c];
+        volatile uint32_t sink;
+        double t = now_s();
+#if defined(BENCH_CYCLES)
+        uint64_t cycles = __rdtsc();
+#endif
+        sink = ck->update(ck->init, data.data(), length);
+#if defined(BENCH_CYCLES)
+        cycles = __rdtsc() - cycles;
+#endif
+        t = now_s() - t;
+        (void)sink;
+        printf(" %s %.1f MB/s", names[c], length / (t * 1e6));
+#if defined(BENCH_CYCLES)
+        printf(" (%.2f bytes/cycle)", length / (double)cycles);
+#endif
+        printf((c < CSUM_ALGORITHMS - 1) ? "," : "\n");
+    }
+    return true;
+}
+
+static uint32_t get32(const uint8_t *buf)
+{
+    return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/* How the device reads application data */
+#define PT_BYTE (0)  /* getData(byte) */
+#define PT_BULK (1)  /* getData(buf, length) */
+#define PT_POLL (2)  /* poll(), into a sink */
+
+typedef struct {
+    int                   fd;
+    ESPSyncFS            *fs;
+    std::atomic<bool>     stop;
+    std::atomic<uint32_t> pt_count;  /* Application bytes getData() returned */
+    std::atomic<uint32_t> pt_csum;   /* and their Adler-32 */
+    std::atomic<uint32_t> max_call;  /* Longest getData() call, in us */
+    std::atomic<ESPSync*> sync;
+    std::atomic<ESPSyncPosixStream*> stream;
+    uint32_t              line_limit; /* Fastest rate the "line" carries */
+    std::atomic<uint8_t>  mode;       /* PT_BYTE, PT_BULK or PT_POLL */
+    std::atomic<uint32_t> events[8];  /* Of each ESPSYNC_EVENT_* */
+    std::atomic<uint32_t> allocs;     /* Heap allocations by the device thread */
+    uint8_t               instance;   /* Of those sharing the filesystem */
+} device_t;
+
+static void device_sink(const uint8_t *data, size_t length, void *arg)
+{
+    device_t *dev = (device_t*)arg;
+    dev->pt_csum = adler32_update(dev->pt_csum, data, length);
+    dev->pt_count += length;
+}
+
+static void device_event(const ESPSyncEvent *event, void *arg)
+{
+    device_t *dev = (device_t*)arg;
+    if (event->type < 8) {
+        dev->events[event->type]++;
+    }
+}
+
+static void device_init(device_t *dev, int fd, ESPSyncFS *fs, uint8_t instance)
+{
+    dev->fd = fd;
+    dev->fs = fs;
+    dev->stop = false;
+    dev->pt_count = 0;
+    dev->pt_csum = 1;
+    dev->max_call = 0;
+    dev->sync = NULL;
+    dev->stream = NULL;
+    dev->line_limit = 1000000;
+    dev->mode = PT_BYTE;
+    for (uint8_t x = 0; x < 8; x++) {
+        dev->events[x] = 0;
+    }
+    dev->allocs = 0;
+    dev->instance = instance;
+}
+
+/**
+ * The "device", services the protocol until told to stop.
+ */
+static void device(device_t *dev)
+{
+    heap_allocs = &dev->allocs;
+
+    ESPSyncPosixStream stream(dev->fd);
+    ESPSync sync(dev->instance);
+    uint8_t data[256];
+    size_t  got = 0;
+
+    stream.setLineLimit(dev->line_limit);
+    sync.setFS(dev->fs);
+    sync.setStream(&stream);
+    sync.onData(device_sink, dev);
+    sync.onEvent(device_event, dev);
+    dev->stream = &stream;
+    dev->sync = &sync;
+
+    while (!dev->stop) {
+        /* Only time calls that may be protocol, timing every
+           application byte would swamp the passthrough rate */
+        double t = (got == 0) ? now_s() : 0;
+        if (dev->mode == PT_POLL) {
+            uint32_t before = dev->pt_count;
+            sync.poll();
+            got = dev->pt_count - before;
+        } else {
+            if (dev->mode == PT_BULK) {
+                got = sync.getData(data, sizeof(data));
+            } else {
+                got = sync.getData(data) ? 1 : 0;
+            }
+            if (got > 0) {
+                device_sink(data, got, dev);
+            }
+        }
+        if (t != 0) {
+            uint32_t us = (now_s() - t) * 1e6;
+            if (us > dev->max_call) {
+                dev->max_call = us;
+            }
+        }
+        if ((got == 0) && (stream.available() == 0)) {
+            if (sync.protocol_active(false)) {
+                /* Maybe mid delta, with base file pages to copy */
+                std::this_thread::yield();
+            } else {
+                stream.wait(1);
+            }
+        }
+    }
+}
+
+/**
+ * Send application data, sprinkled with STX bytes that are not headers,
+ * and things that are headers up to the checksum, and wait for the
+ * device to hand all of it to the application, in the given mode.  The data ends in an STX immediately followed by a ping, which
+ * must still be found.
+ */
+static bool passthrough(device_t *dev, ESPSyncMaster *master, int fd, uint32_t length, uint8_t mode)
+{
+    static const uint8_t nearly[6] = { 0x02, 0x20, 0x65, 0x00, 0x01, 0x00 };
+    uint16_t csum = 0;
+    for (uint8_t x = 0; x < sizeof(nearly); x++) {
+        fletcher16(&csum, nearly[x]);
+    }
+
+    std::vector<uint8_t> data(length);
+    for (uint32_t x = 0; x < length; x++) {
+        if (((x % 389) == 0) && (x + 8 < length)) {
+            memcpy(&data[x], nearly, sizeof(nearly));
+            data[x+6] = csum >> 8;
+            data[x+7] = ~csum;
+            x += 7;
+        } else {
+            data[x] = ((x % 97) == 0) ? 0x02 : (rand() & 0xFF);
+        }
+    }
+    data[length-1] = 0x02;
+    dev->mode = mode;
+    uint32_t start = dev->pt_count;
+    uint32_t start_csum = dev->pt_csum;
+
+    double t = now_s();
+    for (uint32_t sent = 0; sent < length; ) {
+        ssize_t wr = write(fd, data.data() + sent, length - sent);
+        if (wr <= 0) {
+            return false;
+        }
+        sent += wr;
+    }
+    if (master->ping() != MASTER_OK) {
+        return false;
+    }
+    while ((dev->pt_count - start < length) && (now_s() - t < 10.0)) {
+        usleep(100);
+    }
+    t = now_s() - t;
+
+    if ((dev->pt_count - start != length) ||
+        (dev->pt_csum != adler32_update(start_csum, data.data(), length))) {
+        return false;
+    }
+    printf("passthru: %u bytes, %.2f MB/s %s\n", length, length / (t * 1e6),
+           (mode == PT_POLL) ? "from poll()" : (mode == PT_BULK) ? "in bulk" : "a byte at a time");
+    return true;
+}
+
+typedef struct {
+    int                   fd[2];     /* Master side, device side */
+    uint32_t              latency;   /* One way, in us */
+    int                   rx_fd;     /* The device's end, to see what it has not read */
+    std::atomic<uint32_t> fifo;      /* Bytes the device's UART holds, 0 for no limit */
+    std::atomic<uint32_t> dropped;   /* Bytes lost to a full FIFO */
+    std::atomic<bool>     stop;
+} link_t;
+
+typedef struct {
+    double               due;
+    std::vector<uint8_t> data;
+} in_flight_t;
+
+/**
+ * Stands in for a USB serial adapter, everything sent either way
+ * arrives latency us later.  With a fifo, what arrives for the device
+ * while it already has that much unread is lost, as a UART overruns.
+ */
+static void link_relay(link_t *link)
+{
+    std::deque<in_flight_t> q[2];   /* Data going to fd[0], and to fd[1] */
+    struct pollfd pfd[2];
+    uint8_t buf[4096];
+
+    for (int x = 0; x < 2; x++) {
+        pfd[x].fd = link->fd[x];
+        pfd[x].events = POLLIN;
+    }
+
+    while (!link->stop) {
+        double now = now_s();
+        double next = now + 0.01;
+
+        for (int x = 0; x < 2; x++) {
+            while (!q[x].empty() && (q[x].front().due <= now)) {
+                const std::vector<uint8_t> &d = q[x].front().data;
+                size_t length = d.size();
+                if ((x == 1) && (link->fifo != 0)) {
+                    int unread = 0;
+                    ioctl(link->rx_fd, FIONREAD, &unread);
+                    size_t room = (link->fifo > (uint32_t)unread) ? link->fifo - unread : 0;
+                    if (length > room) {
+                        link->dropped += length - room;
+                        length = room;
+                    }
+                }
+                for (size_t sent = 0; sent < length; ) {
+                    ssize_t wr = write(link->fd[x], d.data() + sent, length - sent);
+                    if (wr <= 0) {
+                        return;
+                    }
+                    sent += wr;
+                }
+                q[x].pop_front();
+            }
+            if (!q[x].empty() && (q[x].front().due < next)) {
+                next = q[x].front().due;
+            }
+        }
+
+        struct timespec ts;
+        double wait = (next > now) ? (next - now) : 0;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        if (ppoll(pfd, 2, &ts, NULL) <= 0) {
+            continue;
+        }
+
+        for (int x = 0; x < 2; x++) {
+            if (pfd[x].revents & POLLIN) {
+                ssize_t rd = read(link->fd[x], buf, sizeof(buf));
+                if (rd <= 0) {
+                    return;
+                }
+                in_flight_t f;
+                f.due = now_s() + (link->latency / 1e6);
+                f.data.assign(buf, buf + rd);
+                q[1-x].push_back(f);
+            }
+        }
+    }
+}
+
+/**
+ * List, and check every entry against the file on disk, its checksum
+ * too if options asks for them.  Returns the number of entries, or -1
+ * if any is wrong.
+ */
+static int check_listing(ESPSyncMaster *master, const char *root, uint8_t options)
+{
+    std::vector<uint8_t> listing;
+    if (master->list(options, &listing) != MASTER_OK) {
+        return -1;
+    }
+    uint32_t nsiz = listing[8];
+    uint32_t esize = nsiz + 4 + ((options & 0x1) ? 6 : 0) + ((options & 0x2) ? 4 : 0);
+    uint32_t count = (listing.size() - 10) / esize;
+
+    for (uint32_t x = 0; x < count; x++) {
+        const uint8_t *e = &listing[10 + (x * esize)];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%.*s", root, (int)nsiz, (const char*)e);
+
+        std::vector<uint8_t> data;
+        FILE *f = fopen(path, "rb");
+        if (f == NULL) {
+            return -1;
+        }
+        uint8_t buf[4096];
+        size_t got;
+        while ((got = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.insert(data.end(), buf, buf + got);
+        }
+        fclose(f);
+        if ((get32(e + nsiz) != data.size()) ||
+            ((options & 0x2) && (get32(e + esize - 4) != adler32(data.data(), data.size())))) {
+            fprintf(stderr, "%s listed wrongly\n", path);
+            return -1;
+        }
+    }
+    return count;
+}
+
+/**
+ * One master of several at once, uploading every file of content.
+ */
+static void session_uploads(int fd, uint8_t port, uint32_t timeout,
+                            const std::vector<std::vector<uint8_t> > *content,
+                            std::atomic<int> *result)
+{
+    ESPSyncMaster master(fd);
+    char name[32];
+    int rc;
+
+    master.setTimeout(timeout);
+    for (uint32_t x = 0; (x < content->size()) && (*result == MASTER_OK); x++) {
+        snprintf(name, sizeof(name), "/port%u_%04u.bin", port, x);
+        if ((rc = master.putFile(name, (*content)[x].data(), (*content)[x].size())) != MASTER_OK) {
+            *result = rc;
+        }
+    }
+}
+
+/**
+ * Upload content over several sessions at once, each its own ESPSync on
+ * its own stream, all sharing one filesystem.  Then check a listing, and
+ * every file on disk, and remove them again.  Returns the seconds the
+ * uploads took, or -1 if anything was wrong.
+ */
+static double sessions_upload(ESPSyncFS *fs, const char *root, uint32_t sessions,
+                              uint32_t timeout,
+                              const std::vector<std::vector<uint8_t> > &content)
+{
+    std::vector<device_t> devs(sessions);
+    std::vector<std::thread> threads;
+    std::vector<int> fds(2 * sessions, -1);
+    std::atomic<int> result(MASTER_OK);
+    bool ok = true;
+    char name[32];
+    double t;
+
+    for (uint32_t x = 0; x < sessions; x++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[2 * x]) != 0) {
+            perror("socketpair");
+            sessions = x;
+            ok = false;
+            break;
+        }
+        device_init(&devs[x], fds[2 * x], fs, x + 1);
+        threads.push_back(std::thread(device, &devs[x]));
+    }
+    for (uint32_t x = 0; x < sessions; x++) {
+        while (devs[x].sync == NULL) {
+            usleep(100);
+        }
+    }
+
+    t = now_s();
+    if (ok) {
+        std::vector<std::thread> masters;
+        for (uint32_t x = 0; x < sessions; x++) {
+            masters.push_back(std::thread(session_uploads, fds[(2 * x) + 1], x + 1,
+                                          timeout, &content, &result));
+        }
+        for (uint32_t x = 0; x < sessions; x++) {
+            masters[x].join();
+        }
+        ok = (result == MASTER_OK);
+    }
+    t = now_s() - t;
+
+    /* Every instance kept the shared manifest up to date */
+    if (ok) {
+        ESPSyncMaster master(fds[1]);
+        master.setTimeout(timeout);
+        ok = (check_listing(&master, root, 0x03) >= (int)(sessions * content.size()));
+    }
+
+    for (uint32_t x = 0; (x < sessions) && ok; x++) {
+        ESPSyncMaster master(fds[(2 * x) + 1]);
+        master.setTimeout(timeout);
+        for (uint32_t y = 0; (y < content.size()) && ok; y++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/port%u_%04u.bin", root, x + 1, y);
+            FILE *f = fopen(path, "rb");
+            std::vector<uint8_t> stored(content[y].size() + 1);
+            size_t got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+            if (f != NULL) {
+                fclose(f);
+            }
+            stored.resize(got);
+            snprintf(name, sizeof(name), "/port%u_%04u.bin", x + 1, y);
+            ok = (stored == content[y]) && (master.remove(name) == MASTER_OK);
+        }
+        /* Only starting its writer thread takes from the heap */
+        ok = ok && (devs[x].allocs <= 1);
+    }
+
+    for (uint32_t x = 0; x < sessions; x++) {
+        devs[x].stop = true;
+        threads[x].join();
+    }
+    for (uint32_t x = 0; x < fds.size(); x++) {
+        if (fds[x] >= 0) {
+            close(fds[x]);
+        }
+    }
+    return ok ? t : -1;
+}
+
+/**
+ * Upload base, then an edit of it as a delta, to a device of its own.
+ * The delta goes through a link that overruns as a UART would, paced
+ * at baud, with slow page writes, so the COPY runs take longer than the
+ * master's timeout and the line time of the FIFO.  Returns the bytes
+ * the FIFO dropped, or -1 if the file stored is wrong.
+ */
+static int uart_delta(ESPSyncPosixFS *fs, const char *root, uint32_t fifo, uint32_t baud,
+                      const std::vector<uint8_t> &base)
+{
+    std::vector<uint8_t> edited(base);
+    int sv[2] = { -1, -1 };
+    int lv[2] = { -1, -1 };
+    bool ok = false;
+
+    /* Edits spread out, so each COPY is followed by more of the delta */
+    for (uint32_t at = base.size() / 8; at + 16 < base.size(); at += base.size() / 4) {
+        for (uint32_t y = 0; y < 16; y++) {
+            edited[at + y] ^= 0x5A;
+        }
+    }
+
+    if ((socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) ||
+        (socketpair(AF_UNIX, SOCK_STREAM, 0, lv) != 0)) {
+        perror("socketpair");
+        return -1;
+    }
+    device_t dev_state;
+    device_init(&dev_state, sv[0], fs, 1);
+    std::thread dev(device, &dev_state);
+    while (dev_state.sync == NULL) {
+        usleep(100);
+    }
+    link_t link;
+    link.fd[0] = lv[0];
+    link.fd[1] = sv[1];
+    link.latency = 0;
+    link.rx_fd = sv[0];
+    link.fifo = 0;
+    link.dropped = 0;
+    link.stop = false;
+    std::thread relay(link_relay, &link);
+
+    {
+        /* The default timeout, the device has to ask for longer */
+        ESPSyncMaster master(lv[1]);
+        fs->setWriteDelay(0);
+        ok = (master.putFile("/uart.bin", base.data(), base.size()) == MASTER_OK);
+        link.fifo = fifo;
+        master.setLineRate(baud);
+        fs->setWriteDelay(5000);
+        ok = ok && (master.putDelta("/uart.bin", edited.data(), edited.size(),
+                                    "/uart.bin", 512) == MASTER_OK);
+        fs->setWriteDelay(0);
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/uart.bin", root);
+        FILE *f = fopen(path, "rb");
+        std::vector<uint8_t> stored(edited.size() + 1);
+        size_t got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        stored.resize(got);
+        ok = ok && (stored == edited);
+        master.setLineRate(0);
+        link.fifo = 0;
+        ok = ok && (master.remove("/uart.bin") == MASTER_OK);
+    }
+
+    link.stop = true;
+    relay.join();
+    dev_state.stop = true;
+    dev.join();
+    for (int x = 0; x < 2; x++) {
+        close(sv[x]);
+        close(lv[x]);
+    }
+    return ok ? (int)link.dropped : -1;
+}
+
+/**
+ * What the Hash command should reply, worked out from the files on disk.
+ */
+static void disk_hashes(const char *root, const char **prefixes, uint8_t count,
+                        uint32_t *files, uint32_t *hashes)
+{
+    struct dirent *de;
+    DIR *dir = opendir(root);
+
+    memset(files, 0, (count + 1) * sizeof(uint32_t));
+    memset(hashes, 0, (count + 1) * sizeof(uint32_t));
+    while ((dir != NULL) && ((de = readdir(dir)) != NULL)) {
+        char path[PATH_MAX];
+        char name[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+        snprintf(name, sizeof(name), "/%s", de->d_name);
+
+        std::vector<uint8_t> data;
+        FILE *f = (de->d_name[0] != '.') ? fopen(path, "rb") : NULL;
+        if (f == NULL) {
+            continue;
+        }
+        uint8_t buf[4096];
+        size_t got;
+        while ((got = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.insert(data.end(), buf, buf + got);
+        }
+        fclose(f);
+
+        uint32_t h = manifest_hash(name, data.size(), adler32(data.data(), data.size()));
+        files[0]++;
+        hashes[0] += h;
+        for (uint8_t x = 0; x < count; x++) {
+            if (strncmp(name, prefixes[x], strlen(prefixes[x])) == 0) {
+                files[x+1]++;
+                hashes[x+1] += h;
+            }
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+}
+
+/**
+ * The bucket of a histogram with the most in it.
+ */
+static const char *histogram_mode(const uint32_t *hist)
+{
+    static const char *names[ESPSYNC_STATS_BUCKETS] = {
+        "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "<10s", ">=10s" };
+    uint8_t mode = 0;
+
+    for (uint8_t x = 1; x < ESPSYNC_STATS_BUCKETS; x++) {
+        if (hist[x] > hist[mode]) {
+            mode = x;
+        }
+    }
+    return names[mode];
+}
+
+static uint32_t histogram_count(const uint32_t *hist)
+{
+    uint32_t count = 0;
+    for (uint8_t x = 0; x < ESPSYNC_STATS_BUCKETS; x++) {
+        count += hist[x];
+    }
+    return count;
+}
+
+static int fail(const char *what, int result)
+{
+    fprintf(stderr, "FAIL: %s (result %d)\n", what, result);
+    return 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n files] [-s file size] [-p pings] [-t passthrough bytes]\n"
+                    "          [-w us added to each flash page write] [-b upload baud rate]\n"
+                    "          [-l us link latency] [-m small files] [-W window]\n"
+                    "          [-c concurrent sessions]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t files = 16;
+    uint32_t fsize = 65536;
+    uint32_t pings = 1000;
+    uint32_t ptlen = 1024*1024;
+    uint32_t wdelay = 0;
+    uint32_t baud = 0;
+    uint32_t latency = 0;
+    uint32_t small = 200;
+    uint32_t window = 8;
+    uint32_t sessions = 4;
+    int opt;
+    int rc;
+
+    while ((opt = getopt(argc, argv, "n:s:p:t:w:b:l:m:W:c:")) != -1) {
+        switch (opt) {
+            case 't': ptlen = strtoul(optarg, NULL, 0); break;
+            case 'w': wdelay = strtoul(optarg, NULL, 0); break;
+            case 'b': baud = strtoul(optarg, NULL, 0); break;
+            case 'l': latency = strtoul(optarg, NULL, 0); break;
+            case 'm': small = strtoul(optarg, NULL, 0); break;
+            case 'W': window = strtoul(optarg, NULL, 0); break;
+            case 'c': sessions = strtoul(optarg, NULL, 0); break;
+            case 'n': files = strtoul(optarg, NULL, 0); break;
+            case 's': fsize = strtoul(optarg, NULL, 0); break;
+            case 'p': pings = strtoul(optarg, NULL, 0); break;
+            default:  usage(argv[0]); return 64;
+        }
+    }
+
+    /* The bench's own device is instance 0, the others share with it */
+    if (sessions >= ESPSYNC_INSTANCES) {
+        fprintf(stderr, "At most %u concurrent sessions\n", ESPSYNC_INSTANCES - 1);
+        return 64;
+    }
+
+    char root[] = "/tmp/espsync_bench.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return 73;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 71;
+    }
+
+    if (!adler32_kernel(16*1024*1024)) {
+        fprintf(stderr, "FAIL: adler32 kernel\n");
+        rmdir(root);
+        return 1;
+    }
+    if (!csum_kernels(16*1024*1024)) {
+        fprintf(stderr, "FAIL: crc kernels\n");
+        rmdir(root);
+        return 1;
+    }
+
+    ESPSyncPosixFS fs(root, 64*1024*1024);
+    fs.setWriteDelay(wdelay);
+    device_t dev_state;
+    device_init(&dev_state, sv[0], &fs, 0);
+    std::thread dev(device, &dev_state);
+    while (dev_state.sync == NULL) {
+        usleep(100);
+    }
+
+    /* The master talks to the device directly, or through a slow link */
+    int mfd = sv[1];
+    int lv[2] = { -1, -1 };
+    link_t link;
+    std::thread relay;
+    if (latency > 0) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, lv) != 0) {
+            perror("socketpair");
+            return 71;
+        }
+        link.fd[0] = lv[0];
+        link.fd[1] = sv[1];
+        link.latency = latency;
+        link.rx_fd = sv[0];
+        link.fifo = 0;
+        link.dropped = 0;
+        link.stop = false;
+        relay = std::thread(link_relay, &link);
+        mfd = lv[1];
+    }
+
+    ESPSyncMaster master(mfd);
+    /* Allow for a whole file of slow writes when a transfer is NAK'd */
+    master.setTimeout(1000 + (((uint64_t)fsize / 256) * wdelay) / 1000);
+    int failed = 0;
+    double t;
+
+    /* Round trip latency */
+    t = now_s();
+    for (uint32_t x = 0; (x < pings) && !failed; x++) {
+        if ((rc = master.ping()) != MASTER_OK) {
+            failed = fail("ping", rc);
+        }
+    }
+    t = now_s() - t;
+    if (!failed && (pings > 0)) {
+        printf("ping    : %u round trips, %.1f us each\n", pings, (t * 1e6) / pings);
+    }
+
+    if (!failed && ((rc = master.format()) != MASTER_OK)) {
+        failed = fail("format", rc);
+    }
+
+    /* Upload throughput */
+    std::vector<std::vector<uint8_t> > content(files);
+    srand(1);
+    for (uint32_t x = 0; x < files; x++) {
+        content[x].resize(fsize);
+        for (uint32_t y = 0; y < fsize; y++) {
+            content[x][y] = rand();
+        }
+    }
+
+    char name[32];
+    ESPSyncWriterStats wstats = { 0, 0, 0 };
+    master.setLineRate(baud);
+    t = now_s();
+    for (uint32_t x = 0; (x < files) && !failed; x++) {
+        snprintf(name, sizeof(name), "/file%04u.bin", x);
+        if ((rc = master.putFile(name, content[x].data(), fsize)) != MASTER_OK) {
+            failed = fail("upload", rc);
+        } else {
+            /* The reply is only sent once every write has finished */
+            ESPSyncWriterStats fstats;
+            dev_state.sync.load()->uploadStats(&fstats);
+            wstats.pages   += fstats.pages;
+            wstats.writeUs += fstats.writeUs;
+            wstats.waitUs  += fstats.waitUs;
+        }
+    }
+    t = now_s() - t;
+    master.setLineRate(0);
+    if (!failed && (files > 0)) {
+        printf("upload  : %u files x %u bytes, %.2f MB/s, %.1f files/s, longest getData() %u us\n",
+               files, fsize, (files * (double)fsize) / (t * 1e6), files / t,
+               (uint32_t)dev_state.max_call);
+        printf("writes  : %u pages, %.1f ms writing, %.1f ms waited for, %u%% overlapped\n",
+               wstats.pages, wstats.writeUs / 1e3, wstats.waitUs / 1e3,
+               ESPSYNC_WRITE_OVERLAP(wstats));
+    }
+
+    /* Failed uploads are NAK'd, and leave nothing behind */
+    if (!failed && (files > 0)) {
+        struct stat st;
+        char path[PATH_MAX], bad[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/.espsync/TEMP", root);
+        snprintf(bad, sizeof(bad), "%s/bad.bin", root);
+
+        master.setFault(MASTER_FAULT_CHKSUM);
+        if ((rc = master.putFile("/bad.bin", content[0].data(), fsize)) != 0x22) {
+            failed = fail("upload with bad checksum", rc);
+        }
+        if (!failed && ((stat(bad, &st) == 0) || (stat(path, &st) == 0))) {
+            failed = fail("failed upload left a file", 0);
+        }
+    }
+
+    /* Check what landed on disk */
+    for (uint32_t x = 0; (x < files) && !failed; x++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/file%04u.bin", root, x);
+        FILE *f = fopen(path, "rb");
+        std::vector<uint8_t> stored(fsize + 1);
+        size_t got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if ((got != fsize) || (memcmp(stored.data(), content[x].data(), fsize) != 0)) {
+            failed = fail("stored file content", x);
+        }
+    }
+
+    /* Listing with checksums, the first reads every file to build the manifest */
+    std::vector<uint8_t> listing;
+    double t_build = now_s();
+    if (!failed && ((rc = master.list(0x06, &listing)) != MASTER_OK)) {
+        failed = fail("list", rc);
+    }
+    t_build = now_s() - t_build;
+    uint32_t writes = dev_state.stream.load()->writeCalls();
+    t = now_s();
+    if (!failed && ((rc = master.list(0x02, &listing)) != MASTER_OK)) {
+        failed = fail("list", rc);
+    }
+    t = now_s() - t;
+    /* The ACK, then the reply as whole buffers */
+    writes = dev_state.stream.load()->writeCalls() - writes;
+    if (!failed) {
+        uint32_t nsiz = listing[8];
+        uint32_t esize = nsiz + 8;
+        uint32_t count = (listing.size() - 10) / esize;
+        uint32_t matched = 0;
+
+        for (uint32_t x = 0; x < count; x++) {
+            const uint8_t *e = &listing[10 + (x * esize)];
+            uint32_t n;
+            if ((sscanf((const char*)e, "/file%04u.bin", &n) == 1) && (n < files) &&
+                (get32(e + nsiz) == fsize) &&
+                (get32(e + nsiz + 4) == adler32(content[n].data(), fsize))) {
+                matched++;
+            }
+        }
+        if ((count != files) || (matched != files)) {
+            failed = fail("listing content", matched);
+        } else {
+            printf("list    : %u entries with checksums, %.2f ms rebuilding the manifest, "
+                   "%.2f ms from it, %u bytes in %u writes\n", count, t_build * 1e3, t * 1e3,
+                   (uint32_t)listing.size() + 8 + 4, writes);
+        }
+    }
+
+    /* Each change the master made was reported to the application, once */
+    if (!failed && ((dev_state.events[ESPSYNC_EVENT_SESSION_START] != 1) ||
+                    (dev_state.events[ESPSYNC_EVENT_FORMATTED] != 1) ||
+                    (dev_state.events[ESPSYNC_EVENT_FILE_RECEIVED] != files))) {
+        failed = fail("events", dev_state.events[ESPSYNC_EVENT_FILE_RECEIVED]);
+    }
+
+    if (!failed && (files > 1)) {
+        if ((rc = master.rename("/file0000.bin", "/renamed.bin")) != MASTER_OK) {
+            failed = fail("rename", rc);
+        } else if ((rc = master.remove("/renamed.bin")) != MASTER_OK) {
+            failed = fail("remove", rc);
+        } else if ((rc = master.remove("/renamed.bin")) != 0x25) {
+            failed = fail("remove missing file", rc);
+        } else if ((dev_state.events[ESPSYNC_EVENT_FILE_RENAMED] != 1) ||
+                   (dev_state.events[ESPSYNC_EVENT_FILE_REMOVED] != 1)) {
+            failed = fail("rename and remove events", 0);
+        }
+    }
+
+    /* An upload that stops part way is kept, and continued from there */
+    uint32_t resumed_at = 0;
+    if (!failed && (files > 0) && (fsize >= 4)) {
+        uint32_t offset = 0, total = 0, csum = 0;
+        struct stat st;
+
+        master.setFault(MASTER_FAULT_TRUNCATE);
+        if ((rc = master.putFile("/part.bin", content[0].data(), fsize)) != 0x21) {
+            failed = fail("upload that stops part way", rc);
+        } else if ((rc = master.resumable("/part.bin", &offset, &total, &csum)) != MASTER_OK) {
+            failed = fail("resumable", rc);
+        } else if ((offset != fsize / 2) || (total != fsize) ||
+                   (csum != adler32_update(ADLER32_INIT, content[0].data(), offset))) {
+            failed = fail("resumable offset", offset);
+        } else if ((rc = master.resumable("/other.bin", &offset, &total, &csum)) != 0x25) {
+            failed = fail("resumable of another file", rc);
+        }
+
+        /* The continuation stops part way too, then is continued again */
+        master.setFault(MASTER_FAULT_TRUNCATE);
+        if (!failed && ((rc = master.putFileResume("/part.bin", content[0].data(), fsize,
+                                                   &resumed_at)) != 0x21)) {
+            failed = fail("continuation that stops part way", rc);
+        }
+        if (!failed && ((rc = master.putFileResume("/part.bin", content[0].data(), fsize,
+                                                   &resumed_at)) != MASTER_OK)) {
+            failed = fail("putFileResume", rc);
+        }
+        if (!failed && (resumed_at <= fsize / 2)) {
+            failed = fail("continued from", resumed_at);
+        }
+
+        char path[PATH_MAX], part[PATH_MAX];
+        snprintf(part, sizeof(part), "%s/part.bin", root);
+        snprintf(path, sizeof(path), "%s/.espsync/RESUME", root);
+        FILE *f = failed ? NULL : fopen(part, "rb");
+        std::vector<uint8_t> stored(fsize + 1);
+        size_t got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (!failed && ((got != fsize) || (memcmp(stored.data(), content[0].data(), fsize) != 0))) {
+            failed = fail("continued file content", got);
+        }
+        if (!failed && (stat(path, &st) == 0)) {
+            failed = fail("continued upload left its tag", 0);
+        }
+        if (!failed && ((rc = master.remove("/part.bin")) != MASTER_OK)) {
+            failed = fail("remove continued file", rc);
+        }
+        if (!failed) {
+            printf("resume  : %u byte file, cut off twice, last continued from %u\n",
+                   fsize, resumed_at);
+        }
+    }
+
+    /**
+     * A noisy line at 921600 baud, one byte in NOISE_ONE_IN damaged.  A
+     * whole file has to be sent again until it gets through intact, in
+     * chunks only the damaged chunks are sent again.
+     */
+    if (!failed && (files > 0) && (fsize >= 16384)) {
+        const uint32_t length = 16384;
+        const uint32_t noise = 8000;
+        const uint8_t *data = content[0].data();
+        uint32_t attempts = 0, resent = 0;
+        uint64_t sent;
+        double t, t_whole, t_chunk;
+
+        master.setLineRate(921600);
+        master.setNoise(noise);
+        t = now_s();
+        do {
+            rc = master.putFile("/noisy.bin", data, length);
+        } while ((rc != MASTER_OK) && (++attempts < 50));
+        t_whole = now_s() - t;
+        if (rc != MASTER_OK) {
+            failed = fail("whole file upload over a noisy line", rc);
+        }
+
+        t = now_s();
+        if (!failed && ((rc = master.session(4)) != MASTER_OK)) {
+            failed = fail("session", rc);
+        }
+        if (!failed && ((rc = master.putFileChunked("/noisy.bin", data, length, 512,
+                                                    &resent)) != MASTER_OK)) {
+            failed = fail("chunked upload over a noisy line", rc);
+        }
+        t_chunk = now_s() - t;
+        master.setNoise(0);
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/noisy.bin", root);
+        std::vector<uint8_t> stored(length + 1);
+        FILE *f = fopen(path, "rb");
+        size_t got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (!failed && ((got != length) || (memcmp(stored.data(), data, length) != 0))) {
+            failed = fail("chunked file content", got);
+        }
+
+        /* A File cut off part way is picked up by a chunked upload */
+        master.setLineRate(0);
+        master.setFault(MASTER_FAULT_TRUNCATE);
+        if (!failed && ((rc = master.putFile("/noisy.bin", data + 1, length - 1)) != 0x21)) {
+            failed = fail("upload that stops part way", rc);
+        }
+        sent = master.txBytes();
+        if (!failed && ((rc = master.putFileChunked("/noisy.bin", data + 1, length - 1,
+                                                    512)) != MASTER_OK)) {
+            failed = fail("chunked upload of a kept file", rc);
+        }
+        sent = master.txBytes() - sent;
+        f = fopen(path, "rb");
+        got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (!failed && ((got != length - 1) || (memcmp(stored.data(), data + 1, got) != 0) ||
+                        (sent > (length * 3) / 4))) {
+            failed = fail("chunked upload carried on from the kept file", (uint32_t)sent);
+        }
+        if (!failed && (((rc = master.session(1)) != MASTER_OK) ||
+                        ((rc = master.remove("/noisy.bin")) != MASTER_OK))) {
+            failed = fail("remove chunked file", rc);
+        }
+        if (!failed) {
+            printf("noisy   : %u bytes at 921600 baud, 1 byte in %u damaged, whole %.1f KB/s "
+                   "after %u failures, chunked %.1f KB/s resending %u bytes\n",
+                   length, noise, length / (t_whole * 1024), attempts,
+                   length / (t_chunk * 1024), resent);
+        }
+    }
+
+    /* Download a file whole, then ranges of it, as a log would be followed */
+    if (!failed && (files > 1) && (fsize >= 256)) {
+        std::vector<uint8_t> got;
+        uint32_t size = 0;
+
+        t = now_s();
+        if ((rc = master.getFile("/file0001.bin", 0, 0xFFFFFFFF, &got, &size)) != MASTER_OK) {
+            failed = fail("download", rc);
+        }
+        t = now_s() - t;
+        if (!failed && ((size != fsize) || (got != content[1]))) {
+            failed = fail("downloaded content", got.size());
+        }
+        if (!failed && (((rc = master.getFile("/file0001.bin", 10, 50, &got)) != MASTER_OK) ||
+                        (got.size() != 50) ||
+                        (memcmp(got.data(), content[1].data() + 10, 50) != 0))) {
+            failed = fail("download of a range", rc);
+        }
+        if (!failed && (((rc = master.getFile("/file0001.bin", fsize - 100, 0xFFFFFFFF,
+                                              &got)) != MASTER_OK) ||
+                        (got.size() != 100) ||
+                        (memcmp(got.data(), content[1].data() + fsize - 100, 100) != 0))) {
+            failed = fail("download of the tail", rc);
+        }
+        if (!failed && (((rc = master.getFile("/file0001.bin", fsize, 0xFFFFFFFF,
+                                              &got, &size)) != MASTER_OK) ||
+                        (got.size() != 0) || (size != fsize))) {
+            failed = fail("download from the end", rc);
+        }
+        if (!failed && ((rc = master.getFile("/missing.bin", 0, 0xFFFFFFFF, &got)) != 0x25)) {
+            failed = fail("download of a missing file", rc);
+        }
+        if (!failed && ((rc = master.getFile("///RESUME", 0, 0xFFFFFFFF, &got)) != 0x26)) {
+            failed = fail("download of an internal file", rc);
+        }
+        std::vector<uint32_t> sums;
+        uint32_t bsize;
+        if (!failed && ((rc = master.signature("///MANIFEST", 512, &sums, &bsize)) != 0x26)) {
+            failed = fail("signature of an internal file", rc);
+        }
+        if (!failed) {
+            printf("download: %u byte file, %.2f MB/s, ranges and tail checked\n",
+                   fsize, fsize / (t * 1e6));
+        }
+    }
+
+    /* A renamed copy of a file the device has, then ones it can not copy */
+    if (!failed && (files > 1)) {
+        double t_copy, t_put;
+        uint64_t sent = master.txBytes();
+        uint64_t sent_put;
+
+        t = now_s();
+        if ((rc = master.putCopy("/copy0001.bin", content[1].data(), fsize,
+                                 "/file0001.bin")) != MASTER_OK) {
+            failed = fail("copy", rc);
+        }
+        t_copy = now_s() - t;
+        sent = master.txBytes() - sent;
+        if (!failed && (sent > 128)) {
+            failed = fail("copy sent the file", (uint32_t)sent);
+        }
+
+        /* Not the data asked for, so it is uploaded after all */
+        sent_put = master.txBytes();
+        t = now_s();
+        if (!failed && ((rc = master.putCopy("/copy0000.bin", content[0].data(), fsize,
+                                             "/file0001.bin")) != MASTER_OK)) {
+            failed = fail("copy of different data", rc);
+        }
+        t_put = now_s() - t;
+        sent_put = master.txBytes() - sent_put;
+        if (!failed && (sent_put < fsize)) {
+            failed = fail("copy of different data was not uploaded", (uint32_t)sent_put);
+        }
+        if (!failed && ((rc = master.putCopy("/copy0002.bin", content[0].data(), fsize,
+                                             "/missing.bin")) != MASTER_OK)) {
+            failed = fail("copy of a missing file", rc);
+        }
+
+        const char *copies[3] = { "copy0001.bin", "copy0000.bin", "copy0002.bin" };
+        const uint8_t made[3] = { 1, 0, 0 };
+        for (uint32_t x = 0; (x < 3) && !failed; x++) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", root, copies[x]);
+            std::vector<uint8_t> stored(fsize + 1);
+            FILE *f = fopen(path, "rb");
+            size_t got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+            if (f != NULL) {
+                fclose(f);
+            }
+            if ((got != fsize) || (memcmp(stored.data(), content[made[x]].data(), fsize) != 0)) {
+                failed = fail("copied file content", x);
+            }
+        }
+        /* The copy is in the manifest with the source's checksum */
+        if (!failed && (check_listing(&master, root, 0x3) < 0)) {
+            failed = fail("listing after copies", 0);
+        }
+        for (uint32_t x = 0; (x < 3) && !failed; x++) {
+            snprintf(name, sizeof(name), "/%s", copies[x]);
+            if ((rc = master.remove(name)) != MASTER_OK) {
+                failed = fail("remove copy", rc);
+            }
+        }
+        if (!failed) {
+            printf("copy    : %u byte file, %u bytes sent, %.2f ms, %.2f ms to upload it\n",
+                   fsize, (uint32_t)sent, t_copy * 1e3, t_put * 1e3);
+        }
+    }
+
+    /* Update a file in place, sending only what changed */
+    if (!failed && (files > 1) && (fsize >= 4096)) {
+        std::vector<uint8_t> edited(content[1]);
+        uint32_t at = fsize / 4;
+        for (uint32_t y = 0; y < 100; y++) {
+            edited[at + y] ^= 0x5A;
+        }
+        edited.insert(edited.begin() + (fsize / 2), 37, 0xA5);
+        edited.erase(edited.begin() + ((fsize / 4) * 3), edited.begin() + ((fsize / 4) * 3) + 50);
+
+        uint64_t sent = master.txBytes();
+        t = now_s();
+        if ((rc = master.putDelta("/file0001.bin", edited.data(), edited.size(),
+                                  "/file0001.bin", 512)) != MASTER_OK) {
+            failed = fail("delta upload", rc);
+        }
+        t = now_s() - t;
+        sent = master.txBytes() - sent;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/file0001.bin", root);
+        FILE *f = fopen(path, "rb");
+        std::vector<uint8_t> stored(edited.size() + 1);
+        size_t got = (f != NULL) ? fread(stored.data(), 1, stored.size(), f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (!failed && ((got != edited.size()) ||
+                        (memcmp(stored.data(), edited.data(), got) != 0))) {
+            failed = fail("delta stored file content", got);
+        }
+        if (!failed) {
+            printf("delta   : %u byte file, %u bytes sent (%.1f%%), %.2f ms\n",
+                   (uint32_t)edited.size(), (uint32_t)sent,
+                   (sent * 100.0) / edited.size(), t * 1e3);
+        }
+    }
+
+    /* The same, to a UART that only holds 256 bytes, while flash is slow */
+    if (!failed && (files > 0) && (fsize >= 4096)) {
+        int dropped;
+        t = now_s();
+        dropped = uart_delta(&fs, root, 256, 115200, content[0]);
+        t = now_s() - t;
+        if (dropped != 0) {
+            failed = fail("delta through a small UART FIFO", dropped);
+        } else {
+            printf("uart    : %u byte delta upload through a 256 byte FIFO at 115200 baud, "
+                   "5 ms page writes, nothing dropped, %.2f s\n", fsize, t);
+        }
+        fs.setWriteDelay(wdelay);
+    }
+
+    /* Web content, sent plain then compressed, over a serial line */
+    if (!failed) {
+        static const char *words[] = { "<div class=\"row\">", "</div>", "<span>", "</span>",
+                                       "function", "return", "var ", "{ ", "} ", "color: #333;",
+                                       "margin: 0 auto;", "\n", "  ", "sensor", "value" };
+        std::vector<uint8_t> page;
+        while (page.size() < 16384) {
+            const char *w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+            page.insert(page.end(), w, w + strlen(w));
+            if ((rand() % 4) == 0) {
+                page.push_back('0' + (rand() % 10));
+            }
+        }
+        uint32_t rate = (baud != 0) ? baud : 115200;
+        double t_raw, t_lz;
+        uint64_t sent_lz;
+
+        master.setLineRate(rate);
+        t = now_s();
+        if ((rc = master.putFile("/page.htm", page.data(), page.size())) != MASTER_OK) {
+            failed = fail("plain web page upload", rc);
+        }
+        t_raw = now_s() - t;
+        sent_lz = master.txBytes();
+        t = now_s();
+        if (!failed && ((rc = master.putFileLZ("/page.htm", page.data(), page.size())) != MASTER_OK)) {
+            failed = fail("compressed web page upload", rc);
+        }
+        t_lz = now_s() - t;
+        sent_lz = master.txBytes() - sent_lz;
+        master.setLineRate(0);
+
+        if (!failed && ((rc = master.putFileLZ("/page.lz", page.data(), page.size(), true)) != MASTER_OK)) {
+            failed = fail("compressed web page upload, stored compressed", rc);
+        }
+
+        /* One is stored as it was, the other still compressed */
+        char path[PATH_MAX];
+        std::vector<uint8_t> stored(page.size() + 1);
+        std::vector<uint8_t> unpacked(page.size() + 1);
+        size_t got = 0, made = 0;
+        snprintf(path, sizeof(path), "%s/page.htm", root);
+        FILE *f = fopen(path, "rb");
+        if (f != NULL) {
+            got = fread(stored.data(), 1, stored.size(), f);
+            fclose(f);
+        }
+        if (!failed && ((got != page.size()) || (memcmp(stored.data(), page.data(), got) != 0))) {
+            failed = fail("compressed upload stored file content", got);
+        }
+        snprintf(path, sizeof(path), "%s/page.lz", root);
+        f = fopen(path, "rb");
+        if (f != NULL) {
+            got = fread(stored.data(), 1, stored.size(), f);
+            fclose(f);
+        }
+        ESPSyncLZ lz;
+        lz.begin(ESPSYNC_LZ_WINDOW_BITS);
+        lz.decode(stored.data(), got, unpacked.data(), unpacked.size(), &made);
+        if (!failed && ((made != page.size()) || !lz.idle() || lz.error() ||
+                        (memcmp(unpacked.data(), page.data(), made) != 0))) {
+            failed = fail("file stored compressed", made);
+        }
+        if (!failed) {
+            printf("lz      : %u byte page, %u bytes sent (%.1f%%), %.1f KB/s plain, "
+                   "%.1f KB/s compressed at %u baud\n",
+                   (uint32_t)page.size(), (uint32_t)sent_lz, (sent_lz * 100.0) / page.size(),
+                   page.size() / (t_raw * 1024), page.size() / (t_lz * 1024), rate);
+        }
+    }
+
+    /* Many small files, where round trips dominate */
+    if (!failed && (small > 0)) {
+        std::vector<uint8_t> sdata(512);
+        for (uint32_t y = 0; y < sdata.size(); y++) {
+            sdata[y] = rand();
+        }
+        double t_saw = 0;
+        double t_win = 0;
+        double t_batch = 0;
+
+        /* Create them first, so both timed passes overwrite the same files */
+        for (uint32_t x = 0; (x < small) && !failed; x++) {
+            snprintf(name, sizeof(name), "/s%04u.bin", x);
+            if ((rc = master.putFile(name, sdata.data(), sdata.size())) != MASTER_OK) {
+                failed = fail("small file upload", rc);
+            }
+        }
+
+        t = now_s();
+        for (uint32_t x = 0; (x < small) && !failed; x++) {
+            snprintf(name, sizeof(name), "/s%04u.bin", x);
+            if ((rc = master.putFile(name, sdata.data(), sdata.size())) != MASTER_OK) {
+                failed = fail("small file upload", rc);
+            }
+        }
+        t_saw = now_s() - t;
+
+        /* Replies to the windowed uploads carry CRC-32C */
+        if (!failed && (((rc = master.session(window, 0x07)) != MASTER_OK) ||
+                        (master.csum() != CSUM_CRC32C))) {
+            failed = fail("session", rc);
+        }
+        t = now_s();
+        for (uint32_t x = 0; (x < small) && !failed; x++) {
+            snprintf(name, sizeof(name), "/s%04u.bin", x);
+            if ((rc = master.queueFile(name, sdata.data(), sdata.size())) != MASTER_OK) {
+                failed = fail("windowed small file upload", rc);
+            }
+        }
+        if (!failed && ((rc = master.drain()) != MASTER_OK)) {
+            failed = fail("windowed small file upload", rc);
+        }
+        t_win = now_s() - t;
+
+        for (uint32_t x = 0; (x < small) && !failed; x++) {
+            struct stat st;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/s%04u.bin", root, x);
+            if ((stat(path, &st) != 0) || (st.st_size != (off_t)sdata.size())) {
+                failed = fail("windowed file stored", x);
+            }
+        }
+        uint8_t granted = master.window();
+        if (!failed && ((rc = master.session(1)) != MASTER_OK)) {
+            failed = fail("session", rc);
+        }
+
+        /* The same again, many files to a message */
+        char bnames[ESPSYNC_BATCH_FILES][16];
+        ESPSyncMasterFile batch[ESPSYNC_BATCH_FILES];
+        uint8_t status[ESPSYNC_BATCH_FILES];
+        t = now_s();
+        for (uint32_t x = 0; (x < small) && !failed; x += ESPSYNC_BATCH_FILES) {
+            uint8_t n = ((small - x) < ESPSYNC_BATCH_FILES) ? (small - x) : ESPSYNC_BATCH_FILES;
+            for (uint8_t y = 0; y < n; y++) {
+                snprintf(bnames[y], sizeof(bnames[y]), "/s%04u.bin", x + y);
+                batch[y].name = bnames[y];
+                batch[y].data = sdata.data();
+                batch[y].length = sdata.size();
+            }
+            if ((rc = master.putBatch(batch, n, status)) != MASTER_OK) {
+                failed = fail("batch upload", rc);
+            }
+            for (uint8_t y = 0; (y < n) && !failed; y++) {
+                if (status[y] != 0x06) {
+                    failed = fail("batch upload file", status[y]);
+                }
+            }
+        }
+        t_batch = now_s() - t;
+
+        /* A bad record only loses that file */
+        if (!failed) {
+            struct stat st;
+            char path[PATH_MAX];
+            batch[0].name = "/bad.bin";
+            batch[1].name = "/good.bin";
+            master.setFault(MASTER_FAULT_CHKSUM);
+            if (((rc = master.putBatch(batch, 2, status)) != MASTER_OK) ||
+                (status[0] != 0x22) || (status[1] != 0x06)) {
+                failed = fail("batch with a bad record", rc);
+            }
+            snprintf(path, sizeof(path), "%s/bad.bin", root);
+            if (!failed && (stat(path, &st) == 0)) {
+                failed = fail("bad batch record left a file", 0);
+            }
+            if (!failed && ((rc = master.remove("/good.bin")) != MASTER_OK)) {
+                failed = fail("remove batch file", rc);
+            }
+        }
+
+        if (!failed) {
+            printf("small   : %u files x %u bytes, %.1f files/s stop and wait, "
+                   "%.1f files/s with a window of %u, %.1f files/s in batches of %u\n",
+                   small, (uint32_t)sdata.size(), small / t_saw, small / t_win,
+                   granted, small / t_batch, ESPSYNC_BATCH_FILES);
+        }
+    }
+
+    /* Every kind of upload, rename and remove kept the manifest right */
+    if (!failed && ((rc = check_listing(&master, root, 0x03)) < 0)) {
+        failed = fail("manifest after changes", rc);
+    }
+    /* A file added behind the protocol's back makes it stale */
+    if (!failed) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/outside.txt", root);
+        FILE *f = fopen(path, "wb");
+        if (f != NULL) {
+            fputs("Written by the application", f);
+            fclose(f);
+        }
+        /* A plain listing walks the directory while it is stale, then uses it */
+        int plain = check_listing(&master, root, 0x00);
+        int before = check_listing(&master, root, 0x03);
+        if ((before < 0) || (plain != before) ||
+            ((rc = check_listing(&master, root, 0x00)) != before)) {
+            failed = fail("plain listing", rc);
+        }
+        unlink(path);
+        if (!failed && ((rc = check_listing(&master, root, 0x00)) != before - 1)) {
+            failed = fail("plain listing of a stale manifest", rc);
+        }
+        if (!failed && ((rc = check_listing(&master, root, 0x03)) != before - 1)) {
+            failed = fail("stale manifest rebuilt", rc);
+        }
+    }
+
+    /* One round trip shows nothing changed, and a second where */
+    if (!failed) {
+        static const char *prefixes[] = { "/file", "/s", "/page" };
+        uint32_t files_got[4], hashes_got[4];
+        uint32_t files_want[4], hashes_want[4];
+
+        uint64_t sent = master.txBytes();
+        t = now_s();
+        rc = master.hash(prefixes, 3, 0, files_got, hashes_got);
+        t = now_s() - t;
+        sent = master.txBytes() - sent;
+        disk_hashes(root, prefixes, 3, files_want, hashes_want);
+        if ((rc != MASTER_OK) ||
+            (memcmp(files_got, files_want, sizeof(files_got)) != 0) ||
+            (memcmp(hashes_got, hashes_want, sizeof(hashes_got)) != 0)) {
+            failed = fail("hash of every file", rc);
+        } else {
+            printf("hash    : %u files, %u bytes sent and %u received, %.2f ms, "
+                   "a listing with checksums is %u bytes\n",
+                   files_got[0], (uint32_t)sent, 8 + (4 * 8) + 4, t * 1e3,
+                   8 + 10 + (files_got[0] * (listing[8] + 8)) + 4);
+        }
+
+        /* Only the hashes covering a changed file change */
+        if (!failed && (small > 0)) {
+            std::vector<uint8_t> sdata(512, 0x5A);
+            if ((rc = master.putFile("/s0000.bin", sdata.data(), sdata.size())) != MASTER_OK) {
+                failed = fail("small file upload", rc);
+            } else if ((rc = master.hash(prefixes, 3, 0, files_want, hashes_want)) != MASTER_OK) {
+                failed = fail("hash after a change", rc);
+            } else if ((hashes_want[0] == hashes_got[0]) || (hashes_want[1] != hashes_got[1]) ||
+                       (hashes_want[2] == hashes_got[2]) || (hashes_want[3] != hashes_got[3])) {
+                failed = fail("hash narrowed to the changed prefix", 0);
+            }
+        }
+    }
+
+    /* Each checksum a session can agree on, on small requests and long replies */
+    if (!failed && (files > 1)) {
+        for (uint8_t c = 0; (c < CSUM_ALGORITHMS) && !failed; c++) {
+            std::vector<uint8_t> got;
+            ESPSyncStats dstats;
+            if (((rc = master.session(1, 1 << c)) != MASTER_OK) || (master.csum() != c)) {
+                failed = fail("session checksum", c);
+            } else if ((rc = check_listing(&master, root, 0x03)) < 0) {
+                failed = fail("listing with a session checksum", c);
+            } else if (((rc = master.getFile("/file0002.bin", 0, 0xFFFFFFFF, &got)) != MASTER_OK) ||
+                       (got != content[2])) {
+                failed = fail("download with a session checksum", c);
+            } else if ((rc = master.stats(false, &dstats)) != MASTER_OK) {
+                failed = fail("stats with a session checksum", c);
+            }
+        }
+        if (!failed && (((rc = master.session(1)) != MASTER_OK) ||
+                        (master.csum() != CSUM_ADLER32))) {
+            failed = fail("session back to Adler-32", rc);
+        }
+        if (!failed) {
+            printf("session : Adler-32, CRC-32 and CRC-32C each agreed and used for CHK2\n");
+        }
+    }
+
+    /* Directories are walked, and files keep the date they were sent with */
+    if (!failed) {
+        static const uint8_t sent[6] = { 1, 1, 0, 0, 0, 0 };
+        std::vector<uint8_t> ddata(1000, 0xA5);
+        std::vector<uint8_t> listing;
+        char path[PATH_MAX];
+        uint8_t outside[6] = { 0, 0, 0, 0, 0, 0 };
+        uint8_t found = 0;
+        struct stat st;
+
+        if (((rc = master.session(1)) != MASTER_OK) ||
+            (master.fsCaps() != (ESPSYNC_FS_DIRS | ESPSYNC_FS_MTIME))) {
+            failed = fail("filesystem capabilities", master.fsCaps());
+        } else if ((rc = master.putFile("/dir/sub/deep.bin", ddata.data(), ddata.size())) != MASTER_OK) {
+            failed = fail("upload into a directory", rc);
+        } else {
+            /* And one the application wrote, it has the time it was written */
+            snprintf(path, sizeof(path), "%s/dir/outside.txt", root);
+            FILE *f = fopen(path, "wb");
+            if (f != NULL) {
+                fputs("Written by the application", f);
+                fclose(f);
+            }
+            if ((stat(path, &st) != 0) || !espsync_time_date(st.st_mtime, outside)) {
+                failed = fail("application file", 0);
+            }
+        }
+        if (!failed && ((rc = master.list(0x05, &listing)) == MASTER_OK)) {
+            uint32_t nsiz = listing[8];
+            uint32_t esize = nsiz + 4 + 6;
+            for (uint32_t x = 10; x + esize <= listing.size() - 4; x += esize) {
+                const uint8_t *date = &listing[x + nsiz + 4];
+                if (strcmp((const char*)&listing[x], "/dir/sub/deep.bin") == 0) {
+                    found |= (memcmp(date, sent, 6) == 0) ? 0x1 : 0x4;
+                } else if (strcmp((const char*)&listing[x], "/dir/outside.txt") == 0) {
+                    found |= (memcmp(date, outside, 6) == 0) ? 0x2 : 0x4;
+                }
+            }
+        }
+        if (!failed && ((rc != MASTER_OK) || (found != 0x3) ||
+                        (check_listing(&master, root, 0x03) < 0))) {
+            failed = fail("listing of directories, with dates", (rc != MASTER_OK) ? rc : found);
+        }
+        /* Removing the last file in a directory removes it too */
+        if (!failed && (((rc = master.remove("/dir/sub/deep.bin")) != MASTER_OK) ||
+                        ((rc = master.remove("/dir/outside.txt")) != MASTER_OK))) {
+            failed = fail("remove from a directory", rc);
+        }
+        snprintf(path, sizeof(path), "%s/dir", root);
+        if (!failed && (stat(path, &st) == 0)) {
+            failed = fail("empty directory left behind", 0);
+        }
+        if (!failed) {
+            printf("dirs    : files listed by whole path, with the date sent or written\n");
+        }
+    }
+
+    /* Several ports at once, sharing the filesystem, against one alone */
+    if (!failed && (files > 0) && (sessions > 0)) {
+        uint32_t timeout = 1000 + (((uint64_t)fsize / 256) * wdelay * sessions) / 1000;
+        double t_one = sessions_upload(&fs, root, 1, timeout, content);
+        double t_all = (t_one > 0) ? sessions_upload(&fs, root, sessions, timeout, content) : -1;
+        if ((t_one < 0) || (t_all < 0)) {
+            failed = fail("uploads over several sessions", 0);
+        } else {
+            double one = (files * (double)fsize) / (t_one * 1e6);
+            double all = (sessions * files * (double)fsize) / (t_all * 1e6);
+            printf("ports   : 1 session %.2f MB/s, %u at once %.2f MB/s together (%.1fx), "
+                   "one filesystem\n", one, sessions, all, all / one);
+        }
+    }
+
+    /* Find the fastest rate the line carries, 3M fails and falls back */
+    if (!failed) {
+        static const uint32_t rates[] = { 3000000, 921600, 460800 };
+        std::vector<uint8_t> bdata(16384);
+        uint32_t chosen = 0;
+        double t_slow, t_fast, t_probe;
+
+        for (uint32_t x = 0; x < bdata.size(); x++) {
+            bdata[x] = rand();
+        }
+        master.setLineRate(115200);
+        t = now_s();
+        if ((rc = master.putFile("/baud.bin", bdata.data(), bdata.size())) != MASTER_OK) {
+            failed = fail("upload at 115200", rc);
+        }
+        t_slow = now_s() - t;
+
+        t = now_s();
+        if (!failed && (((rc = master.probeBaud(rates, 3, &chosen)) != MASTER_OK) ||
+                        (chosen != 921600))) {
+            failed = fail("line rate probe", (rc != MASTER_OK) ? rc : (int)chosen);
+        }
+        t_probe = now_s() - t;
+
+        t = now_s();
+        if (!failed && ((rc = master.putFile("/baud.bin", bdata.data(), bdata.size())) != MASTER_OK)) {
+            failed = fail("upload at the probed rate", rc);
+        }
+        t_fast = now_s() - t;
+
+        if (!failed && ((rc = master.setBaud(115200)) != MASTER_OK)) {
+            failed = fail("line rate back to 115200", rc);
+        }
+        master.setLineRate(0);
+        if (!failed && ((rc = master.remove("/baud.bin")) != MASTER_OK)) {
+            failed = fail("remove baud test file", rc);
+        }
+        if (!failed) {
+            printf("baud    : %u bytes, %.2f s at 115200, %.2f s at %u, "
+                   "%.2f s to find it\n", (uint32_t)bdata.size(), t_slow, t_fast,
+                   chosen, t_probe);
+        }
+    }
+
+    if (!failed && (dev_state.pt_count != 0)) {
+        failed = fail("protocol bytes leaked to the application", dev_state.pt_count);
+    }
+
+    /* Application traffic, then check the protocol still works after it */
+    if (!failed && (ptlen > 0)) {
+        if (!passthrough(&dev_state, &master, mfd, ptlen, PT_BYTE) ||
+            !passthrough(&dev_state, &master, mfd, ptlen, PT_BULK) ||
+            !passthrough(&dev_state, &master, mfd, ptlen, PT_POLL)) {
+            failed = fail("application data", dev_state.pt_count);
+        }
+    }
+
+    /* Everything above shows up in the slave's statistics */
+    if (!failed) {
+        ESPSyncStats st;
+        uint32_t rejects = 0;
+        uint32_t naks = 0;
+        uint32_t served = 0;
+
+        if ((rc = master.stats(true, &st)) != MASTER_OK) {
+            failed = fail("stats", rc);
+        } else {
+            for (uint8_t x = 0; x < ESPSYNC_STATS_REJECTS; x++) {
+                rejects += st.rejects[x];
+            }
+            for (uint8_t x = 0; x < ESPSYNC_STATS_NAKS; x++) {
+                naks += st.naks[x];
+            }
+            for (uint8_t x = 0; x < ESPSYNC_STATS_COMMANDS; x++) {
+                served += histogram_count(st.service[x]);
+            }
+            /* 0x21 and 0x22 from the failed uploads, 0x65 is File */
+            if ((st.rxApp != dev_state.pt_count) || (st.rxBytes <= st.rxApp) ||
+                (st.rxDropped != 0) ||
+                (st.naks[0] == 0) || (st.naks[1] == 0) ||
+                ((ptlen > 0) && (rejects == 0)) ||
+                (st.flashBytes < (uint64_t)files * fsize) ||
+                (histogram_count(st.write) == 0) ||
+                (histogram_count(st.service[0x65 - 0x60]) < files)) {
+                failed = fail("stats content", 0);
+            }
+        }
+        if (!failed) {
+            printf("stats   : %u bytes received, %u passed through, %u headers rejected, "
+                   "%u of %u replies NAKs, %u bytes written, writes mostly %s, "
+                   "uploads mostly %s, stream read mostly every %s\n",
+                   st.rxBytes, st.rxApp, rejects, naks, served, st.flashBytes,
+                   histogram_mode(st.write), histogram_mode(st.service[0x65 - 0x60]),
+                   histogram_mode(st.loop));
+        }
+
+        /* Reset once read, so only this request has been seen since */
+        if (!failed && (((rc = master.stats(false, &st)) != MASTER_OK) ||
+                        (st.rxApp != 0) || (st.flashBytes != 0) ||
+                        (st.rxBytes != 8 + 1 + 4))) {
+            failed = fail("stats reset", rc);
+        }
+    }
+
+    if (latency > 0) {
+        link.stop = true;
+        relay.join();
+        close(lv[0]);
+        close(lv[1]);
+    }
+    dev_state.stop = true;
+    dev.join();
+    close(sv[0]);
+    close(sv[1]);
+
+    /* The one allowed is starting the writer thread, an ESP32 task is static */
+    if (!failed && (dev_state.allocs > 1)) {
+        failed = fail("device heap allocations", dev_state.allocs);
+    }
+    if (!failed) {
+        printf("memory  : %u bytes for ESPSync, all of it, %u heap allocation serving everything above\n",
+               (unsigned)sizeof(ESPSync), (unsigned)dev_state.allocs);
+    }
+
+    fs.format();
+    rmdir(root);
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed;
+}
@@ -0,0 +1,83 @@
+/**
+ *  ESP Sync host build, serve a directory on a pty
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Runs the ESPSync protocol handler against a pseudo terminal, so that
+ * extras/espsync.py (or any other master) can be pointed at the printed
+ * /dev/pts/N device instead of a real board.  Any data that is not
+ * protocol traffic is echoed to stdout, as a sketch would see it.
+ */
+#include "ESPSync.h"
+#include "ESPSyncPosixStream.h"
+#include "ESPSyncPosixFS.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <termios.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <directory> [size in KB]\n", argv[0]);
+        return 64;
+    }
+    uint32_t size = (argc > 2) ? strtoul(argv[2], NULL, 0) * 1024 : 4*1024*1024;
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0)) {
+        perror("pty");
+        return 71;
+    }
+
+    /* Hold the slave open, so the master never sees a hangup between clients */
+    const char *slave_name = ptsname(master);
+    int slave = open(slave_name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if ((slave < 0) || (tcgetattr(slave, &tio) != 0)) {
+        perror(slave_name);
+        return 71;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    ESPSyncPosixFS     fs(argv[1], size);
+    ESPSyncPosixStream stream(master);
+    ESPSync            sync;
+
+    if (!fs.begin()) {
+        fprintf(stderr, "%s: not a directory\n", argv[1]);
+        return 66;
+    }
+    sync.setFS(&fs);
+    sync.setStream(&stream);
+
+    printf("%s\n", slave_name);
+    fflush(stdout);
+
+    for (;;) {
+        uint8_t data;
+        if (sync.getData(&data)) {
+            putchar(data);
+            fflush(stdout);
+        } else if (stream.available() == 0) {
+            stream.wait(100);
+        }
+    }
+    return 0;
+}
@@ -15,15 +15,26 @@
  * You should have received a copy of the GNU General Public License 
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
-#if not (defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266))
+#if defined(ARDUINO) && !(defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266))
 #error "ERROR: ESPSync Library only works on ESP32 or ESP8266"
 #endif
 
 #include "ESPSync.h"
+#include "ESPSyncChecksum.h"
 
 #include <time.h>
 #include <sys/time.h>
-#include "FS.h"
+
+/* The filesystem used until setFS() is called, SPIFFS unless ESPSYNC_LITTLEFS */
+#if defined(ARDUINO) && defined(ESPSYNC_LITTLEFS)
+#include "ESPSyncFS_LittleFS.h"
+
+static ESPSyncLittleFS default_fs;
+#elif defined(ARDUINO)
+#include "ESPSyncFS_SPIFFS.h"
+
+static ESPSyncSPIFFS default_fs;
+#endif
 
 #define RANGE_CHK(x,minx,maxx) ((x - minx) <= (maxx - minx))
 #define BYTEAT(value,pos) ((value >> pos) & 0xFF)
@@ -69,8 +80,26 @@
 #define CMD_REMOVE   (0x63)
 #define CMD_RENAME   (0x64)
 #define CMD_FILE     (0x65)
+#define CMD_SESSION  (0x66)
+#define CMD_SIGNATURE (0x67)
+#define CMD_DELTA    (0x68)
+#define CMD_FILE_LZ  (0x69)
+#define CMD_HASH     (0x6A)
+#define CMD_BATCH    (0x6B)
+#define CMD_BAUD     (0x6C)
+#define CMD_STATS    (0x6D)
+#define CMD_RESUME   (0x6E)
+#define CMD_CONTINUE (0x6F)
 #define CMD_FIRST    (CMD_SET_TIME)
-#define CMD_LAST     (CMD_FILE)
+#define CMD_LAST     (CMD_CONTINUE)
+
+/* Commands beyond the first 16, in a second bank */
+#define CMD_CHUNKED  (0x80)
+#define CMD_CHUNK    (0x81)
+#define CMD_GET      (0x82)
+#define CMD_COPY     (0x83)
+#define CMD_EXT_FIRST (CMD_CHUNKED)
+#define CMD_EXT_LAST (CMD_COPY)
 
 #define RPL_TIME_SET (0x70)
 #define RPL_FORMATED (0x71)
@@ -78,6 +107,17 @@
 #define RPL_REMOVED  (0x73)
 #define RPL_RENAMED  (0x74)
 #define RPL_RECEIVED (0x75)
+#define RPL_SESSION  (0x76)
+#define RPL_SIGNATURE (0x77)
+#define RPL_HASH     (0x7A)
+#define RPL_BATCH    (0x7B)
+#define RPL_BAUD     (0x7C)
+#define RPL_STATS    (0x7D)
+#define RPL_RESUME   (0x7E)
+#define RPL_CHUNKED  (0x90)
+#define RPL_CHUNK    (0x91)
+#define RPL_FILE     (0x92)
+/* A delta or compressed file is answered with RPL_RECEIVED, like a whole file */
 
 /**
  * Receive States
@@ -93,98 +133,255 @@
 
 #define RXSTATE_WAIT_DATA     (0x08)
 
-#define RXSTATE_WAIT_CHK2_HI   (0x09)
-#define RXSTATE_WAIT_CHK2_LO   (0x0A)
+#define RXSTATE_WAIT_CHK2_24   (0x09)
+#define RXSTATE_WAIT_CHK2_16   (0x0A)
+#define RXSTATE_WAIT_CHK2_8    (0x0B)
+#define RXSTATE_WAIT_CHK2_0    (0x0C)
+
+#define RXSTATE_FILE_NSIZ      (0x0D)
+#define RXSTATE_FILE_NAME      (0x0E)
+#define RXSTATE_FILE_DATA      (0x0F)
+#define RXSTATE_DISCARD        (0x10)
+
+#define RXSTATE_DELTA_HEAD     (0x11)
+#define RXSTATE_DELTA_BASE     (0x12)
+#define RXSTATE_DELTA_OP       (0x13)
+#define RXSTATE_DELTA_LITERAL  (0x14)
+#define RXSTATE_COPY_PAGE      (0x15)
+
+#define RXSTATE_LZ_HEAD        (0x16)
+#define RXSTATE_LZ_DATA        (0x17)
+
+#define RXSTATE_BATCH_NSIZ     (0x18)
+#define RXSTATE_BATCH_NAME     (0x19)
+#define RXSTATE_BATCH_DATA     (0x1A)
+#define RXSTATE_BATCH_RCHK     (0x1B)
+
+#define RXSTATE_RESUME_HEAD    (0x1C)
+#define RXSTATE_CHUNK_DATA     (0x1D)
+
+#define TEMP_BUFFER_SIZE (ESPSYNC_TEMP_BUFFER_SIZE)
+
+
+#define DURATION_FORMAT (10)  /* 10 Seconds per megabyte */
+#define DURATION_REHASH (2000) /* ms per megabyte, to rebuild the manifest */
+#define DURATION_COPY   (4000) /* ms per megabyte, to copy a file */
+
+/* Longest gap allowed between bytes of a message body, in ms.
+   About 576 characters @ 115200bps */
+#define RX_TIMEOUT (50)
+
+/* Bytes of a file read at once, when calculating its checksum */
+#define CSUM_READ_SIZE (64)
+
+/* Name of the file data is received into, before being renamed */
+#define TEMP_FILE_NAME "///TEMP"
+
+/* Name, size and checksum of the temp file, when it is kept to be continued */
+#define RESUME_FILE_NAME "///RESUME"
 
 /**
- * Checksum calculation modes
+ * Delta Definitions
  */
-#define CSUM_SKIP       (0x00)
-#define CSUM_FLETCHER16 (0x01)
-#define CSUM_ADLER32    (0x02)
+#define DELTA_MIN_BLOCK  (16)
+#define DELTA_MAX_BLOCK  (16384)
+#define DELTA_HEAD_SIZE  (7)     /* BSIZ, FCHK and BLEN */
+#define DELTA_OP_COPY    (0x01)  /* IDX(4) CNT(2), blocks of the base file */
+#define DELTA_OP_LITERAL (0x02)  /* LEN(2) then that many bytes */
 
-/* Has to be big enough to hold largest small messages data*/
-#define TEMP_BUFFER_SIZE (70)
+/* Most name prefixes a Hash command can ask about */
+#define HASH_MAX_PREFIX  (8)
 
+/**
+ * Batch Definitions
+ */
+#define BATCH_HEAD_SIZE  (6 + 4)  /* DATE and FSIZE, after the name */
+#define BATCH_RCHK_SIZE  (4)
 
-#define DURATION_FORMAT (10)  /* 10 Seconds per megabyte */
+/**
+ * Resume Definitions
+ */
+#define RESUME_HEAD_SIZE (8)     /* OFFSET and FCHK, after the date */
+#define RESUME_UNKNOWN   (0)     /* Not looked for, since starting */
+#define RESUME_NONE      (1)
+#define RESUME_KEPT      (2)
 
-class dQueue
-{
-    public:
-        dQueue(uint8_t size);
-        void put(uint8_t data);
-        bool any(void);
-        uint8_t get(void);
-        void flush(void);
+/**
+ * Chunked File Definitions
+ */
+#define CHUNKED_SIZE     (1 + 6 + 4 + 4 + 2 + 1 + 4) /* Less the name */
+#define CHUNKED_RESTART  (0x01)  /* Throw away anything kept, and start again */
 
-    private:
-        uint8_t pbsize;
-        uint8_t *pending_bytes;
-        uint8_t *pbnext;
-        uint8_t *pblast;
+/**
+ * Get Definitions
+ */
+#define GET_HEAD_SIZE    (4 + 4)  /* OFFSET and LENGTH, before the name */
+#define GET_REPLY_HEAD   (4 + 4)  /* FSIZE and OFFSET, before the data */
+#define GET_MAX_DATA     (0xFFFFFF - GET_REPLY_HEAD - 4)
 
-        uint8_t* incpb(uint8_t* pb);
-};
+/**
+ * Copy Definitions
+ */
+#define COPY_HEAD_SIZE   (4 + 1)  /* FCHK and SNSIZ, after the date */
 
-dQueue::dQueue(uint8_t size) 
-{
-    pbsize = size+1;
-    pending_bytes = new uint8_t[pbsize];
-    flush();
-}
+/* Slowest line rate the Baud command may ask for */
+#define BAUD_MIN         (9600)
+
+/* Stats command option, clear them once they have been sent */
+#define STATS_OPT_RESET  (0x01)
+
+/**
+ * Compressed File Definitions
+ */
+#define LZ_HEAD_SIZE     (6)     /* FLAGS, WBITS and DSIZE */
+#define LZ_FLAG_STORE    (0x01)  /* Keep the file compressed */
 
-uint8_t *dQueue::incpb(uint8_t* pb)
+dQueue::dQueue(void)
 {
-    pb++;
-    if (pb >= &pending_bytes[pbsize]) {
-        pb = pending_bytes;
-    }
-    return pb;
+    flush();
 }
 
-void dQueue::put(uint8_t data)
+bool dQueue::put(uint8_t data)
 {
-    uint8_t* pbstep = incpb(pblast);
-    if (pbstep != pbnext) {
-        *pblast = data;
-        pblast = pbstep;
+    if ((uint16_t)(_tail - _head) == ESPSYNC_PASSTHROUGH_SIZE) {
+        return false;
     }
+    _buf[_tail % ESPSYNC_PASSTHROUGH_SIZE] = data;
+    _tail++;
+    return true;
 }
 
 bool dQueue::any(void) {
-    return (pbnext != pblast);
+    return (_head != _tail);
 }
 
 uint8_t dQueue::get(void) {
     uint8_t data = 0x00;
     if (any()) {
-        data = *pbnext;
-        pbnext = incpb(pbnext);
+        data = _buf[_head % ESPSYNC_PASSTHROUGH_SIZE];
+        _head++;
     }
     return data;
 }
 
+size_t dQueue::get(uint8_t *buf, size_t length) {
+    size_t got = 0;
+
+    /* At most two runs, up to the end of the ring then from the start */
+    while ((got < length) && any()) {
+        uint16_t at = _head % ESPSYNC_PASSTHROUGH_SIZE;
+        size_t   n  = (uint16_t)(_tail - _head);
+        if (n > (size_t)(ESPSYNC_PASSTHROUGH_SIZE - at)) {
+            n = ESPSYNC_PASSTHROUGH_SIZE - at;
+        }
+        if (n > length - got) {
+            n = length - got;
+        }
+        memcpy(buf + got, _buf + at, n);
+        _head += n;
+        got += n;
+    }
+    return got;
+}
+
 void dQueue::flush(void) {
-    pbnext = pblast = pending_bytes;
+    _head = _tail = 0;
 }
 
 
-ESPSync::ESPSync(void)
+/**
+ * Each instance sharing a filesystem needs its own temp and resume
+ * files.  The first keeps the plain names, the others add ".<instance>".
+ */
+static void instance_name(char *buf, const char *name, uint8_t instance)
+{
+    if (instance == 0) {
+        strcpy(buf, name);
+    } else {
+        snprintf(buf, ESPSYNC_INSTANCE_NAME, "%s.%u", name, (unsigned)instance);
+    }
+}
+
+ESPSync::ESPSync(uint8_t instance)
 {
     _streamRef = NULL;
+    instance_name(_tempname, TEMP_FILE_NAME, instance);
+    instance_name(_resumename, RESUME_FILE_NAME, instance);
     _rxstate = RXSTATE_WAIT_STX;
 
-    _prev_cmn  = 0xFF;
-    _prev_fun  = 0;
-    _prev_size = 0;
-
-    _chk_mode = CSUM_SKIP;
-
-    // temporary data buffer
-    _dbuf = new uint8_t[TEMP_BUFFER_SIZE];
-
-    SPIFFS.begin();
+    for (uint8_t x = 0; x < ESPSYNC_MAX_WINDOW; x++) {
+        _history[x].cmn  = 0xFF;
+        _history[x].fun  = 0;
+        _history[x].size = 0;
+    }
+    _history_next = 0;
+    _window = 1; /* Stop and wait, until a session says otherwise */
+    _ck = &espsync_csums[CSUM_ADLER32];
+    _rxck = _ck;
+    _txck = _ck;
+
+    _active = false;
+
+    _rxhead = 0;
+    _rxlen = 0;
+    _txlen = 0;
+    _txcsum = ADLER32_INIT;
+    _rx_time = 0;
+    _body_left = 0;
+
+    _rxfile = ESPSYNC_NO_FILE;
+    _fbuf = NULL;
+    _fbuf_len = 0;
+    _fpage = 0;
+    _fnsiz = 0;
+    _fmaxpath = 0;
+
+    _basefile = ESPSYNC_NO_FILE;
+    _block = 0;
+    _fcsum = 0;
+    _hcsum = 0;
+    _fcsum_want = 0;
+    _run_left = 0;
+    _op_len = 0;
+    _op_need = 0;
+
+    _lzflags = 0;
+    _lzleft = 0;
+
+    _resume = RESUME_UNKNOWN;
+    _chunked = false;
+    _csize = 0;
+    _cfchk = 0;
+    _roffset = 0;
+    _rtotal = 0;
+    _rcsum = ADLER32_INIT;
+
+    _bcount = 0;
+    _bsize = 0;
+
+    _baud_pending = false;
+    _baud_old = 0;
+    _baud_time = 0;
+
+    _sink = NULL;
+    _sink_arg = NULL;
+    _event = NULL;
+    _event_arg = NULL;
+    _session = false;
+    _msg_time = 0;
+
+    _rx_start = 0;
+    _loop_time = espsync_micros();
+    resetStats();
+    _writer.setTotals(&_stats);
+
+#if defined(ARDUINO)
+    /* Mounted by the first message, not before setup() has run */
+    _fs = &default_fs;
+    _manifest.setFS(_fs);
+#else
+    _fs = NULL;
+#endif
 }
 
 /**
@@ -193,11 +390,31 @@ ESPSync::ESPSync(void)
  * also receive message bodies directly, reducing 
  * overhead.
  */
+#if defined(ARDUINO)
 void ESPSync::setSerial(HardwareSerial *streamObject)
+{
+    _serial.begin(streamObject);
+    _streamRef = &_serial;
+}
+#endif
+
+void ESPSync::setStream(ESPSyncStream *streamObject)
 {
     _streamRef = streamObject;
 }
 
+/**
+ * Set the filesystem backend the protocol operates on.
+ */
+void ESPSync::setFS(ESPSyncFS *fs)
+{
+    _fs = fs;
+    _manifest.setFS(_fs);
+    if (_fs != NULL) {
+        _fs->begin();
+    }
+}
+
 /**
  * Has the handler captured the Serial port
  */
@@ -218,60 +435,84 @@ bool ESPSync::protocol_active(bool conservative)
     return active;
 }
 
-void fletcher16(uint16_t* csum, uint8_t byte) {
-    uint8_t sum1 = (*csum) + byte;
-    uint8_t sum2 = ((*csum) >> 8) + sum1;
-    *csum = (sum2 << 8) | sum1;
-}
+#define reset_rxstate() { _rxstate = RXSTATE_WAIT_STX; }
 
-void adler32(uint16_t* csum_hi, uint16_t* csum_lo, uint8_t byte) {
-    static const uint32_t MOD_ADLER32 = 65521;
-    uint32_t lo = ((*csum_lo) + byte) % MOD_ADLER32;
-    uint32_t hi = ((*csum_hi) + lo) % MOD_ADLER32;
-    *csum_lo = lo;
-    *csum_hi = hi;
+/**
+ * Replies are framed in _txbuf and handed to the stream in as few
+ * writes as possible, rather than a byte at a time.  A header, its body
+ * and CHK2 usually go in one write.  Slices too big for the buffer are
+ * written directly, after what is already buffered.
+ */
+void ESPSync::TX_Flush(void) {
+    if ((_streamRef != NULL) && (_txlen > 0)) {
+        _streamRef->write(_txbuf, _txlen);
+    }
+    _txlen = 0;
 }
 
-void adler32(uint32_t *csum, uint8_t byte) {
-    uint16_t csum_lo = (*csum & 0xFFFF);
-    uint16_t csum_hi = (*csum >> 16);
-    adler32(&csum_hi, &csum_lo, byte);
-    *csum = (csum_hi << 16) | csum_lo;
+void ESPSync::TX_Append(const uint8_t *data, size_t size) {
+    if (_txlen + size > sizeof(_txbuf)) {
+        TX_Flush();
+        if (size > sizeof(_txbuf)) {
+            if (_streamRef != NULL) {
+                _streamRef->write(data, size);
+            }
+            return;
+        }
+    }
+    memcpy(_txbuf + _txlen, data, size);
+    _txlen += size;
 }
 
-#define reset_rxstate() { _rxstate = RXSTATE_WAIT_STX; _chk_mode = CSUM_SKIP; }
-
-#define TX(X,csum) {_streamRef->write(X); fletcher16(&csum,X);}
-#define TX_CSUM(csum) {_streamRef->write(csum>>8); _streamRef->write(csum&0xFF);}
-#define TX_CSUM32(csum) { TX_CSUM(csum>>16); TX_CSUM(csum&0xFFFF);}
+void ESPSync::TX_Header(uint8_t func, uint32_t size_opt) {
+    uint8_t  hdr[8];
+    uint16_t csum = 0;
 
-uint32_t cnt_files_in_spiffs(void) {
-    uint32_t fcount = 0;
-    /**
-     * NOTE: Does not handle subdirectories, because SPIFFS is FLAT
-     */ 
-    Dir root = SPIFFS.openDir("/");
-    while (root.next()) {
-        fcount++;
+    hdr[0] = STX;
+    hdr[1] = TX_CMN(_this_cmn);
+    hdr[2] = func;
+    NBO24(hdr+3, size_opt);
+    for (uint8_t x = 0; x < 6; x++) {
+        fletcher16(&csum, hdr[x]);
     }
-    return fcount;
+    NBO16(hdr+6, csum);
+    TX_Append(hdr, sizeof(hdr));
+    _txck = (func == RPL_SESSION) ? &espsync_csums[CSUM_ADLER32] : _ck;
+    _txcsum = _txck->init;
 }
 
-void ESPSync::TX_Header(uint8_t func, uint32_t size_opt) {
-    uint16_t csum = 0;
-    if (_streamRef != NULL) {
-        TX(STX,csum);
-        TX(TX_CMN(_this_cmn),csum);
-        TX(func,csum);
-        TX(((size_opt >> 16) & 0xFF),csum);
-        TX(((size_opt >> 8) & 0xFF),csum);
-        TX((size_opt& 0xFF),csum);
-        TX_CSUM(csum);
+/**
+ * The final reply to a command has been sent, so it has been served.
+ */
+void ESPSync::TX_Served(void) {
+    uint8_t index;
+
+    /* The first bank, then the second, each 16 commands */
+    if ((_this_fun >= CMD_FIRST) && (_this_fun < CMD_FIRST + 16)) {
+        index = _this_fun - CMD_FIRST;
+    } else if ((_this_fun >= CMD_EXT_FIRST) && (_this_fun < CMD_EXT_FIRST + 16)) {
+        index = _this_fun - CMD_EXT_FIRST + 16;
+    } else {
+        return;
+    }
+    if (index < ESPSYNC_STATS_COMMANDS) {
+        espsync_histogram(_stats.service[index], espsync_micros() - _rx_start);
     }
 }
 
+void ESPSync::TX_Empty(uint8_t func) {
+    TX_Header(func, 0);
+    TX_Flush();
+    TX_Served();
+}
+
 void ESPSync::TX_NAK(uint8_t code) {
     TX_Header(NAK, (code << 16) | 0xA55A);
+    TX_Flush();
+    TX_Served();
+    if (RANGE_CHK(code, NAK_TIMEOUT, NAK_TIMEOUT + ESPSYNC_STATS_NAKS - 1)) {
+        _stats.naks[code - NAK_TIMEOUT]++;
+    }
 }
 
 void ESPSync::TX_ACK(uint32_t timeout) {
@@ -281,53 +522,78 @@ void ESPSync::TX_ACK(uint32_t timeout) {
       timeout = ((timeout-1) << 8) | 0x5A; // Adjust timeout to TX value.
     }
     TX_Header(ACK, timeout);
+    TX_Flush();
 }
 
-void ESPSync::TX_DataChunk(uint32_t *chk, uint8_t size) {
-    uint8_t *tx = _dbuf;
-    if (_streamRef != NULL) {
-        while (size != 0) {
-            _streamRef->write(*tx);
-            adler32(chk, *tx);
-            tx++;
-            size--;
-        }
-    }    
+void ESPSync::TX_Data(const uint8_t *data, size_t size) {
+    _txcsum = _txck->update(_txcsum, data, size);
+    TX_Append(data, size);
 }
 
-void ESPSync::TX_DataBuf(uint8_t func, uint8_t size) {
-    uint32_t chk = 0;
+void ESPSync::TX_End(void) {
+    uint8_t chk[4];
+
+    NBO32(chk, _txcsum);
+    TX_Append(chk, sizeof(chk));
+    TX_Flush();
+    TX_Served();
+}
 
-    if (_streamRef != NULL) {
-        TX_Header(func, size+4);
-        TX_DataChunk(&chk, size);
-        // Send checksum
-        TX_CSUM32(chk);
+/**
+ * Send length bytes of an open file as reply data, read straight into
+ * the framing buffer, as much as it has room for at a time.  The header
+ * has already gone, so if the file can't be read the rest is sent as
+ * 0s, and false is returned.
+ */
+bool ESPSync::TX_FileData(int fh, uint32_t length) {
+    bool    ok = true;
+    int32_t got;
+    size_t  n;
+
+    while (length > 0) {
+        if (_txlen == sizeof(_txbuf)) {
+            TX_Flush();
+        }
+        n = sizeof(_txbuf) - _txlen;
+        if (n > length) {
+            n = length;
+        }
+        got = ok ? _fs->read(fh, _txbuf + _txlen, n) : -1;
+        if (got <= 0) {
+            ok = false;
+            got = n;
+            memset(_txbuf + _txlen, 0, n);
+        }
+        _txcsum = _txck->update(_txcsum, _txbuf + _txlen, got);
+        _txlen += got;
+        length -= got;
     }
+    return ok;
+}
+
+void ESPSync::TX_DataBuf(uint8_t func, uint8_t size) {
+    TX_Header(func, size+4);
+    TX_Data(_dbuf, size);
+    TX_End();
 }
 
 void ESPSync::PROCESS_SetTime(void) {
     /* Should be very quick, no need to ACK */
 
-    if (RANGE_CHK(_dbuf[0],1,31) &&
-        RANGE_CHK(_dbuf[1],1,12) &&
-        RANGE_CHK(_dbuf[3],0,23) &&
-        RANGE_CHK(_dbuf[4],0,59) &&
-        RANGE_CHK(_dbuf[5],0,59)) {
+    time_t t;
 
+    if (espsync_date_time(_dbuf, &t)) {
         // Set Specified Date/Time
-        struct tm tm;
-        tm.tm_mday = _dbuf[0];
-        tm.tm_mon  = _dbuf[1]-1;
-        tm.tm_year = (2019 - 1900)+_dbuf[2];
-        tm.tm_hour = _dbuf[3];
-        tm.tm_min  = _dbuf[4];
-        tm.tm_sec  = _dbuf[5];
-        time_t t = mktime(&tm);
+#if defined(ARDUINO)
         struct timeval now = { .tv_sec = t, .tv_usec = 0 };
         settimeofday(&now, NULL);
+#else
+        /* Never set the clock of the machine running the host build */
+        (void)t;
+#endif
         // Reply that we did it.
-        TX_Header(RPL_TIME_SET,0);
+        TX_Empty(RPL_TIME_SET);
+        MSG_Complete();
     } else {
         TX_NAK(NAK_FORMAT);
     }
@@ -335,13 +601,13 @@ void ESPSync::PROCESS_SetTime(void) {
 }
         
 void ESPSync::PROCESS_Format(void) {
-    FSInfo fs_info;
+    ESPSyncFSInfo fs_info;
 
-    if (SPIFFS.begin()) {
+    if (_fs->begin()) {
 
         // If last command was a format, just ACK.
         if (!MSG_Retransmit()) {
-            SPIFFS.info(fs_info);
+            _fs->info(&fs_info);
             
             // Reply with ACK specifying expected format duration
             // Duration is calculated based on benchmarked format Speed 
@@ -349,10 +615,15 @@ void ESPSync::PROCESS_Format(void) {
             TX_ACK(DURATION_FORMAT * ((fs_info.totalBytes / (1048576))+1));
 
             // Format the SPIFFS
-            SPIFFS.format();
+            _fs->format();
+            FILE_Forget();
+
+            // Start an empty manifest
+            _manifest.rebuild();
+            MSG_Event(ESPSYNC_EVENT_FORMATTED, NULL);
         }
 
-        SPIFFS.info(fs_info);
+        _fs->info(&fs_info);
         // Reply with a 0x71 message when finished.
         NBO32(_dbuf, fs_info.totalBytes); 
         NBO32(_dbuf+4, fs_info.usedBytes);
@@ -366,14 +637,17 @@ void ESPSync::PROCESS_Format(void) {
         
 void ESPSync::PROCESS_Listing(void) {
     uint8_t options = _dbuf[0];
-    FSInfo fs_info;
-    SPIFFS.info(fs_info);
-    uint32_t csum;
+    ESPSyncFSInfo fs_info;
+    ESPSyncDirEntry entry;
+    ESPSyncManifestEntry mentry;
+    uint32_t fcount;
+    bool     manifest;
 
-    if (!SPIFFS.begin()) {
+    if (!_fs->begin()) {
         TX_NAK(NAK_FSERR);
         return;
     }
+    _fs->info(&fs_info);
 
     // Reply with ACK specifying expected listing duration
     TX_ACK(1000); //Todo: Benchmark listing duration
@@ -382,14 +656,25 @@ void ESPSync::PROCESS_Listing(void) {
                   // be ample time to keep the link alive between files
                   // but needs to be checked.
 
-#if defined(ARDUINO_ARCH_ESP8266)
-    options &= 0x2; /* Cant get file date/time on ESP8266 */
-#elif defined(ARDUINO_ARCH_ESP32)
-    options &= 0x3; /* CAN get file date/time on ESP32 */
-#endif                                                    
+    /**
+     * Dates and checksums come from the manifest, so files are only
+     * read when it is stale, or a rebuild is asked for.  Names and
+     * sizes alone come from it too, if it is up to date, so the
+     * directory is only walked once, to check it.  If it is not, the
+     * same walk counts the files, and a second sends them.
+     */
+    options &= 0x7;
+    if ((options & 0x3) != 0) {
+        if (!FILE_Manifest(&fs_info, (options & 0x4) != 0) || !_manifest.open(&fcount)) {
+            TX_NAK(NAK_FSERR);
+            return;
+        }
+        manifest = true;
+    } else {
+        manifest = _manifest.valid(&fcount) && _manifest.open(&fcount);
+    }
+    options &= 0x3;
 
-    /* First count total number of files in SPIFFS */
-    uint32_t fcount = cnt_files_in_spiffs();
     uint32_t esize = fs_info.maxPathLength + 4;
     if (options & 0x1) { /* Date requested */
         esize += 6;
@@ -397,6 +682,11 @@ void ESPSync::PROCESS_Listing(void) {
     if (options & 0x2) { /* Checksum Requested */
         esize += 4;
     }
+    if (esize > TEMP_BUFFER_SIZE) {
+        _manifest.close();
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
     // Calculate the size of the message
     uint32_t msize = 10 + (esize * fcount) + 4;
 
@@ -408,523 +698,2572 @@ void ESPSync::PROCESS_Listing(void) {
     NBO32(_dbuf+4, (fs_info.totalBytes - fs_info.usedBytes));
     NBO8(_dbuf+8, fs_info.maxPathLength);
     NBO8(_dbuf+9,options);
-    TX_DataChunk(&csum, 10);
+    TX_Data(_dbuf, 10);
 
     /* For each file in filesystem, send file data */
-    Dir dir = SPIFFS.openDir("/");
-    while (dir.next()) {
-        File f = dir.openFile("r");
+    if (!manifest) {
+        _fs->openDir();
+    }
+    for (uint32_t x = 0; x < fcount; x++) {
+        memset(_dbuf,0x00,esize);
+
+        if (manifest) {
+            /* A short read still sends the number of entries promised */
+            if (_manifest.next(&mentry)) {
+                strncpy((char*)_dbuf,mentry.name,fs_info.maxPathLength-1);
+                NBO32((_dbuf+fs_info.maxPathLength),mentry.size);
+                if (options & 0x1) { /* Add file date/time */
+                    memcpy(_dbuf+fs_info.maxPathLength+4,mentry.date,6);
+                }
+                if (options & 0x2) { /* Add file checksum */
+                    uint32_t fcsum = mentry.csum;
+                    NBO32(_dbuf+esize-4,fcsum);
+                }
+            }
+        } else {
+            bool got;
+            while ((got = _fs->nextEntry(&entry)) && ESPSYNC_INTERNAL(entry.name)) {
+            }
+            if (got) {
+                strncpy((char*)_dbuf,entry.name,fs_info.maxPathLength-1);
+                NBO32((_dbuf+fs_info.maxPathLength),entry.size);
+            }
+        }
+        TX_Data(_dbuf, esize);
+    }
+    if (manifest) {
+        _manifest.close();
+    } else {
+        /* Finish the enumeration */
+        while (_fs->nextEntry(&entry)) {
+        }
+    }
+    TX_End();
+    MSG_Complete();
+}
 
-        memset(_dbuf,0x00,fs_info.maxPathLength);
-        strcpy((char*)_dbuf,dir.fileName().c_str());
-        NBO32((_dbuf+fs_info.maxPathLength),dir.fileSize());
+void ESPSync::PROCESS_Hash(void) {
+    /**
+     * One hash over every file, so a master can see nothing has changed
+     * without listing them all.  Each prefix asked for gets its own hash
+     * of just the files whose names start with it, Eg, a directory, to
+     * narrow down where a difference is.
+     */
+    uint8_t  options = _dbuf[0];
+    uint8_t  pstart[HASH_MAX_PREFIX];
+    uint8_t  plen[HASH_MAX_PREFIX];
+    uint32_t count[HASH_MAX_PREFIX + 1];
+    uint32_t hash[HASH_MAX_PREFIX + 1];
+    uint32_t fcount;
+    uint8_t  prefixes = 0;
+    ESPSyncFSInfo fs_info;
+    ESPSyncManifestEntry mentry;
+
+    if (!_fs->begin()) {
+        TX_NAK(NAK_FSERR);
+        return;
+    }
 
-        if (options & 0x1) { /* Add file date/time */
-#ifdef ARDUINO_ARCH_ESP32
-#error "ERROR: ESP32 not coded yet"                                       
-#endif
+    /* The prefixes must exactly fill the message */
+    for (uint32_t x = 1; x < _this_size - 4; x += 1 + plen[prefixes++]) {
+        if ((prefixes == HASH_MAX_PREFIX) || (_dbuf[x] == 0) ||
+            (x + 1 + _dbuf[x] > _this_size - 4)) {
+            TX_NAK(NAK_FORMAT);
+            return;
         }
+        pstart[prefixes] = x + 1;
+        plen[prefixes] = _dbuf[x];
+    }
+
+    _fs->info(&fs_info);
+    if (!FILE_Manifest(&fs_info, (options & 0x4) != 0) || !_manifest.open(&fcount)) {
+        TX_NAK(NAK_FSERR);
+        return;
+    }
 
-        if (options & 0x2) { /* Add file checksum */
-            uint32_t fcsum;
-            int  fbyte;
-            while ((fbyte = f.read()) != -1) {
-                adler32(&fcsum, fbyte);
+    memset(count, 0, sizeof(count));
+    memset(hash, 0, sizeof(hash));
+    while (_manifest.next(&mentry)) {
+        uint32_t h = manifest_hash(mentry.name, mentry.size, mentry.csum);
+        count[0]++;
+        hash[0] += h;
+        for (uint8_t p = 0; p < prefixes; p++) {
+            if (strncmp(mentry.name, (char*)(_dbuf + pstart[p]), plen[p]) == 0) {
+                count[p+1]++;
+                hash[p+1] += h;
             }
-            NBO32(_dbuf+esize-4,fcsum);
         }
-        f.close();
-        TX_DataChunk(&csum, esize);
     }
-    TX_CSUM32(csum);
+    _manifest.close();
+
+    TX_Header(RPL_HASH, ((prefixes + 1) * 8) + 4);
+    for (uint8_t p = 0; p <= prefixes; p++) {
+        NBO32(_dbuf, count[p]);
+        NBO32(_dbuf+4, hash[p]);
+        TX_Data(_dbuf, 8);
+    }
+    TX_End();
+    MSG_Complete();
 }
 
 void ESPSync::PROCESS_Remove(void) {
-    FSInfo fs_info;
-    uint8_t nlen = _dbuf[0];
+    ESPSyncFSInfo fs_info;
 
-    if (!SPIFFS.begin()) {
+    if (!_fs->begin()) {
         TX_NAK(NAK_FSERR);
         return;
     }
 
-    /* Turn the names in the buffer into C strings. */
-    _dbuf[nlen+1] = 0x00;
+    /* Turn the name in the buffer into a C string. */
     _dbuf[_this_size-4] = 0x00;
 
-    if (SPIFFS.exists((char*)(_dbuf+1))) {
-        if (SPIFFS.remove((char*)_dbuf)) {
-            SPIFFS.info(fs_info);
-
-            NBO32(_dbuf, fs_info.totalBytes )
-            NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
-            TX_DataBuf(RPL_REMOVED, 10);
+    if (ESPSYNC_INTERNAL((char*)_dbuf)) {
+        TX_NAK(NAK_FNAMERR);
+        return;
+    }
 
-        } else {
+    if (_fs->exists((char*)_dbuf)) {
+        if (!_fs->remove((char*)_dbuf)) {
             TX_NAK(NAK_FSERR);
+            return;
         }
-
-    } else {
+        _manifest.remove((char*)_dbuf);
+        MSG_Event(ESPSYNC_EVENT_FILE_REMOVED, (char*)_dbuf);
+    } else if (!MSG_Retransmit()) {
         TX_NAK(NAK_FNOTF);
+        return;
     }
+    /* else, it was removed the first time, only the reply was lost */
+
+    _fs->info(&fs_info);
+    NBO32(_dbuf, fs_info.totalBytes )
+    NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
+    TX_DataBuf(RPL_REMOVED, 8);
+    MSG_Complete();
 
 }
         
 void ESPSync::PROCESS_Rename(void) {
-    FSInfo fs_info;
     uint8_t nlen = _dbuf[0];
 
-    if (!SPIFFS.begin()) {
+    if (!_fs->begin()) {
         TX_NAK(NAK_FSERR);
         return;
     }
 
+    /* Both names must exactly fill the message */
+    if ((nlen == 0) || ((uint32_t)nlen + 2 >= _this_size - 4) ||
+        ((uint32_t)nlen + 2 + _dbuf[nlen+1] != _this_size - 4)) {
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
+
     /* Turn the names in the buffer into C strings. */
     _dbuf[nlen+1] = 0x00;
     _dbuf[_this_size-4] = 0x00;
 
-    if (!SPIFFS.exists((char*)(_dbuf+1))) {
-        TX_NAK(NAK_FNOTF);
+    if (ESPSYNC_INTERNAL((char*)(_dbuf+1)) || ESPSYNC_INTERNAL((char*)(_dbuf+nlen+2))) {
+        TX_NAK(NAK_FNAMERR);
         return;
     }
 
-    if (SPIFFS.exists((char*)(_dbuf+nlen+1))) {
-        TX_NAK(NAK_FEXISTS);
+    if (!_fs->exists((char*)(_dbuf+1))) {
+        if (MSG_Retransmit() && _fs->exists((char*)(_dbuf+nlen+2))) {
+            /* Renamed the first time, only the reply was lost */
+            TX_Empty(RPL_RENAMED);
+        } else {
+            TX_NAK(NAK_FNOTF);
+        }
         return;
     }
 
-    if (SPIFFS.rename((char*)(_dbuf+1), (char*)(_dbuf+nlen+1))) {
-        
-        SPIFFS.info(fs_info);
-
-        NBO32(_dbuf, fs_info.totalBytes )
-        NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
-        TX_DataBuf(RPL_REMOVED, 10);
+    if (_fs->exists((char*)(_dbuf+nlen+2))) {
+        TX_NAK(NAK_FEXISTS);
+        return;
+    }
 
+    if (_fs->rename((char*)(_dbuf+1), (char*)(_dbuf+nlen+2))) {
+        _manifest.rename((char*)(_dbuf+1), (char*)(_dbuf+nlen+2));
+        MSG_Event(ESPSYNC_EVENT_FILE_RENAMED, (char*)(_dbuf+nlen+2), (char*)(_dbuf+1));
+        TX_Empty(RPL_RENAMED);
+        MSG_Complete();
     } else {
         TX_NAK(NAK_FSERR);
     }
 
 }
         
-void ESPSync::PROCESS_FileRX(void) {
+void ESPSync::PROCESS_Session(void) {
     /**
-     * File RX can be a LOT of Data. Much bigger than the normal small buffer.
-     * So, we use a temporary buffer the size of a page in the SPIFFS. And directly
-     * read the data from the UART.  We store the data in a temporary file. And when all
-     * data is received and checksum validates we move it to the proper file name.
-     * 
-     * Upshot is, this function will pause any code running on the main loop until it finishes.
-     * So be-warned.
+     * Sets up how the master and slave talk, for the rest of the session.
+     * The window is how many requests the master may send before it has
+     * to wait for a reply, 1 is plain stop and wait.  The strongest CHK2
+     * both ends have is used from the next message on.
      */
-    uint8_t rx_error = ACK;
+    uint8_t window = _dbuf[1];
+    uint8_t offered = (_this_size - 4 >= 3) ? _dbuf[2] : 0;
+    uint8_t csum = CSUM_ADLER32;
 
-    uint32_t rxd;
-    uint8_t* next_c;
+    if (window == 0) {
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
+    if (window > ESPSYNC_MAX_WINDOW) {
+        window = ESPSYNC_MAX_WINDOW;
+    }
+    _window = window;
 
-    uint32_t csum;
-    uint32_t rx_size = 0;
- 
-    uint8_t nsiz;
+    offered &= ESPSYNC_CSUMS;
+    if (offered & (1 << CSUM_CRC32C)) {
+        csum = CSUM_CRC32C;
+    } else if (offered & (1 << CSUM_CRC32)) {
+        csum = CSUM_CRC32;
+    }
 
-    FSInfo fs_info;
-    File rxfile;
-    SPIFFS.info(fs_info);
+    NBO8(_dbuf, ESPSYNC_PROTOCOL_VERSION);
+    NBO8(_dbuf+1, _window);
+    NBO8(_dbuf+2, ESPSYNC_LZ_WINDOW_BITS);
+    NBO8(_dbuf+3, csum);
+    NBO8(_dbuf+4, (_fs != NULL) ? _fs->caps() : 0);
+    TX_DataBuf(RPL_SESSION, 5);
+    MSG_Complete();
+    _ck = &espsync_csums[csum];
+}
 
-    uint8_t* fbuffer = new uint8_t[fs_info.pageSize];
+void ESPSync::PROCESS_Baud(void) {
+    /**
+     * Changing the line rate takes two messages.  The first is answered at
+     * the old rate, then the rate changes.  The master sends the second at
+     * the new rate, with a pattern of bytes after the rate, and it is echoed
+     * back.  If that does not arrive intact in time, the rate goes back to
+     * what it was, so a rate the line can not carry only costs the timeout.
+     * Asking for the rate already in use just echoes, to test the line.
+     */
+    uint32_t rate = ((uint32_t)_dbuf[0] << 24) | ((uint32_t)_dbuf[1] << 16) |
+                    ((uint32_t)_dbuf[2] << 8) | _dbuf[3];
+    uint32_t current = _streamRef->baud();
+
+    if (_baud_pending) {
+        if (rate != current) {
+            TX_NAK(NAK_FORMAT);
+            return;
+        }
+        _baud_pending = false;
+    }
 
-    if (fbuffer != NULL) {
+    if (rate == current) {
+        TX_DataBuf(RPL_BAUD, _this_size - 4);
+        MSG_Complete();
+        return;
+    }
 
-        /* 50ms timeout on character reception which is about 
-             576 characters @ 115200bps */
-        _streamRef->setTimeout(50); 
-      
-        rxfile = SPIFFS.open("///TEMP","w");
+    if ((_this_size != 8) || (current == 0) ||
+        !RANGE_CHK(rate, BAUD_MIN, ESPSYNC_MAX_BAUD)) {
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
 
-        /* Get File Name Length */
-        if (rx_error == ACK) {
-            rxd = _streamRef->readBytes(&nsiz,1);
-            if ((rxd != 1) || (nsiz > 0)) {
-                rx_error = NAK_FSIZERR;
-            }
-        }
+    NBO16(_dbuf+4, ESPSYNC_BAUD_CONFIRM);
+    TX_DataBuf(RPL_BAUD, 6);
+    MSG_Complete();
 
-        /* Get File Name and Date */
-        if (rx_error == ACK) {
-            rxd = _streamRef->readBytes(_dbuf,nsiz+6);
-            if (rxd != (uint32_t)nsiz+6) {
-                rx_error = NAK_TIMEOUT;
-            }
-        }
+    _baud_old = current;
+    _baud_time = espsync_millis();
+    _baud_pending = _streamRef->setBaud(rate);
+}
 
-        /* Read and store File Data */
-        while ((rx_error == ACK) && (rx_size < _this_size - 4)) {
-            uint16_t rxbufsize = fs_info.pageSize;
-            if (rx_size + (uint32_t)fs_info.pageSize > _this_size ) {
-                rxbufsize = _this_size - rx_size;
-            }
-            rxd = _streamRef->readBytes(fbuffer,rxbufsize);
+void ESPSync::PROCESS_Stats(void) {
+    /**
+     * Everything counted since the last reset, as network order words,
+     * streamed straight from _stats.  The reply is sent before it is
+     * counted itself.
+     */
+    uint8_t  options = _dbuf[0];
+    const uint32_t *words = (const uint32_t*)&_stats;
+
+    _stats.period = espsync_millis() - _stats_time;
+    TX_Header(RPL_STATS, 2 + sizeof(_stats) + 4);
+    NBO8(_dbuf, ESPSYNC_STATS_BUCKETS);
+    NBO8(_dbuf+1, ESPSYNC_STATS_COMMANDS);
+    TX_Data(_dbuf, 2);
+    for (uint32_t x = 0; x < ESPSYNC_STATS_WORDS; x++) {
+        NBO32(_dbuf, words[x]);
+        TX_Data(_dbuf, 4);
+    }
+    TX_End();
+    MSG_Complete();
 
-            if (rxd == 0) {
-                /* Transmitter failed. Abort */
-                rx_error = NAK_TIMEOUT;
-            } else {
-                // Append new data to file.
-                if (rxfile.write(fbuffer,rxd) == rxd) { 
-                    next_c = fbuffer;
-                    while (next_c < fbuffer+rxd) {
-                        adler32(&csum,*next_c);
-                        rx_size++;
-                        next_c++;
-                    }
-                } else {
-                    rx_error = NAK_FSERR;
-                }
-            }
-        }
+    if (options & STATS_OPT_RESET) {
+        resetStats();
+    }
+}
 
-        /* All data in temp file. close it */
-        rxfile.close();
+void ESPSync::PROCESS_FileStart(void) {
+    /**
+     * File RX can be a LOT of Data. Much bigger than the normal small buffer.
+     * So, we use temporary buffers the size of a page in the SPIFFS, and the
+     * receive state machine fills them from whatever bytes each call to getData()
+     * brings in.  Full pages are handed to the writer, which stores them in a
+     * temporary file while the next page is being received. And when all
+     * data is received and checksum validates we move it to the proper file name.
+     *
+     * Nothing here waits for data, so the main loop keeps running during an upload.
+     */
+    ESPSyncFSInfo fs_info;
+    _fs->info(&fs_info);
+
+    _fpage = ESPSYNC_WRITE_PAGE(fs_info.pageSize);
+    _fmaxpath = fs_info.maxPathLength;
+    _fbuf = NULL;
+    _fbuf_len = 0;
+    _csum = ADLER32_INIT;
+    _body_left = _this_size;
+    _rxstate = RXSTATE_FILE_NSIZ;
+
+    if (_this_fun == CMD_CONTINUE) {
+        /* The kept temp file is opened once the offset has been checked */
+        return;
+    }
 
-        /* Verify Checksum */
-        if (rx_error == ACK) {
-            rxd = _streamRef->readBytes(fbuffer,1);
-            if (rxd != 1) {
-                rx_error = NAK_TIMEOUT;
-            } else if (*fbuffer != ((csum >> 24) & 0xFF)) {
-                rx_error = NAK_CHKSUM;
-            }
-        }
-        if (rx_error == ACK) {
-            rxd = _streamRef->readBytes(fbuffer,1);
-            if (rxd != 1) {
-                rx_error = NAK_TIMEOUT;
-            } else if (*fbuffer != ((csum >> 16) & 0xFF)) {
-                rx_error = NAK_CHKSUM;
-            }
-        }
-        if (rx_error == ACK) {
-            rxd = _streamRef->readBytes(fbuffer,1);
-            if (rxd != 1) {
-                rx_error = NAK_TIMEOUT;
-            } else if (*fbuffer != ((csum >> 8) & 0xFF)) {
-                rx_error = NAK_CHKSUM;
-            }
-        }
-        if (rx_error == ACK) {
-            rxd = _streamRef->readBytes(fbuffer,1);
-            if (rxd != 1) {
-                rx_error = NAK_TIMEOUT;
-            } else if (*fbuffer != (csum & 0xFF)) {
-                rx_error = NAK_CHKSUM;
-            }
-        }
+    /* A new upload replaces anything kept */
+    FILE_Forget();
+    _rxfile = _fs->open(_tempname,"w");
+    if (_rxfile == ESPSYNC_NO_FILE) {
+        RX_Abort(NAK_FSERR);
+        return;
+    }
 
-        /* Save Transferred File */
-        if (rx_error == ACK) {
-#if ARDUINO_ARCH_ESP32
-            /* Set date of temporary file to date of transferred file. Only works for ESP32 */
-#endif            
-        }
+    if (!_writer.begin(_fs, _rxfile, _fpage)) {
+        RX_Abort(NAK_FSERR);
+    }
+}
 
-        /* Check File Name */
-        if (rx_error == ACK) {
-            /* Turn File Name into C String */
-            _dbuf[nsiz] = 0x00;
+void ESPSync::PROCESS_BatchStart(void) {
+    /**
+     * Many files in one message, each received into the temp file in
+     * turn, exactly as a File message.  The filesystem info, writer and
+     * manifest rewrite are shared by all of them, rather than paid for
+     * each file.
+     */
+    ESPSyncFSInfo fs_info;
+    _fs->info(&fs_info);
+
+    _fpage = ESPSYNC_WRITE_PAGE(fs_info.pageSize);
+    _fmaxpath = fs_info.maxPathLength;
+    _fbuf = NULL;
+    _fbuf_len = 0;
+    _csum = ADLER32_INIT;
+    _body_left = _this_size;
+    _bcount = 0;
+    _rxstate = RXSTATE_BATCH_NSIZ;
+
+    /* Without the RAM to hold them, each update is written at once */
+    _manifest.hold();
+    FILE_Forget();
+
+    if (!_writer.begin(_fs, ESPSYNC_NO_FILE, _fpage)) {
+        RX_Abort(NAK_FSERR);
+    }
+}
 
-            if (strcmp("///TEMP",(const char*)_dbuf) != 0) {
-                rx_error = NAK_FNAMERR;
-            }
-        }
+/**
+ * Take file data from a received slice.
+ * Returns the number of bytes used.
+ */
+size_t ESPSync::RX_FileData(const uint8_t *data, size_t length)
+{
+    if (length > _body_left - 4) {
+        length = _body_left - 4;
+    }
+    _csum = adler32_update(_csum, data, length);
+    _body_left -= length;
 
-        /* Remove any pre-existing file before rename - overwriting it */
-        if (rx_error == ACK) {
-            if (SPIFFS.exists((char*)_dbuf)) {
-                if (!SPIFFS.remove((char*)_dbuf)) {
-                    rx_error = NAK_FSERR;
-                }
-            }
-        }
+    if (!FILE_Out(data, length)) {
+        RX_Abort(NAK_FSERR);
+    }
+    return length;
+}
 
-        if (rx_error == ACK) {
-            if (!SPIFFS.rename("///TEMP",(char*)_dbuf)) {
-                rx_error = NAK_FSERR;
+/**
+ * Add data to the file being received.  It is gathered into page
+ * buffers, and each full page is queued to be written.
+ * Returns false if the writer has failed.
+ */
+bool ESPSync::FILE_Out(const uint8_t *data, size_t length)
+{
+    size_t n;
+
+    while (length > 0) {
+        if (_fbuf == NULL) {
+            /* Only waits if the flash is behind by every buffer */
+            _fbuf = _writer.get();
+            if (_fbuf == NULL) {
+                return false;
             }
         }
 
-        delete fbuffer;
+        n = _fpage - _fbuf_len;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(_fbuf + _fbuf_len, data, n);
+        _fbuf_len += n;
+        data += n;
+        length -= n;
 
-    } else {
-        rx_error = NAK_FSERR;
+        if (_fbuf_len == _fpage) {
+            FILE_Flush();
+        }
     }
+    return true;
+}
+
+/**
+ * Queue the page being filled to be written, even if it is not full.
+ */
+void ESPSync::FILE_Flush(void)
+{
+    if ((_fbuf != NULL) && (_fbuf_len > 0)) {
+        _writer.put(_fbuf_len);
+    }
+    _fbuf = NULL;
+    _fbuf_len = 0;
+}
+
+/**
+ * Close and free everything an upload holds.  The temp file is only
+ * left behind when it has been renamed.
+ */
+void ESPSync::FILE_Cleanup(void) {
+    _writer.end();
+    _lz.end();
+    _manifest.release();
+    _fbuf = NULL;
+    _fbuf_len = 0;
+    if (_basefile != ESPSYNC_NO_FILE) {
+        _fs->close(_basefile);
+        _basefile = ESPSYNC_NO_FILE;
+    }
+    if (_rxfile != ESPSYNC_NO_FILE) {
+        _fs->close(_rxfile);
+        _rxfile = ESPSYNC_NO_FILE;
+    }
+    if (_fs->exists(_tempname)) {
+        _fs->remove(_tempname);
+    }
+    FILE_Forget();
+}
+
+/**
+ * The link failed part way through a File or Continue message.  Keep
+ * the data received in the temp file, and tag it, so the master can
+ * continue from there rather than start again.
+ * Returns false if there is nothing to keep, or it could not be kept.
+ */
+bool ESPSync::FILE_Keep(void) {
+    uint32_t base  = 0;
+    uint32_t prior = ADLER32_INIT;
+    int32_t  fsize;
+    bool     ok;
+
+    if (((_this_fun != CMD_FILE) && (_this_fun != CMD_CONTINUE)) ||
+        (_rxstate < RXSTATE_WAIT_CHK2_24) ||
+        ((_rxstate > RXSTATE_WAIT_CHK2_0) && (_rxstate != RXSTATE_FILE_DATA))) {
+        return false;
+    }
+    if (_this_fun == CMD_CONTINUE) {
+        base  = _roffset;
+        prior = _rcsum;
+    } else {
+        _rtotal = _this_size - 4 - 1 - _fnsiz - 6;
+    }
+
+    /* What was received has to be written before it is measured */
+    FILE_Flush();
+    ok = _writer.end();
+    fsize = _fs->size(_rxfile);
+    _fs->close(_rxfile);
+    _rxfile = ESPSYNC_NO_FILE;
+    if (!ok || (fsize <= 0) || ((uint32_t)fsize < base)) {
+        return false;
+    }
+
+    /* The data this message brought is summed in _csum, after the header */
+    fsize -= base;
+    return FILE_Tag(adler32_combine(prior, adler32_suffix(_csum, _hcsum, fsize), fsize));
+}
+
+/**
+ * Write the tag of a kept upload.  The name and date are in the small
+ * buffer, _rtotal is the size of the whole file, csum the Adler-32 of
+ * the temp file so far.
+ */
+bool ESPSync::FILE_Tag(uint32_t csum) {
+    uint8_t tail[8];
+    bool    ok;
+    int     fh;
+
+    fh = _fs->open(_resumename, "w");
+    if (fh == ESPSYNC_NO_FILE) {
+        return false;
+    }
+    _resume = RESUME_KEPT;
+    NBO32(tail, _rtotal);
+    NBO32(tail+4, csum);
+    ok = (_fs->write(fh, &_fnsiz, 1) == 1) &&
+         (_fs->write(fh, _dbuf, _fnsiz + 6) == _fnsiz + 6) &&
+         (_fs->write(fh, tail, 8) == 8);
+    _fs->close(fh);
+    return ok;
+}
+
+/**
+ * Is an upload of name kept?  If so, get the size of the whole file
+ * and the checksum of what is kept from its tag.  With no name, it is
+ * whatever upload is kept, and its name and date are put in the small
+ * buffer.
+ */
+bool ESPSync::FILE_Kept(const uint8_t *name, uint8_t nsiz) {
+    uint8_t tag[1 + ESPSYNC_MAX_PATH + 6 + 8];
+    int32_t got;
+    int     fh;
+
+    if ((_resume == RESUME_NONE) || !_fs->exists(_resumename)) {
+        _resume = RESUME_NONE;
+        return false;
+    }
+    _resume = RESUME_KEPT;
+
+    fh = _fs->open(_resumename, "r");
+    if (fh == ESPSYNC_NO_FILE) {
+        return false;
+    }
+    got = _fs->read(fh, tag, sizeof(tag));
+    _fs->close(fh);
+
+    if (got <= 0) {
+        return false;
+    }
+    if (name == NULL) {
+        nsiz = tag[0];
+        name = tag + 1;
+    }
+    if ((got != 1 + nsiz + 6 + 8) || (tag[0] != nsiz) ||
+        (nsiz + 6 > TEMP_BUFFER_SIZE) || (memcmp(tag+1, name, nsiz) != 0)) {
+        return false;
+    }
+    if (name == tag + 1) {
+        _fnsiz = nsiz;
+        memcpy(_dbuf, tag + 1, nsiz + 6);
+    }
+    _rtotal = ((uint32_t)tag[7+nsiz] << 24) | ((uint32_t)tag[8+nsiz] << 16) |
+              ((uint32_t)tag[9+nsiz] << 8) | tag[10+nsiz];
+    _rcsum  = ((uint32_t)tag[11+nsiz] << 24) | ((uint32_t)tag[12+nsiz] << 16) |
+              ((uint32_t)tag[13+nsiz] << 8) | tag[14+nsiz];
+    return true;
+}
+
+/**
+ * Throw away the tag of a kept upload, its temp file has been stored,
+ * removed or is about to be replaced.
+ */
+void ESPSync::FILE_Forget(void) {
+    if (_resume != RESUME_NONE) {
+        if (_fs->exists(_resumename)) {
+            _fs->remove(_resumename);
+        }
+        _resume = RESUME_NONE;
+    }
+    _chunked = false;
+}
+
+/**
+ * Something other than a chunk has arrived during a chunked upload.
+ * Finish writing what has been received, close the temp file and bring
+ * the tag up to date, so the file is free for the message to use, and
+ * the upload can be picked up again after a reset.
+ */
+void ESPSync::FILE_Park(void) {
+    uint32_t csum = _rcsum;
+    bool     ok;
+
+    if (!_chunked || (_rxfile == ESPSYNC_NO_FILE)) {
+        return;
+    }
+    FILE_Flush();
+    ok = _writer.end();
+    _fs->close(_rxfile);
+    _rxfile = ESPSYNC_NO_FILE;
+
+    if (!ok || !FILE_Kept(NULL, 0) || !FILE_Tag(csum)) {
+        FILE_Cleanup();
+    }
+}
+
+/**
+ * Open the temp file of a chunked upload again, to append to it.
+ */
+bool ESPSync::FILE_Unpark(void) {
+    if (_rxfile != ESPSYNC_NO_FILE) {
+        return true;
+    }
+    if (!FILE_Kept(NULL, 0)) {
+        return false;
+    }
+    _rxfile = _fs->open(_tempname, "a");
+    if (_rxfile == ESPSYNC_NO_FILE) {
+        return false;
+    }
+    _roffset = _fs->size(_rxfile);
+    _fbuf = NULL;
+    _fbuf_len = 0;
+    return _writer.begin(_fs, _rxfile, _fpage);
+}
+
+/**
+ * Finish writing the temp file, and move it to name, replacing any file
+ * of that name, and give it the date it was sent with, if the filesystem
+ * keeps times.  With more, the writer is kept for the next file.
+ * Returns ACK, or the NAK code of what went wrong.
+ */
+uint8_t ESPSync::FILE_Store(const char *name, const uint8_t *date, bool more, int32_t *fsize) {
+    uint8_t rx_error = ACK;
+
+    /* Wait for the last pages to be written, then close it */
+    FILE_Flush();
+    if (!(more ? _writer.next(ESPSYNC_NO_FILE) : _writer.end())) {
+        rx_error = NAK_FSERR;
+    }
+    *fsize = _fs->size(_rxfile);
+    _fs->close(_rxfile);
+    _rxfile = ESPSYNC_NO_FILE;
+
+    /* Remove any pre-existing file before rename - overwriting it */
+    if (rx_error == ACK) {
+        if (_fs->exists(name)) {
+            if (!_fs->remove(name)) {
+                rx_error = NAK_FSERR;
+            }
+        }
+    }
+
+    if (rx_error == ACK) {
+        if (!_fs->rename(_tempname, name)) {
+            rx_error = NAK_FSERR;
+        } else {
+            /* Not every backend can, the manifest has the date anyway */
+            if (_fs->caps() & ESPSYNC_FS_MTIME) {
+                _fs->setTime(name, date);
+            }
+            FILE_Forget();
+            MSG_Event(ESPSYNC_EVENT_FILE_RECEIVED, name);
+        }
+    }
+    return rx_error;
+}
+
+void ESPSync::PROCESS_FileRX(void) {
+    /**
+     * All of the file is in the temp file, and its checksum is good.
+     */
+    uint8_t rx_error;
+    ESPSyncFSInfo fs_info;
+    ESPSyncManifestEntry mentry;
+    int32_t fsize;
+
+    /* Check File Name */
+    /* Turn File Name into C String */
+    memcpy(mentry.date, _dbuf+_fnsiz, 6);
+    _dbuf[_fnsiz] = 0x00;
+
+    if (_this_fun == CMD_CONTINUE) {
+        /* Checksum of the whole file, what was kept then the rest */
+        uint32_t n = _this_size - 4 - 1 - _fnsiz - 6 - RESUME_HEAD_SIZE;
+        _fcsum = adler32_combine(_rcsum, adler32_suffix(_csum, _hcsum, n), n);
+    }
+
+    if (ESPSYNC_INTERNAL((const char*)_dbuf)) {
+        rx_error = NAK_FNAMERR;
+    } else if ((_this_fun == CMD_CONTINUE) && (_fcsum != _fcsum_want)) {
+        /* What was kept, and the rest, do not make the file the master has */
+        rx_error = NAK_CHKSUM;
+    } else {
+        rx_error = FILE_Store((const char*)_dbuf, mentry.date, false, &fsize);
+    }
+
+    if (rx_error == ACK) {
+        /**
+         * Record it in the manifest.  The checksum of a delta, a copy,
+         * a continued upload, or of a file kept compressed, is known
+         * already.  Otherwise it is taken from the message checksum,
+         * without reading it.
+         */
+        if ((fsize >= 0) && (_fnsiz < ESPSYNC_MAX_PATH)) {
+            strcpy(mentry.name, (const char*)_dbuf);
+            mentry.size = fsize;
+            if ((_this_fun == CMD_DELTA) || (_this_fun == CMD_COPY) ||
+                (_this_fun == CMD_CONTINUE) ||
+                ((_this_fun == CMD_FILE_LZ) && (_lzflags & LZ_FLAG_STORE))) {
+                mentry.csum = _fcsum;
+            } else {
+                mentry.csum = adler32_suffix(_csum, _hcsum, fsize);
+            }
+            _manifest.update(&mentry);
+        } else {
+            _manifest.invalidate();
+        }
+
+        _fs->info(&fs_info);
+
+        NBO32(_dbuf, fs_info.totalBytes );
+        NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
+        TX_DataBuf(RPL_RECEIVED, 8);
+        MSG_Complete();
+
+    } else {
+        /* BAD RX, Attempt to clean up temp file */
+        FILE_Cleanup();
+        /* Send Error */
+        TX_NAK(rx_error);
+    }
+}
+
+void ESPSync::PROCESS_Resume(void) {
+    /**
+     * How much of an interrupted upload of the file is kept, the size
+     * it will be, and the checksum of what is kept.  The master checks
+     * that against its copy, then sends the rest with Continue.
+     */
+    uint8_t nsiz = _this_size - 4;
+    int32_t kept = -1;
+    int     fh;
+
+    if (FILE_Kept(_dbuf, nsiz)) {
+        fh = _fs->open(_tempname, "r");
+        if (fh != ESPSYNC_NO_FILE) {
+            kept = _fs->size(fh);
+            _fs->close(fh);
+        }
+    }
+    if (kept < 0) {
+        TX_NAK(NAK_FNOTF);
+        return;
+    }
+
+    NBO32(_dbuf, kept);
+    NBO32(_dbuf+4, _rtotal);
+    NBO32(_dbuf+8, _rcsum);
+    TX_DataBuf(RPL_RESUME, 12);
+    MSG_Complete();
+}
+
+void ESPSync::PROCESS_ChunkStart(void) {
+    /**
+     * Start, or pick up again, a file sent in chunks.  Each chunk is a
+     * message of its own, checked and answered on its own, so a bad one
+     * costs only itself.  What has been received is kept, as an
+     * interrupted File is, and stored under the name after the last.
+     */
+    ESPSyncFSInfo fs_info;
+    uint8_t  nsiz = _dbuf[0];
+    uint8_t *tail = _dbuf + 1 + nsiz + 6;
+    uint32_t total = ((uint32_t)tail[0] << 24) | ((uint32_t)tail[1] << 16) |
+                     ((uint32_t)tail[2] << 8) | tail[3];
+    uint32_t fchk  = ((uint32_t)tail[4] << 24) | ((uint32_t)tail[5] << 16) |
+                     ((uint32_t)tail[6] << 8) | tail[7];
+    uint16_t csize = ((uint16_t)tail[8] << 8) | tail[9];
+    uint8_t  flags = tail[10];
+    bool     kept;
+
+    if (!_fs->begin() || !_fs->info(&fs_info)) {
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+    if ((nsiz == 0) || (nsiz >= fs_info.maxPathLength) ||
+        (_this_size != (uint32_t)nsiz + CHUNKED_SIZE)) {
+        TX_NAK(NAK_FNAMERR);
+        return;
+    }
+    if ((total == 0) || (csize == 0)) {
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
+    if (csize > ESPSYNC_CHUNK_SIZE) {
+        csize = ESPSYNC_CHUNK_SIZE;
+    }
+
+    /* Name and date to the start of the buffer, where the tag is made from */
+    memmove(_dbuf, _dbuf + 1, nsiz + 6);
+    _fnsiz = nsiz;
+    if ((nsiz >= 3) && ESPSYNC_INTERNAL((const char*)_dbuf)) {
+        TX_NAK(NAK_FNAMERR);
+        return;
+    }
+
+    kept = !(flags & CHUNKED_RESTART) && FILE_Kept(_dbuf, nsiz) && (_rtotal == total);
+    if (!kept) {
+        FILE_Forget();
+        _rtotal = total;
+        _rcsum = ADLER32_INIT;
+    }
+
+    _fpage = ESPSYNC_WRITE_PAGE(fs_info.pageSize);
+    _fbuf = NULL;
+    _fbuf_len = 0;
+    _rxfile = _fs->open(_tempname, kept ? "a" : "w");
+    _roffset = (_rxfile != ESPSYNC_NO_FILE) ? _fs->size(_rxfile) : 0;
+    if ((_rxfile == ESPSYNC_NO_FILE) || (_roffset > total) ||
+        !_writer.begin(_fs, _rxfile, _fpage) || !FILE_Tag(_rcsum)) {
+        FILE_Cleanup();
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+    _chunked = true;
+    _csize = csize;
+    _cfchk = fchk;
+
+    NBO16(_dbuf, csize);
+    NBO32(_dbuf+2, _roffset);
+    NBO32(_dbuf+6, _rcsum);
+    TX_DataBuf(RPL_CHUNKED, 10);
+    MSG_Complete();
+}
+
+void ESPSync::PROCESS_ChunkRX(void) {
+    /**
+     * A chunk has arrived intact.  If it is the next one, it is added to
+     * the file, and the last one stores it.  Either way the reply says
+     * where the master is to carry on from, so chunks lost, or sent on
+     * after one was lost, are sent again.
+     */
+    ESPSyncManifestEntry mentry;
+    uint32_t offset = ((uint32_t)_chunk[0] << 24) | ((uint32_t)_chunk[1] << 16) |
+                      ((uint32_t)_chunk[2] << 8) | _chunk[3];
+    uint32_t len = _this_size - 8;
+    uint8_t  rx_error = ACK;
+    int32_t  fsize;
+
+    if (!FILE_Unpark()) {
+        rx_error = NAK_FSERR;
+    } else if ((offset == _roffset) && (len <= _rtotal - _roffset)) {
+        if (!FILE_Out(_chunk + 4, len)) {
+            rx_error = NAK_FSERR;
+        } else {
+            /* Only the data is in the file's checksum, not the offset */
+            _rcsum = adler32_combine(_rcsum,
+                adler32_suffix(_csum, adler32_update(ADLER32_INIT, _chunk, 4), len), len);
+            _roffset += len;
+        }
+    }
+
+    if ((rx_error == ACK) && (_roffset == _rtotal)) {
+        /* All of it, store it under the name in the tag */
+        if (_rcsum != _cfchk) {
+            rx_error = NAK_CHKSUM;
+        } else if (!FILE_Kept(NULL, 0)) {
+            rx_error = NAK_FSERR;
+        } else {
+            memcpy(mentry.date, _dbuf + _fnsiz, 6);
+            _dbuf[_fnsiz] = 0x00;
+            rx_error = FILE_Store((const char*)_dbuf, mentry.date, false, &fsize);
+        }
+        if (rx_error == ACK) {
+            if ((fsize >= 0) && (_fnsiz < ESPSYNC_MAX_PATH)) {
+                strcpy(mentry.name, (const char*)_dbuf);
+                mentry.size = fsize;
+                mentry.csum = _cfchk;
+                _manifest.update(&mentry);
+            } else {
+                _manifest.invalidate();
+            }
+        }
+    }
+
+    if (rx_error != ACK) {
+        FILE_Cleanup();
+        TX_NAK(rx_error);
+        return;
+    }
+    NBO32(_dbuf, _roffset);
+    TX_DataBuf(RPL_CHUNK, 4);
+    MSG_Complete();
+}
+
+void ESPSync::PROCESS_Get(void) {
+    /**
+     * Send a file, or a range of it, back to the master.  The size is
+     * known once it is open, so the header goes at once, and the data
+     * follows as it is read.  FSIZE lets the master tail a growing log,
+     * asking each time from where it got to.
+     */
+    uint32_t offset = ((uint32_t)_dbuf[0] << 24) | ((uint32_t)_dbuf[1] << 16) |
+                      ((uint32_t)_dbuf[2] << 8) | _dbuf[3];
+    uint32_t length = ((uint32_t)_dbuf[4] << 24) | ((uint32_t)_dbuf[5] << 16) |
+                      ((uint32_t)_dbuf[6] << 8) | _dbuf[7];
+    char    *name = (char*)(_dbuf + GET_HEAD_SIZE);
+    int32_t  fsize;
+    int      f;
+
+    if (!_fs->begin()) {
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+
+    /* Turn the name in the buffer into a C string. */
+    _dbuf[_this_size-4] = 0x00;
+
+    if (ESPSYNC_INTERNAL(name)) {
+        TX_NAK(NAK_FNAMERR);
+        return;
+    }
+    if (!_fs->exists(name)) {
+        TX_NAK(NAK_FNOTF);
+        return;
+    }
+    f = _fs->open(name, "r");
+    fsize = (f == ESPSYNC_NO_FILE) ? -1 : _fs->size(f);
+    if ((fsize < 0) || ((offset < (uint32_t)fsize) && !_fs->seek(f, offset))) {
+        if (f != ESPSYNC_NO_FILE) {
+            _fs->close(f);
+        }
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+
+    /* Only what there is, and what fits in one reply */
+    if (offset > (uint32_t)fsize) {
+        offset = fsize;
+    }
+    if (length > (uint32_t)fsize - offset) {
+        length = fsize - offset;
+    }
+    if (length > GET_MAX_DATA) {
+        length = GET_MAX_DATA;
+    }
+
+    TX_Header(RPL_FILE, GET_REPLY_HEAD + length + 4);
+    NBO32(_dbuf, fsize);
+    NBO32(_dbuf+4, offset);
+    TX_Data(_dbuf, GET_REPLY_HEAD);
+    if (!TX_FileData(f, length)) {
+        /* Make sure the master throws it away */
+        _txcsum = ~_txcsum;
+    }
+    _fs->close(f);
+
+    TX_End();
+    MSG_Complete();
+}
+
+void ESPSync::PROCESS_Signature(void) {
+    /**
+     * Checksums of each block of a file, so the master can work out which
+     * parts of its copy the slave already has, and send a delta.
+     * The weak sum is Adler-32, which the master can roll along its data,
+     * the strong sum is CRC-32, to confirm a weak match.
+     */
+    uint16_t block = ((uint16_t)_dbuf[0] << 8) | _dbuf[1];
+    uint8_t  fbuf[CSUM_READ_SIZE];
+    int32_t  fsize;
+    uint32_t blocks;
+    int      f;
+
+    if (!_fs->begin()) {
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+
+    if (!RANGE_CHK(block, DELTA_MIN_BLOCK, DELTA_MAX_BLOCK)) {
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
+
+    /* Turn the name in the buffer into a C string. */
+    _dbuf[_this_size-4] = 0x00;
+
+    if (ESPSYNC_INTERNAL((char*)(_dbuf+2))) {
+        TX_NAK(NAK_FNAMERR);
+        return;
+    }
+
+    if (!_fs->exists((char*)(_dbuf+2))) {
+        TX_NAK(NAK_FNOTF);
+        return;
+    }
+    f = _fs->open((char*)(_dbuf+2), "r");
+    fsize = (f == ESPSYNC_NO_FILE) ? -1 : _fs->size(f);
+    if (fsize < 0) {
+        if (f != ESPSYNC_NO_FILE) {
+            _fs->close(f);
+        }
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+
+    blocks = ((uint32_t)fsize + block - 1) / block;
+    if (6 + (blocks * 8) + 4 > 0xFFFFFF) {
+        _fs->close(f);
+        TX_NAK(NAK_FSIZERR);
+        return;
+    }
+
+    TX_Header(RPL_SIGNATURE, 6 + (blocks * 8) + 4);
+    NBO32(_dbuf, fsize);
+    NBO16(_dbuf+4, block);
+    TX_Data(_dbuf, 6);
+
+    while (blocks-- > 0) {
+        uint32_t weak   = ADLER32_INIT;
+        uint32_t strong = CRC32_INIT;
+        uint32_t left   = block;
+        int32_t  frd;
+
+        while (left > 0) {
+            frd = _fs->read(f, fbuf, (left < sizeof(fbuf)) ? left : sizeof(fbuf));
+            if (frd <= 0) {
+                break;
+            }
+            weak   = adler32_update(weak, fbuf, frd);
+            strong = crc32_update(strong, fbuf, frd);
+            left  -= frd;
+        }
+        NBO32(_dbuf, weak);
+        NBO32(_dbuf+4, strong);
+        TX_Data(_dbuf, 8);
+    }
+    _fs->close(f);
+
+    TX_End();
+    MSG_Complete();
+}
+
+void ESPSync::PROCESS_DeltaRX(void) {
+    /**
+     * The whole delta has been applied, and its checksum is good.
+     * The rebuilt file must also match the master's copy, as a block
+     * can match both sums and still be different.
+     */
+    _fs->close(_basefile);
+    _basefile = ESPSYNC_NO_FILE;
+
+    if (_fcsum != _fcsum_want) {
+        bool done = false;
+
+        /* Applied the first time, only the reply was lost, but the base
+           may have been replaced by the rebuilt file since. */
+        if (MSG_Retransmit()) {
+            _dbuf[_fnsiz] = 0x00;
+            int f = _fs->open((char*)_dbuf, "r");
+            if (f != ESPSYNC_NO_FILE) {
+                done = (file_adler32(_fs, f) == _fcsum_want);
+                _fs->close(f);
+            }
+        }
+
+        FILE_Cleanup();
+        if (done) {
+            ESPSyncFSInfo fs_info;
+            _fs->info(&fs_info);
+            NBO32(_dbuf, fs_info.totalBytes );
+            NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
+            TX_DataBuf(RPL_RECEIVED, 8);
+        } else {
+            TX_NAK(NAK_CHKSUM);
+        }
+        return;
+    }
+
+    PROCESS_FileRX();
+}
+
+void ESPSync::PROCESS_LZRX(void) {
+    /**
+     * The checksum of the decompressed data is good, but the stream
+     * must also have ended exactly at the size the master said.
+     */
+    if ((_lzleft != 0) || !_lz.idle()) {
+        FILE_Cleanup();
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
+    _lz.end();
+    PROCESS_FileRX();
+}
+
+void ESPSync::PROCESS_CopyStart(void) {
+    /**
+     * Make a file from one already here, rather than have the master
+     * send it again, Eg, after a build renames its assets.  The source
+     * is copied a page at a time, from getData(), as a delta's COPY is,
+     * and must have the checksum the master expects of the new file.
+     */
+    ESPSyncFSInfo fs_info;
+    uint8_t  nsiz = _dbuf[0];
+    uint8_t *head = _dbuf + 1 + nsiz + 6;
+    char    *source = (char*)(head + COPY_HEAD_SIZE);
+    int32_t  fsize;
+
+    if (!_fs->begin() || !_fs->info(&fs_info)) {
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+
+    /* Both names must exactly fill the message */
+    if ((nsiz == 0) || ((uint32_t)nsiz + 1 + 6 + COPY_HEAD_SIZE >= _this_size - 4) ||
+        ((uint32_t)nsiz + 1 + 6 + COPY_HEAD_SIZE + head[4] != _this_size - 4)) {
+        TX_NAK(NAK_FORMAT);
+        return;
+    }
+    if ((nsiz >= fs_info.maxPathLength) ||
+        ((nsiz >= 3) && ESPSYNC_INTERNAL((char*)(_dbuf+1))) ||
+        ESPSYNC_INTERNAL(source)) {
+        TX_NAK(NAK_FNAMERR);
+        return;
+    }
+
+    /* Turn the source into a C string, and keep the name and date as a File's */
+    _fcsum_want = ((uint32_t)head[0] << 24) | ((uint32_t)head[1] << 16) |
+                  ((uint32_t)head[2] << 8) | head[3];
+    _dbuf[_this_size-4] = 0x00;
+    memmove(_dbuf, _dbuf+1, nsiz + 6);
+    _fnsiz = nsiz;
+
+    _basefile = _fs->open(source, "r");
+    if (_basefile == ESPSYNC_NO_FILE) {
+        PROCESS_CopyRX();
+        return;
+    }
+    fsize = _fs->size(_basefile);
+
+    /* A new upload replaces anything kept */
+    FILE_Forget();
+    _fpage = ESPSYNC_WRITE_PAGE(fs_info.pageSize);
+    _rxfile = _fs->open(_tempname, "w");
+    if ((fsize < 0) || (_rxfile == ESPSYNC_NO_FILE) ||
+        !_writer.begin(_fs, _rxfile, _fpage)) {
+        FILE_Cleanup();
+        TX_NAK(NAK_FSERR);
+        return;
+    }
+
+    /* Reading and writing all of it can outlast the master's timeout */
+    TX_ACK(DURATION_COPY * (((uint32_t)fsize / 1048576) + 1));
+
+    _fbuf = NULL;
+    _fbuf_len = 0;
+    _fcsum = ADLER32_INIT;
+    _run_left = fsize;
+    _body_left = 0;
+    _rxstate = RXSTATE_COPY_PAGE;
+}
+
+void ESPSync::PROCESS_CopyRX(void) {
+    /**
+     * All of the source has been copied to the temp file.  If there is
+     * no source, the copy may have been made the first time, with only
+     * the reply lost, and the source since removed or renamed.
+     */
+    ESPSyncFSInfo fs_info;
+    bool done = false;
+
+    if (_basefile != ESPSYNC_NO_FILE) {
+        _fs->close(_basefile);
+        _basefile = ESPSYNC_NO_FILE;
+        if (_fcsum == _fcsum_want) {
+            PROCESS_FileRX();
+            return;
+        }
+        FILE_Cleanup();
+        TX_NAK(NAK_CHKSUM);
+        return;
+    }
+
+    if (MSG_Retransmit()) {
+        _dbuf[_fnsiz] = 0x00;
+        int f = _fs->open((char*)_dbuf, "r");
+        if (f != ESPSYNC_NO_FILE) {
+            done = (file_adler32(_fs, f) == _fcsum_want);
+            _fs->close(f);
+        }
+    }
+    if (done) {
+        _fs->info(&fs_info);
+        NBO32(_dbuf, fs_info.totalBytes );
+        NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
+        TX_DataBuf(RPL_RECEIVED, 8);
+    } else {
+        TX_NAK(NAK_FNOTF);
+    }
+}
+
+/**
+ * Make sure the manifest has every file, rebuilding it if not, or if
+ * asked to.  A rebuild reads every file, so the master is ACK'd first.
+ */
+bool ESPSync::FILE_Manifest(ESPSyncFSInfo *fs_info, bool rebuild) {
+    if (rebuild || !_manifest.valid()) {
+        TX_ACK(DURATION_REHASH * ((fs_info->usedBytes / 1048576) + 1));
+        return _manifest.rebuild();
+    }
+    return true;
+}
+
+void ESPSync::PROCESS_BatchRX(void) {
+    /**
+     * Every record has been dealt with, and the checksum of the whole
+     * message is good.  Reply with how each record went.
+     */
+    ESPSyncFSInfo fs_info;
+
+    _writer.end();
+    _manifest.release();
+    _fs->info(&fs_info);
+
+    NBO32(_dbuf, fs_info.totalBytes);
+    NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
+    NBO8(_dbuf+8, _bcount);
+    memcpy(_dbuf+9, _bstatus, _bcount);
+    TX_DataBuf(RPL_BATCH, 9 + _bcount);
+    MSG_Complete();
+}
+
+/**
+ * Record that the current message has been carried out.
+ */
+void ESPSync::MSG_Complete(void) {
+    _history[_history_next].cmn  = _this_cmn;
+    _history[_history_next].fun  = _this_fun;
+    _history[_history_next].size = _this_size;
+    _history_next = (_history_next + 1) % ESPSYNC_MAX_WINDOW;
+}
+
+/**
+ * Is the current message a repeat of one already carried out?
+ * With a window of N, the master can have N messages outstanding, so
+ * the last N completed are checked.  A CMN is not reused until at
+ * least 32-N messages later, so a match can only be a retransmission.
+ */
+bool ESPSync::MSG_Retransmit(void) {
+    uint8_t h = _history_next;
+
+    for (uint8_t x = 0; x < _window; x++) {
+        h = (h + ESPSYNC_MAX_WINDOW - 1) % ESPSYNC_MAX_WINDOW;
+        if ((_history[h].cmn == _this_cmn) &&
+            (_history[h].fun == _this_fun) &&
+            (_history[h].size == _this_size)) {
+            _stats.retransmits++;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CheckMessageSizes(uint8_t func, uint32_t size) {
+    /**
+     * Only check messages that have data bodies, AND fit in the small message buffer.
+     * Sizes include the 4 byte data checksum.
+     */
+    bool OK = false;
+    if ((func == CMD_SET_TIME) && (size == 10)) {
+        OK = true;
+    } else if ((func == CMD_LIST) && (size == 5)) {
+        OK = true;
+    } else if ((func == CMD_REMOVE) && (size >= 5) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_RENAME) && (size >= 8) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_SESSION) && (size >= 6) && (size <= TEMP_BUFFER_SIZE)) {
+        /* Later versions of the protocol may send more */
+        OK = true;
+    } else if ((func == CMD_SIGNATURE) && (size >= 7) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_HASH) && (size >= 5) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_BAUD) && (size >= 8) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_STATS) && (size == 5)) {
+        OK = true;
+    } else if ((func == CMD_RESUME) && (size >= 5) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_CHUNKED) && (size > CHUNKED_SIZE) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_GET) && (size > GET_HEAD_SIZE + 4) && (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    } else if ((func == CMD_COPY) && (size >= 1 + 1 + 6 + COPY_HEAD_SIZE + 1 + 4) &&
+               (size <= TEMP_BUFFER_SIZE)) {
+        OK = true;
+    }
+
+    return OK;
+}
+
+/**
+ * Process individual bytes, looking for valid message headers.
+ */
+bool ESPSync::ProcessByte(uint8_t byte)
+{
+    ProcessBytes(&byte, 1);
+    return true;
+}
+
+/**
+ * Process a buffer of bytes, looking for valid message headers.
+ */
+size_t ESPSync::ProcessBytes(const uint8_t *data, size_t length)
+{
+    size_t used;
+
+    FILE_Lock();
+    used = RX_Process(data, length, false);
+    FILE_Unlock();
+    return used;
+}
+
+/**
+ * Another instance may share the filesystem, only one at a time
+ * carries out its messages.  Application data is passed through
+ * without waiting for the lock.
+ */
+void ESPSync::FILE_Lock(void)
+{
+    if (_fs != NULL) {
+        _fs->lock();
+    }
+}
+
+void ESPSync::FILE_Unlock(void)
+{
+    if (_fs != NULL) {
+        _fs->unlock();
+    }
+}
+
+/**
+ * Check the header bytes received so far.
+ * Fails as soon as any field shows it can not be a header.
+ */
+bool ESPSync::RX_HeaderValid(void)
+{
+    /* Make sure CMN is valid, otherwise, not a header */
+    if ((_rxstate > RXSTATE_WAIT_CMN) && ((uint8_t)RX_CMN(_hdr[1]) > CMN_MAX)) {
+        _stats.rejects[RXSTATE_WAIT_CMN]++;
+        return false;
+    }
+
+    /* Make sure function is valid, otherwise, not a header */
+    if ((_rxstate > RXSTATE_WAIT_FUN) && (_hdr[2] != ACK) &&
+        ((_hdr[2] < CMD_FIRST) || (_hdr[2] > CMD_LAST)) &&
+        ((_hdr[2] < CMD_EXT_FIRST) || (_hdr[2] > CMD_EXT_LAST))) {
+        _stats.rejects[RXSTATE_WAIT_FUN]++;
+        return false;
+    }
+
+    if (_rxstate > RXSTATE_WAIT_CHK_LO) {
+        uint16_t csum = 0;
+        for (uint8_t x = 0; x < RXSTATE_WAIT_CHK_HI; x++) {
+            fletcher16(&csum, _hdr[x]);
+        }
+        if ((_hdr[6] != (csum >> 8)) || (_hdr[7] != (csum & 0xFF))) {
+            _stats.rejects[RXSTATE_WAIT_CHK_LO]++;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Give a byte that was held back to the application.
+ */
+void ESPSync::RX_Release(uint8_t byte)
+{
+    if (!_pending.put(byte)) {
+        _stats.rxDropped++;
+    }
+}
+
+/**
+ * A partial header turned out not to be one.  The STX was application
+ * data, and the bytes after it must be scanned again, because any of
+ * them could be the start of a real header.
+ */
+void ESPSync::RX_Reject(void)
+{
+    uint8_t held[sizeof(_hdr)];
+    uint8_t nheld = _rxstate - 1;
+
+    memcpy(held, _hdr+1, nheld);
+    RX_Release(_hdr[0]);
+    reset_rxstate();
+
+    RX_Process(held, nheld, true);
+}
+
+/**
+ * A valid header has been received, so process it.
+ */
+void ESPSync::RX_Dispatch(void)
+{
+    _active = true; /* Protocol now active */
+
+    _this_cmn  = RX_CMN(_hdr[1]);
+    _this_fun  = _hdr[2];
+    _this_size = ((uint32_t)_hdr[3] << 16) | ((uint32_t)_hdr[4] << 8) | _hdr[5];
+    _rx_start  = espsync_micros();
+    _msg_time  = espsync_millis();
+    if (!_session) {
+        _session = true;
+        MSG_Event(ESPSYNC_EVENT_SESSION_START, NULL);
+    }
+    if ((_this_fun != ACK) && (_this_fun != CMD_CHUNK)) {
+        FILE_Park();
+    }
+
+    switch (_this_fun) {
+        case ACK:
+            // Check Ack OPT Filler is valid.
+            if ((_this_size & 0xFF) == 0x5A) {
+                // Just reply with an ACK.
+                TX_ACK((_this_size>>8)+1);
+            }
+            reset_rxstate();
+            break;
+
+        case CMD_SET_TIME:
+        case CMD_LIST:
+        case CMD_REMOVE:
+        case CMD_RENAME:
+        case CMD_SESSION:
+        case CMD_SIGNATURE:
+        case CMD_HASH:
+        case CMD_BAUD:
+        case CMD_STATS:
+        case CMD_RESUME:
+        case CMD_CHUNKED:
+        case CMD_GET:
+        case CMD_COPY:
+            if (CheckMessageSizes(_this_fun, _this_size)) {
+                /* Session is always Adler-32, so it can always be sent */
+                _rxck = (_this_fun == CMD_SESSION) ? &espsync_csums[CSUM_ADLER32] : _ck;
+                _data_size = 0;
+                _rxstate = RXSTATE_WAIT_DATA;
+                _csum = _rxck->init;
+            } else {
+                // Size is wrong, dont reply to bad headers.
+                RX_BadSize();
+            }
+            break;
+
+        case CMD_FORMAT:
+            if (_this_size == 0) {
+                PROCESS_Format();
+                reset_rxstate();
+            } else {
+                RX_BadSize();
+            }
+            break;
+
+        case CMD_FILE:
+            if (_this_size >= 10) {
+                PROCESS_FileStart();
+            } else {
+                RX_BadSize();
+            }
+            break;
+
+        case CMD_FILE_LZ:
+            if (_this_size >= 10 + LZ_HEAD_SIZE) {
+                PROCESS_FileStart();
+            } else {
+                RX_BadSize();
+            }
+            break;
+
+        case CMD_BATCH:
+            /* At least one record, of an empty file */
+            if (_this_size >= 1 + 1 + BATCH_HEAD_SIZE + BATCH_RCHK_SIZE + 4) {
+                PROCESS_BatchStart();
+            } else {
+                RX_BadSize();
+            }
+            break;
+
+        case CMD_CHUNK:
+            /* OFFSET and at least a byte, held until CHK2 is checked */
+            if ((_this_size < 4 + 1 + 4) || (_this_size > 4 + ESPSYNC_CHUNK_SIZE + 4)) {
+                RX_BadSize();
+            } else {
+                _csum = ADLER32_INIT;
+                _body_left = _this_size;
+                if (!_chunked) {
+                    RX_Abort(NAK_FNOTF);
+                } else if (_this_size > 4 + (uint32_t)_csize + 4) {
+                    RX_Abort(NAK_FORMAT);
+                } else {
+                    _rxstate = RXSTATE_CHUNK_DATA;
+                }
+            }
+            break;
+
+        case CMD_CONTINUE:
+            if (_this_size >= 10 + RESUME_HEAD_SIZE) {
+                PROCESS_FileStart();
+            } else {
+                RX_BadSize();
+            }
+            break;
+
+        case CMD_DELTA:
+            /* At least a one character name and base */
+            if (_this_size >= 10 + DELTA_HEAD_SIZE + 1) {
+                PROCESS_FileStart();
+            } else {
+                RX_BadSize();
+            }
+            break;
+
+        default:
+            reset_rxstate();
+    }
+}
+
+/**
+ * A valid header, but with a size its function can not have.
+ */
+void ESPSync::RX_BadSize(void)
+{
+    _stats.rejects[RXSTATE_WAIT_SIZ_LO]++;
+    reset_rxstate();
+}
+
+/**
+ * Run the receive state machine over a buffer.
+ * Non-protocol data is skipped with a memchr() for STX, and header,
+ * body and checksum fields are taken as whole slices of the buffer.
+ *
+ * Returns the number of bytes consumed.  Stops early when the handler
+ * goes idle, so the caller can give what follows to the application.
+ * When release is true (re-scanning a rejected header) nothing is
+ * skipped, non-protocol bytes are queued for the application instead.
+ */
+size_t ESPSync::RX_Process(const uint8_t *data, size_t length, bool release)
+{
+    const uint8_t *next = data;
+    const uint8_t *end  = data + length;
+    size_t  n;
+
+    while (next < end) {
+        switch (_rxstate) {
+            case RXSTATE_WAIT_STX:
+                if (release) {
+                    while ((next < end) && (*next != STX)) {
+                        RX_Release(*next++);
+                    }
+                    if (next == end) {
+                        break;
+                    }
+                } else if (next != data) {
+                    return next - data;
+                } else {
+                    next = (const uint8_t*)memchr(next, STX, end - next);
+                    if (next == NULL) {
+                        return length;
+                    }
+                }
+                _hdr[0] = *next++;
+                _rxstate = RXSTATE_WAIT_CMN;
+                break;
+
+            case RXSTATE_WAIT_CMN:
+            case RXSTATE_WAIT_FUN:
+            case RXSTATE_WAIT_SIZ_HI:
+            case RXSTATE_WAIT_SIZ_MD:
+            case RXSTATE_WAIT_SIZ_LO:
+            case RXSTATE_WAIT_CHK_HI:
+            case RXSTATE_WAIT_CHK_LO:
+                /* The state is also the number of header bytes held */
+                n = sizeof(_hdr) - _rxstate;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                memcpy(_hdr + _rxstate, next, n);
+                next += n;
+                _rxstate += n;
+
+                if (!RX_HeaderValid()) {
+                    RX_Reject();
+                    if (!release) {
+                        return next - data;
+                    }
+                } else if (_rxstate == sizeof(_hdr)) {
+                    RX_Dispatch();
+                }
+                break;
+
+            case RXSTATE_WAIT_DATA:
+                // General data reception for messages smaller than _dbuf
+                n = _this_size - 4 - _data_size;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                memcpy(_dbuf + _data_size, next, n);
+                _csum = _rxck->update(_csum, next, n);
+                _data_size += n;
+                next += n;
+                if ((uint32_t)(_data_size+4) == _this_size) {
+                    _rxstate++;
+                }
+                break;
+
+            case RXSTATE_FILE_NSIZ:
+                _fnsiz = *next++;
+                _body_left--;
+                if ((_fnsiz == 0) || (_fnsiz >= _fmaxpath) ||
+                    (_fnsiz + 6 > TEMP_BUFFER_SIZE) ||
+                    ((uint32_t)_fnsiz + 6 + 4 > _body_left)) {
+                    RX_Abort(NAK_FNAMERR);
+                } else {
+                    _csum = adler32_update(_csum, &_fnsiz, 1);
+                    _data_size = 0;
+                    _rxstate = RXSTATE_FILE_NAME;
+                }
+                break;
+
+            case RXSTATE_FILE_NAME:
+                /* Name and Date, into the small buffer */
+                n = _fnsiz + 6 - _data_size;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                memcpy(_dbuf + _data_size, next, n);
+                _csum = adler32_update(_csum, next, n);
+                _data_size += n;
+                _body_left -= n;
+                next += n;
+                if (_data_size == _fnsiz + 6) {
+                    if (_this_fun == CMD_FILE) {
+                        _hcsum = _csum;
+                        _rxstate = (_body_left == 4) ? RXSTATE_WAIT_CHK2_24 : RXSTATE_FILE_DATA;
+                    } else {
+                        /* A fixed size header follows, before the data */
+                        uint8_t head = RXSTATE_LZ_HEAD;
+                        _op_len = 0;
+                        _op_need = LZ_HEAD_SIZE;
+                        if (_this_fun == CMD_DELTA) {
+                            head = RXSTATE_DELTA_HEAD;
+                            _op_need = DELTA_HEAD_SIZE;
+                        } else if (_this_fun == CMD_CONTINUE) {
+                            head = RXSTATE_RESUME_HEAD;
+                            _op_need = RESUME_HEAD_SIZE;
+                        }
+                        if (_body_left < (uint32_t)_op_need + 4) {
+                            RX_Abort(NAK_FORMAT);
+                        } else {
+                            _rxstate = head;
+                        }
+                    }
+                }
+                break;
+
+            case RXSTATE_FILE_DATA:
+                next += RX_FileData(next, end - next);
+                if ((_rxstate == RXSTATE_FILE_DATA) && (_body_left == 4)) {
+                    _rxstate = RXSTATE_WAIT_CHK2_24;
+                }
+                break;
+
+            case RXSTATE_BATCH_NSIZ:
+                _fnsiz = *next++;
+                _body_left--;
+                if ((_fnsiz == 0) || (_fnsiz >= _fmaxpath) ||
+                    (_fnsiz + BATCH_HEAD_SIZE > TEMP_BUFFER_SIZE) ||
+                    ((uint32_t)_fnsiz + BATCH_HEAD_SIZE + BATCH_RCHK_SIZE + 4 > _body_left)) {
+                    RX_Abort(NAK_FNAMERR);
+                } else if (_bcount == ESPSYNC_BATCH_FILES) {
+                    RX_Abort(NAK_FORMAT);
+                } else {
+                    _fcsum = adler32_update(ADLER32_INIT, &_fnsiz, 1);
+                    _data_size = 0;
+                    _rxstate = RXSTATE_BATCH_NAME;
+                }
+                break;
+
+            case RXSTATE_BATCH_NAME:
+                /* Name, Date and Size, into the small buffer */
+                n = _fnsiz + BATCH_HEAD_SIZE - _data_size;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                memcpy(_dbuf + _data_size, next, n);
+                _fcsum = adler32_update(_fcsum, next, n);
+                _data_size += n;
+                _body_left -= n;
+                next += n;
+                if (_data_size == _fnsiz + BATCH_HEAD_SIZE) {
+                    RX_BatchName();
+                }
+                break;
+
+            case RXSTATE_BATCH_DATA:
+                next += RX_BatchData(next, end - next);
+                break;
+
+            case RXSTATE_BATCH_RCHK:
+                next += RX_Field(next, end - next);
+                if (_op_len == _op_need) {
+                    RX_BatchRecord();
+                }
+                break;
+
+            case RXSTATE_DELTA_HEAD:
+                next += RX_Field(next, end - next);
+                if (_op_len == _op_need) {
+                    RX_DeltaHead();
+                }
+                break;
+
+            case RXSTATE_DELTA_BASE:
+                n = _fnsiz + 6 + _op[6] - _data_size;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                memcpy(_dbuf + _data_size, next, n);
+                _csum = adler32_update(_csum, next, n);
+                _data_size += n;
+                _body_left -= n;
+                next += n;
+                if (_data_size == _fnsiz + 6 + _op[6]) {
+                    RX_DeltaBase();
+                }
+                break;
+
+            case RXSTATE_DELTA_OP:
+                if (_body_left == 4) {
+                    _rxstate = RXSTATE_WAIT_CHK2_24;
+                    break;
+                }
+                next += RX_Field(next, end - next);
+                if (_op_len == _op_need) {
+                    RX_DeltaOp();
+                }
+                break;
+
+            case RXSTATE_DELTA_LITERAL:
+                n = _run_left;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                _csum = adler32_update(_csum, next, n);
+                _fcsum = adler32_update(_fcsum, next, n);
+                _body_left -= n;
+                _run_left -= n;
+                if (!FILE_Out(next, n)) {
+                    RX_Abort(NAK_FSERR);
+                } else if (_run_left == 0) {
+                    _rxstate = RXSTATE_DELTA_OP;
+                }
+                next += n;
+                break;
+
+            case RXSTATE_LZ_HEAD:
+                next += RX_Field(next, end - next);
+                if (_op_len == _op_need) {
+                    RX_LZHead();
+                }
+                break;
+
+            case RXSTATE_RESUME_HEAD:
+                next += RX_Field(next, end - next);
+                if (_op_len == _op_need) {
+                    RX_ResumeHead();
+                }
+                break;
+
+            case RXSTATE_CHUNK_DATA:
+                /* OFFSET and data, held until CHK2 shows they are intact */
+                n = _body_left - 4;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                memcpy(_chunk + (_this_size - _body_left), next, n);
+                _csum = adler32_update(_csum, next, n);
+                _body_left -= n;
+                next += n;
+                if (_body_left == 4) {
+                    _rxstate = RXSTATE_WAIT_CHK2_24;
+                }
+                break;
+
+            case RXSTATE_LZ_DATA:
+                if (_body_left == 4) {
+                    _rxstate = RXSTATE_WAIT_CHK2_24;
+                    break;
+                }
+                next += RX_LZData(next, end - next);
+                break;
+
+            case RXSTATE_COPY_PAGE:
+                /* Copy a page, then let the main loop run */
+                RX_CopyPage();
+                return next - data;
+
+            case RXSTATE_DISCARD:
+                /* Rest of a message that has already been NAK'd */
+                n = _body_left;
+                if (n > (size_t)(end - next)) {
+                    n = end - next;
+                }
+                next += n;
+                _body_left -= n;
+                if (_body_left == 0) {
+                    reset_rxstate();
+                }
+                break;
+
+            case RXSTATE_WAIT_CHK2_24:
+            case RXSTATE_WAIT_CHK2_16:
+            case RXSTATE_WAIT_CHK2_8:
+                if (*next++ == BYTEAT(_csum, (RXSTATE_WAIT_CHK2_0 - _rxstate) * 8)) {
+                    _rxstate++;
+                } else {
+                    // Data body error, so NAK
+                    _body_left = RXSTATE_WAIT_CHK2_0 - _rxstate;
+                    RX_Abort(NAK_CHKSUM);
+                }
+                break;
+
+            case RXSTATE_WAIT_CHK2_0:
+                if (*next++ == BYTEAT(_csum,0)) {
+                    // Process small messages here, a Copy carries on after
+                    reset_rxstate();
+                    switch (_this_fun) {
+                        case CMD_SET_TIME:
+                            PROCESS_SetTime();
+                            break;
+
+                        case CMD_LIST:
+                            PROCESS_Listing();
+                            break;
+
+                        case CMD_REMOVE:
+                            PROCESS_Remove();
+                            break;
+                        
+                        case CMD_RENAME:
+                            PROCESS_Rename();
+                            break;
+
+                        case CMD_SESSION:
+                            PROCESS_Session();
+                            break;
+
+                        case CMD_FILE:
+                            PROCESS_FileRX();
+                            break;
+
+                        case CMD_SIGNATURE:
+                            PROCESS_Signature();
+                            break;
+
+                        case CMD_DELTA:
+                            PROCESS_DeltaRX();
+                            break;
+
+                        case CMD_FILE_LZ:
+                            PROCESS_LZRX();
+                            break;
+
+                        case CMD_HASH:
+                            PROCESS_Hash();
+                            break;
+
+                        case CMD_BATCH:
+                            PROCESS_BatchRX();
+                            break;
+
+                        case CMD_BAUD:
+                            PROCESS_Baud();
+                            break;
+
+                        case CMD_STATS:
+                            PROCESS_Stats();
+                            break;
+
+                        case CMD_RESUME:
+                            PROCESS_Resume();
+                            break;
+
+                        case CMD_CONTINUE:
+                            PROCESS_FileRX();
+                            break;
+
+                        case CMD_CHUNKED:
+                            PROCESS_ChunkStart();
+                            break;
+
+                        case CMD_CHUNK:
+                            PROCESS_ChunkRX();
+                            break;
+
+                        case CMD_GET:
+                            PROCESS_Get();
+                            break;
+
+                        case CMD_COPY:
+                            PROCESS_CopyStart();
+                            break;
+                    }
+                } else {
+                    // Data body error, so NAK
+                    _body_left = 0;
+                    RX_Abort(NAK_CHKSUM);
+                }
+                break;
+
+            default :
+                // State Machine Error, just abort.
+                reset_rxstate();
+
+        }
+    }
+
+    if (_rxstate >= RXSTATE_WAIT_DATA) {
+        _rx_time = espsync_millis();
+    }
+    return length;
+}
+
+/**
+ * Gather a fixed size field of a message body into _op.
+ * Returns the number of bytes used.
+ */
+size_t ESPSync::RX_Field(const uint8_t *data, size_t length)
+{
+    size_t n = _op_need - _op_len;
+
+    if (n > length) {
+        n = length;
+    }
+    memcpy(_op + _op_len, data, n);
+    _csum = adler32_update(_csum, data, n);
+    _op_len += n;
+    _body_left -= n;
+    return n;
+}
+
+/**
+ * The delta header is in _op, check it and get the base file name.
+ */
+void ESPSync::RX_DeltaHead(void)
+{
+    uint8_t blen = _op[6];
+
+    _block = ((uint16_t)_op[0] << 8) | _op[1];
+    _fcsum_want = ((uint32_t)_op[2] << 24) | ((uint32_t)_op[3] << 16) |
+                  ((uint32_t)_op[4] << 8) | _op[5];
+
+    if (!RANGE_CHK(_block, DELTA_MIN_BLOCK, DELTA_MAX_BLOCK)) {
+        RX_Abort(NAK_FORMAT);
+    } else if ((blen == 0) || (blen >= _fmaxpath) ||
+               (_fnsiz + 6 + blen + 1 > TEMP_BUFFER_SIZE) ||
+               ((uint32_t)blen + 4 > _body_left)) {
+        RX_Abort(NAK_FNAMERR);
+    } else {
+        _data_size = _fnsiz + 6;
+        _rxstate = RXSTATE_DELTA_BASE;
+    }
+}
+
+/**
+ * The base file name is in the buffer, after the name and date.
+ */
+void ESPSync::RX_DeltaBase(void)
+{
+    char *base = (char*)(_dbuf + _fnsiz + 6);
+
+    _dbuf[_data_size] = 0x00;
+    if (ESPSYNC_INTERNAL(base)) {
+        RX_Abort(NAK_FNAMERR);
+        return;
+    }
+    _basefile = _fs->open(base, "r");
+    if (_basefile == ESPSYNC_NO_FILE) {
+        RX_Abort(NAK_FNOTF);
+        return;
+    }
+
+    _fcsum = ADLER32_INIT;
+    _op_len = 0;
+    _op_need = 1;
+    _rxstate = RXSTATE_DELTA_OP;
+}
 
-    if (rx_error == ACK) {
-        SPIFFS.info(fs_info);
+/**
+ * A delta op, or the op byte of one, is in _op.
+ */
+void ESPSync::RX_DeltaOp(void)
+{
+    if (_op_len == 1) {
+        /* Now the op is known, so is the size of its arguments */
+        if (_op[0] == DELTA_OP_COPY) {
+            _op_need = 7;
+        } else if (_op[0] == DELTA_OP_LITERAL) {
+            _op_need = 3;
+        } else {
+            RX_Abort(NAK_FORMAT);
+            return;
+        }
+        if ((uint32_t)_op_need - 1 > _body_left - 4) {
+            RX_Abort(NAK_FORMAT);
+        }
+        return;
+    }
 
-        NBO32(_dbuf, fs_info.totalBytes );
-        NBO32((_dbuf+4), (fs_info.totalBytes - fs_info.usedBytes));
-        TX_DataBuf(RPL_RECEIVED, 8);
+    if (_op[0] == DELTA_OP_COPY) {
+        uint32_t index = ((uint32_t)_op[1] << 24) | ((uint32_t)_op[2] << 16) |
+                         ((uint32_t)_op[3] << 8) | _op[4];
+        uint16_t count = ((uint16_t)_op[5] << 8) | _op[6];
+        uint64_t pos   = (uint64_t)index * _block;
 
+        if ((count == 0) || (pos > 0xFFFFFFFF) ||
+            !_fs->seek(_basefile, (uint32_t)pos)) {
+            RX_Abort(NAK_FORMAT);
+            return;
+        }
+        _run_left = (uint32_t)count * _block;
+        _rxstate = RXSTATE_COPY_PAGE;
+        /* The master waits for the copy, it can be longer than its timeout */
+        TX_ACK(DURATION_COPY * ((_run_left / 1048576) + 1));
     } else {
-        /* BAD RX, Attempt to clean up temp file */
-        if (SPIFFS.exists("///TEMP")) {
-            SPIFFS.remove("///TEMP");
+        _run_left = ((uint32_t)_op[1] << 8) | _op[2];
+        if (_run_left > _body_left - 4) {
+            RX_Abort(NAK_FORMAT);
+            return;
+        }
+        if (_run_left > 0) {
+            _rxstate = RXSTATE_DELTA_LITERAL;
         }
-        /* Send Error */
-        TX_NAK(rx_error);
     }
+    _op_len = 0;
+    _op_need = 1;
 }
 
-void ESPSync::MSG_Complete(void) {
-    _prev_cmn = _this_cmn;
-    _prev_fun = _this_fun;
-    _prev_size = _this_size;
-}
+/**
+ * Copy one page worth of a COPY from the base file, straight into a
+ * writer buffer.  Done a page at a time, from getData(), so a long
+ * copy does not hold up the main loop.  The stream is not read until
+ * the copy is done, so the master stops after the COPY op, and waits
+ * for an ACK at the start and another at the end, before sending the
+ * rest, rather than overrun the UART.  A Copy message is copied the
+ * same way, the whole of its source file, once all of it has arrived.
+ */
+void ESPSync::RX_CopyPage(void)
+{
+    uint32_t n;
+    int32_t  frd;
+
+    if (_fbuf == NULL) {
+        _fbuf = _writer.get();
+        if (_fbuf == NULL) {
+            RX_Abort(NAK_FSERR);
+            return;
+        }
+    }
 
-bool ESPSync::MSG_Retransmit(void) {
-    return ((_prev_cmn == _this_cmn) &&
-            (_prev_fun == _this_fun) &&
-            (_prev_size == _this_size));
+    n = _fpage - _fbuf_len;
+    if (n > _run_left) {
+        n = _run_left;
+    }
+    frd = _fs->read(_basefile, _fbuf + _fbuf_len, n);
+    if (frd <= 0) {
+        /* Past the end of the base, the last block can be short */
+        _run_left = 0;
+    } else {
+        _fcsum = adler32_update(_fcsum, _fbuf + _fbuf_len, frd);
+        _fbuf_len += frd;
+        _run_left -= frd;
+        if (_fbuf_len == _fpage) {
+            FILE_Flush();
+        }
+    }
+
+    _rx_time = espsync_millis();
+    if (_run_left == 0) {
+        if (_this_fun == CMD_COPY) {
+            reset_rxstate();
+            PROCESS_CopyRX();
+        } else {
+            _rxstate = RXSTATE_DELTA_OP;
+            TX_ACK(RX_TIMEOUT);
+        }
+    }
 }
 
-bool CheckMessageSizes(uint8_t func, uint32_t size) {
-    /**
-     * Only check messages that have data bodies, AND fit in the small message buffer.
-     */
-    bool OK = false;
-    if ((func == CMD_SET_TIME) && (size == 8)) {
-        OK = true;
-    } else if ((func == CMD_LIST) && (size == 3)) {
-        OK = true;
-    } else if ((func == CMD_REMOVE) && (size >= 3) && (size <= TEMP_BUFFER_SIZE)) {
-        OK = true;
-    } else if ((func == CMD_RENAME) && (size >= 6) && (size <= TEMP_BUFFER_SIZE)) {
-        OK = true;
+/**
+ * The continuation header is in _op.  Check it against the upload
+ * kept, then append the rest of the file to it.  If the master has
+ * the offset wrong, what is kept is left for it to ask about again.
+ */
+void ESPSync::RX_ResumeHead(void)
+{
+    uint8_t  code = ACK;
+    uint32_t offset = ((uint32_t)_op[0] << 24) | ((uint32_t)_op[1] << 16) |
+                      ((uint32_t)_op[2] << 8) | _op[3];
+    _fcsum_want = ((uint32_t)_op[4] << 24) | ((uint32_t)_op[5] << 16) |
+                  ((uint32_t)_op[6] << 8) | _op[7];
+
+    if (!FILE_Kept(_dbuf, _fnsiz)) {
+        RX_Abort(NAK_FNOTF);
+        return;
+    }
+    _rxfile = _fs->open(_tempname, "a");
+    if (_rxfile == ESPSYNC_NO_FILE) {
+        RX_Abort(NAK_FSERR);
+        return;
+    }
+    _roffset = _fs->size(_rxfile);
+    if ((offset != _roffset) || ((uint64_t)offset + _body_left - 4 != _rtotal)) {
+        code = NAK_FSIZERR;
+    } else if (!_writer.begin(_fs, _rxfile, _fpage)) {
+        code = NAK_FSERR;
+    }
+    if (code != ACK) {
+        _fs->close(_rxfile);
+        _rxfile = ESPSYNC_NO_FILE;
+        RX_Abort(code);
+        return;
     }
 
-    return OK;
+    _hcsum = _csum;
+    _rxstate = (_body_left == 4) ? RXSTATE_WAIT_CHK2_24 : RXSTATE_FILE_DATA;
 }
 
 /**
- * Process individual bytes, looking for valid message headers.
+ * The compressed file header is in _op, check it and start decoding.
  */
-bool ESPSync::ProcessByte(uint8_t byte)
+void ESPSync::RX_LZHead(void)
 {
-    uint8_t input = byte;
-    bool    process = true;
+    uint8_t bits = _op[1];
 
-    while (process) {
-        process = false;
+    _lzflags = _op[0];
+    _lzleft  = ((uint32_t)_op[2] << 24) | ((uint32_t)_op[3] << 16) |
+               ((uint32_t)_op[4] << 8) | _op[5];
 
-        if (_chk_mode != CSUM_SKIP) {
-            if (_chk_mode == CSUM_FLETCHER16) {
-                fletcher16(&_csum_hi, byte);
-            } else {
-                adler32(&_csum_hi, &_csum_lo, byte);
-            }
+    if (((_lzflags & ~LZ_FLAG_STORE) != 0) ||
+        !RANGE_CHK(bits, ESPSYNC_LZ_MIN_BITS, ESPSYNC_LZ_WINDOW_BITS)) {
+        RX_Abort(NAK_FORMAT);
+    } else if (!_lz.begin(bits)) {
+        RX_Abort(NAK_FSERR);
+    } else {
+        _hcsum = _csum;
+        _fcsum = ADLER32_INIT;
+        _rxstate = RXSTATE_LZ_DATA;
+    }
+}
+
+/**
+ * Take compressed file data from a received slice.  It is decoded
+ * straight into the writer's page buffers, or when the file is kept
+ * compressed, written as it is and decoded only to be checksummed.
+ * Returns the number of bytes used.
+ */
+size_t ESPSync::RX_LZData(const uint8_t *data, size_t length)
+{
+    uint8_t  scratch[CSUM_READ_SIZE];
+    uint8_t *out;
+    size_t   room;
+    size_t   used = 0;
+    size_t   made;
+
+    if (length > _body_left - 4) {
+        length = _body_left - 4;
+    }
+    _body_left -= length;
+
+    if (_lzflags & LZ_FLAG_STORE) {
+        _fcsum = adler32_update(_fcsum, data, length);
+        if (!FILE_Out(data, length)) {
+            RX_Abort(NAK_FSERR);
+            return length;
         }
+    }
 
-        switch (_rxstate) {
-            case RXSTATE_WAIT_STX:
-                if (input == STX) {
-                    _rxstate++;
-                    _csum_hi = 0x0202; // Preload Checksum with STX Values
-                    _chk_mode = CSUM_FLETCHER16;
+    for (;;) {
+        if (_lzflags & LZ_FLAG_STORE) {
+            out  = scratch;
+            room = sizeof(scratch);
+        } else {
+            if (_fbuf == NULL) {
+                _fbuf = _writer.get();
+                if (_fbuf == NULL) {
+                    RX_Abort(NAK_FSERR);
+                    break;
                 }
-                break;
+            }
+            out  = _fbuf + _fbuf_len;
+            room = _fpage - _fbuf_len;
+        }
+        if (room > _lzleft) {
+            room = _lzleft;
+        }
 
-            case RXSTATE_WAIT_CMN:
-                /* Make sure CMN is valid, otherwise, not a header */
-                input = RX_CMN(input);
-                if (input <=CMN_MAX) {
-                    _this_cmn = input;
-                    _rxstate++;
-                } else {
-                    reset_rxstate();
-                }
-                break;
+        used += _lz.decode(data + used, length - used, out, room, &made);
+        _csum = adler32_update(_csum, out, made);
+        _lzleft -= made;
+        if (!(_lzflags & LZ_FLAG_STORE)) {
+            _fbuf_len += made;
+            if (_fbuf_len == _fpage) {
+                FILE_Flush();
+            }
+        }
 
-            case RXSTATE_WAIT_FUN:
-                /* Make sure function is valid, otherwise, not a header */
-                if ((input == ACK) ||
-                   ((input >= CMD_SET_TIME) && (input <= CMD_FILE))) {
-                    _this_fun = input;
-                    _rxstate++;
-                } else {
-                    reset_rxstate();
-                }
-                break;
+        /* A bad stream, or one that decodes to more than it should */
+        if (_lz.error() || ((room == 0) && (used < length))) {
+            RX_Abort(NAK_FORMAT);
+            break;
+        }
+        /* Out of input, unless the output filled first */
+        if ((room == 0) || (made < room)) {
+            break;
+        }
+    }
+    return length;
+}
 
-            case RXSTATE_WAIT_SIZ_HI:
-                _this_size = input << 16;
-                _rxstate++;
-                break;
+/**
+ * The name, date and size of a batch record are in the buffer.
+ * Start receiving its file, unless it is to be thrown away.
+ */
+void ESPSync::RX_BatchName(void)
+{
+    uint8_t *fsize = _dbuf + _fnsiz + 6;
 
-            case RXSTATE_WAIT_SIZ_MD:
-                _this_size = input << 8;
-                _rxstate++;
-                break;
+    _hcsum = _fcsum;
+    _bsize = ((uint32_t)fsize[0] << 24) | ((uint32_t)fsize[1] << 16) |
+             ((uint32_t)fsize[2] << 8) | fsize[3];
+    if (_bsize > _body_left - BATCH_RCHK_SIZE - 4) {
+        RX_Abort(NAK_FORMAT);
+        return;
+    }
 
-            case RXSTATE_WAIT_SIZ_LO:
-                _this_size |= input;
-                _rxstate++;
-                _chk_mode = CSUM_SKIP; /* Stop computing checksum */
-                break;
+    _bstatus[_bcount] = ACK;
+    if ((_fnsiz >= 3) && ESPSYNC_INTERNAL((const char*)_dbuf)) {
+        _bstatus[_bcount] = NAK_FNAMERR;
+    } else {
+        _rxfile = _fs->open(_tempname, "w");
+        if ((_rxfile == ESPSYNC_NO_FILE) || !_writer.next(_rxfile)) {
+            _bstatus[_bcount] = NAK_FSERR;
+        }
+    }
 
-            case RXSTATE_WAIT_CHK_HI:
-                if (input == (_csum_hi >> 8)) {
-                    _rxstate++;
-                } else {
-                    reset_rxstate();
-                }
-                break;
+    _run_left = _bsize;
+    _op_len = 0;
+    _op_need = BATCH_RCHK_SIZE;
+    _rxstate = RXSTATE_BATCH_DATA;
+    if (_run_left == 0) {
+        /* An empty file, straight on to its checksum */
+        RX_BatchData(NULL, 0);
+    }
+}
 
-            case RXSTATE_WAIT_CHK_LO:
-                if (input == (_csum_hi & 0xFF)) {
-                    _active = true; /* Protocol now active */
-                    _csum_hi = 0;
-                    _csum_lo = 0;
+/**
+ * Take the file data of a batch record from a received slice.
+ * Returns the number of bytes used.
+ */
+size_t ESPSync::RX_BatchData(const uint8_t *data, size_t length)
+{
+    if (length > _run_left) {
+        length = _run_left;
+    }
+    _fcsum = adler32_update(_fcsum, data, length);
+    _run_left -= length;
+    _body_left -= length;
 
-                    // Received a valid header, so process it.
-                    switch (_this_fun) {
-                        case ACK:
-                            // Check Ack OPT Filler is valid.
-                            if ((_this_size & 0xFF) == 0x5A) {
-                                // Just reply with an ACK.
-                                TX_ACK((_this_size>>8)+1);
-                            }
-                            reset_rxstate();
-                            break;
+    if ((_bstatus[_bcount] == ACK) && !FILE_Out(data, length)) {
+        /* Keep going, only this record has failed */
+        _bstatus[_bcount] = NAK_FSERR;
+    }
 
-                        case CMD_SET_TIME:
-                        case CMD_LIST:
-                        case CMD_REMOVE:
-                        case CMD_RENAME:
-                            if (CheckMessageSizes(_this_fun, _this_size)) {
-                                _data_size = 0;
-                                _rxstate++;
-                            } else {
-                                // Size is wrong, dont reply to bad headers.
-                                reset_rxstate();
-                            }
-                            break;
+    if (_run_left == 0) {
+        /* The record is summed on its own, fold it into the message */
+        _csum = adler32_combine(_csum, _fcsum, 1 + _fnsiz + BATCH_HEAD_SIZE + _bsize);
+        _rxstate = RXSTATE_BATCH_RCHK;
+    }
+    return length;
+}
 
-                        case CMD_FORMAT:
-                            if (_this_size == 0) {
-                                PROCESS_Format();
-                            }
-                            reset_rxstate();
-                            break;
+/**
+ * The checksum of a batch record is in _op.  Keep its file if it is
+ * good, then go on to the next record.
+ */
+void ESPSync::RX_BatchRecord(void)
+{
+    uint32_t rchk = ((uint32_t)_op[0] << 24) | ((uint32_t)_op[1] << 16) |
+                    ((uint32_t)_op[2] << 8) | _op[3];
+    uint8_t *status = &_bstatus[_bcount++];
+    ESPSyncManifestEntry mentry;
+    int32_t  fsize;
+
+    if ((*status == ACK) && (rchk != _fcsum)) {
+        *status = NAK_CHKSUM;
+    }
 
-                        case CMD_FILE:
-                            if (_this_size >= 10) {
-                                PROCESS_FileRX();
-                            }
-                            reset_rxstate();
-                            break;
+    memcpy(mentry.date, _dbuf+_fnsiz, 6);
+    _dbuf[_fnsiz] = 0x00;
+
+    if (*status == ACK) {
+        *status = FILE_Store((const char*)_dbuf, mentry.date, true, &fsize);
+    } else if (_rxfile != ESPSYNC_NO_FILE) {
+        /* Throw away what was written, the page being filled is reused */
+        _fbuf = NULL;
+        _fbuf_len = 0;
+        _writer.next(ESPSYNC_NO_FILE);
+        _fs->close(_rxfile);
+        _rxfile = ESPSYNC_NO_FILE;
+    }
 
-                        default:
-                            reset_rxstate();
-                    }
+    if (*status == ACK) {
+        if (fsize >= 0) {
+            strcpy(mentry.name, (const char*)_dbuf);
+            mentry.size = fsize;
+            mentry.csum = adler32_suffix(_fcsum, _hcsum, fsize);
+            _manifest.update(&mentry);
+        } else {
+            _manifest.invalidate();
+        }
+    } else if (_fs->exists(_tempname)) {
+        _fs->remove(_tempname);
+    }
 
-                } else {
-                    reset_rxstate();
-                }
-                break;
+    _rxstate = (_body_left == 4) ? RXSTATE_WAIT_CHK2_24 : RXSTATE_BATCH_NSIZ;
+}
 
-            case RXSTATE_WAIT_DATA:
-                // General data reception for messages smaller than _dbuf
-                _dbuf[_data_size] = input;
-                if ((_data_size+2) == (uint8_t)_this_size) {
-                    _rxstate++;
-                    _chk_mode = CSUM_SKIP;
-                } else {
-                    _data_size++;
-                }
-                break;
+/**
+ * Give up on the message being received, and tell the master why.
+ * Whatever is left of its body is thrown away as it arrives, rather
+ * than being passed to the application.
+ */
+void ESPSync::RX_Abort(uint8_t code)
+{
+    /* A chunk is only held in RAM, losing it loses nothing else */
+    if (((_rxfile != ESPSYNC_NO_FILE) && (_this_fun != CMD_CHUNK)) ||
+        (_this_fun == CMD_BATCH)) {
+        /* An upload cut off by the link is kept, to be continued */
+        if ((code != NAK_TIMEOUT) || !FILE_Keep()) {
+            FILE_Cleanup();
+        }
+    }
+    TX_NAK(code);
 
-            case RXSTATE_WAIT_CHK2_HI:
-                if (input == BYTEAT(_csum_hi,8)) {
-                    _rxstate++;
-                } else {
-                    // Data body error, so NAK
-                    TX_NAK(NAK_CHKSUM);
-                    reset_rxstate();
-                }
-                break;
+    if (_body_left > 0) {
+        _rxstate = RXSTATE_DISCARD;
+    } else {
+        reset_rxstate();
+    }
+}
 
-            case RXSTATE_WAIT_CHK2_LO:
-                if (input == BYTEAT(_csum_hi,0)) {
-                    // Process small messages here
-                    switch (_this_fun) {
-                        case CMD_SET_TIME:
-                            PROCESS_SetTime();
-                            break;
+/**
+ * A message body has stopped arriving part way through.
+ */
+void ESPSync::RX_CheckTimeout(void)
+{
+    if ((_rxstate >= RXSTATE_WAIT_DATA) &&
+        ((uint32_t)(espsync_millis() - _rx_time) > RX_TIMEOUT)) {
+        if (_rxstate == RXSTATE_DISCARD) {
+            reset_rxstate();
+        } else {
+            _body_left = 0;
+            RX_Abort(NAK_TIMEOUT);
+        }
+    }
+}
 
-                        case CMD_LIST:
-                            PROCESS_Listing();
-                            break;
+/**
+ * A new line rate was not confirmed in time, go back to the old one.
+ */
+void ESPSync::RX_CheckBaud(void)
+{
+    if (_baud_pending &&
+        ((uint32_t)(espsync_millis() - _baud_time) > ESPSYNC_BAUD_CONFIRM)) {
+        _streamRef->setBaud(_baud_old);
+        _baud_pending = false;
+    }
+}
 
-                        case CMD_REMOVE:
-                            PROCESS_Remove();
-                            break;
-                        
-                        case CMD_RENAME:
-                            PROCESS_Rename();
-                            break;
-                    }
-                    reset_rxstate();
-                } else {
-                    // Data body error, so NAK
-                    TX_NAK(NAK_CHKSUM);                    
-                    reset_rxstate();
-                }
-                break;
+/**
+ * No message for a while, the master has gone.
+ */
+void ESPSync::RX_CheckSession(void)
+{
+    if (_session && (_rxstate == RXSTATE_WAIT_STX) &&
+        ((uint32_t)(espsync_millis() - _msg_time) > ESPSYNC_SESSION_IDLE)) {
+        _session = false;
+        FILE_Park();
+        /**
+         * A new master starts as the constructor left things, stop and
+         * wait with Adler-32, until it agrees otherwise.  Its CMNs are
+         * not repeats of the last master's.
+         */
+        for (uint8_t x = 0; x < ESPSYNC_MAX_WINDOW; x++) {
+            _history[x].cmn  = 0xFF;
+            _history[x].fun  = 0;
+            _history[x].size = 0;
+        }
+        _history_next = 0;
+        _window = 1;
+        _ck = &espsync_csums[CSUM_ADLER32];
+        MSG_Event(ESPSYNC_EVENT_SESSION_END, NULL);
+    }
+}
 
-            default :
-                // State Machine Error, just abort.
-                reset_rxstate();
+void ESPSync::MSG_Event(uint8_t type, const char *name, const char *from)
+{
+    ESPSyncEvent event;
+
+    if (_event != NULL) {
+        event.type = type;
+        event.name = name;
+        event.from = from;
+        _event(&event, _event_arg);
+    }
+}
+
+void ESPSync::onData(ESPSyncDataCallback sink, void *arg)
+{
+    _sink = sink;
+    _sink_arg = arg;
+}
+
+void ESPSync::onEvent(ESPSyncEventCallback handler, void *arg)
+{
+    _event = handler;
+    _event_arg = arg;
+}
 
+void ESPSync::poll(void)
+{
+    uint8_t buf[ESPSYNC_RX_BUFFER_SIZE];
+    size_t  n;
+
+    /* A short read means nothing more has arrived, or a message has */
+    do {
+        n = getData(buf, sizeof(buf));
+        if ((n > 0) && (_sink != NULL)) {
+            _sink(buf, n, _sink_arg);
         }
+    } while (n == sizeof(buf));
+}
+
+void ESPSync::stats(ESPSyncStats *stats)
+{
+    *stats = _stats;
+    stats->period = espsync_millis() - _stats_time;
+}
+
+void ESPSync::resetStats(void)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    _stats_time = espsync_millis();
+}
+
+void ESPSync::invalidateManifest(void)
+{
+    if (_fs != NULL) {
+        FILE_Lock();
+        _manifest.invalidate();
+        FILE_Unlock();
     }
+}
 
-    return true;
+void ESPSync::uploadStats(ESPSyncWriterStats *stats)
+{
+    _writer.stats(stats);
+}
 
+bool ESPSync::getData(uint8_t *data)
+{
+    return getData(data, 1) == 1;
 }
 
-bool ESPSync::getData(uint8_t *data) 
+size_t ESPSync::getData(uint8_t *buf, size_t length)
 {
-    bool ok = false;
-    uint8_t rxd;
+    size_t got = 0;
+    size_t n;
 
-    static dQueue dq(8);
+    if (_streamRef == NULL) {
+        return 0;
+    }
 
-    // Check if we filtered any bytes, but didn't get a header.
-    if ((dq.any()) && !protocol_active(false)) {
-        *data = dq.get();
-        ok = true;
-    } else {
-        if (_streamRef->available() > 0) {
-            rxd = _streamRef->read();
-            ProcessByte(rxd);
-            // If a conservative active protocol check is true,
-            // filter all bytes.
-            if (protocol_active()) {
-                // Flush pending byte buffer
-                dq.flush();
-            } else {
-                // If a lax active protocol check is true,
-                // Or we have already buffered some data
-                // buffer bytes in temp buffer.
-                if (protocol_active(false) || dq.any()) {
-                    dq.put(rxd);
-                } else {
-                    // Otherwise, just return the byte
-                    *data = rxd;
-                    ok = true;
+    RX_CheckBaud();
+
+    while (got < length) {
+        // Bytes that were held as a possible header, but weren't one.
+        if (_pending.any()) {
+            n = _pending.get(buf + got, length - got);
+            got += n;
+            _stats.rxApp += n;
+            continue;
+        }
+
+        // Applying a delta, or a Copy, copy a page of the file at a time.
+        if (_rxstate == RXSTATE_COPY_PAGE) {
+            if (got == 0) {
+                FILE_Lock();
+                RX_CopyPage();
+                FILE_Unlock();
+            }
+            break;
+        }
+
+        // Take everything available in one read.
+        if (_rxhead == _rxlen) {
+            uint32_t now = espsync_micros();
+            espsync_histogram(_stats.loop, now - _loop_time);
+            _loop_time = now;
+
+            int avail = _streamRef->available();
+            if (avail <= 0) {
+                if ((_rxstate != RXSTATE_WAIT_STX) || _session) {
+                    FILE_Lock();
+                    RX_CheckTimeout();
+                    RX_CheckSession();
+                    FILE_Unlock();
+                }
+                break;
+            }
+            if (avail > (int)sizeof(_rxbuf)) {
+                avail = sizeof(_rxbuf);
+            }
+            _rxhead = 0;
+            _rxlen = _streamRef->readBytes(_rxbuf, avail);
+            if (_rxlen == 0) {
+                break;
+            }
+            _stats.rxBytes += _rxlen;
+        }
+
+        // Outside of a message, anything up to an STX is application data.
+        // Unless the rate is being changed, then it is line noise.
+        if ((_rxstate == RXSTATE_WAIT_STX) && (_rxbuf[_rxhead] != STX)) {
+            const uint8_t *stx = (const uint8_t*)memchr(_rxbuf + _rxhead, STX, _rxlen - _rxhead);
+            n = ((stx != NULL) ? (size_t)(stx - _rxbuf) : _rxlen) - _rxhead;
+            if (!_baud_pending) {
+                if (n > length - got) {
+                    n = length - got;
                 }
+                memcpy(buf + got, _rxbuf + _rxhead, n);
+                got += n;
+                _stats.rxApp += n;
             }
+            _rxhead += n;
+            continue;
+        }
+
+        _rxhead += ProcessBytes(_rxbuf + _rxhead, _rxlen - _rxhead);
+
+        // Part way through a message, let the main loop run.
+        if ((_rxhead == _rxlen) && (_rxstate != RXSTATE_WAIT_STX)) {
+            break;
         }
     }
-    return ok;
-}
\ No newline at end of file
+    return got;
+}
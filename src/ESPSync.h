@@ -18,17 +18,147 @@
 #ifndef __ESPSYNC_H_
 #define __ESPSYNC_H_
 
-#include "Arduino.h"
+#include "ESPSyncPlatform.h"
+#include "ESPSyncStream.h"
+#include "ESPSyncFS.h"
+#include "ESPSyncWriter.h"
+#include "ESPSyncLZ.h"
+#include "ESPSyncManifest.h"
+#include "ESPSyncStats.h"
+#include "ESPSyncChecksum.h"
+
+/* Application bytes held back while deciding if they were a header, a power of 2 */
+#ifndef ESPSYNC_PASSTHROUGH_SIZE
+#define ESPSYNC_PASSTHROUGH_SIZE (64)
+#endif
+
+/**
+ * A ring with one writer, the protocol handler, and one reader, the
+ * application.  The indexes run freely, and only the writer moves the
+ * tail and the reader the head.  Nothing is overwritten, put() returns
+ * false for a byte that does not fit.
+ */
+class dQueue
+{
+    public:
+        dQueue(void);
+        bool put(uint8_t data);
+        bool any(void);
+        uint8_t get(void);
+        size_t get(uint8_t *buf, size_t length);
+        void flush(void);
+
+    private:
+        uint8_t  _buf[ESPSYNC_PASSTHROUGH_SIZE];
+        uint16_t _head;
+        uint16_t _tail;
+};
+
+/* Has to be big enough to hold largest small messages data */
+#define ESPSYNC_TEMP_BUFFER_SIZE (70)
+
+/* Longest temp or resume file name, with an instance number, "///RESUME.255" */
+#define ESPSYNC_INSTANCE_NAME (16)
+
+/* Bytes getData() reads from the stream at once */
+#define ESPSYNC_RX_BUFFER_SIZE (128)
+
+/* Bytes of a reply framed before it is written to the stream */
+#define ESPSYNC_TX_BUFFER_SIZE (128)
+
+/* Version of the protocol, reported in the session reply */
+#define ESPSYNC_PROTOCOL_VERSION (1)
+
+/* Most requests a master may have outstanding, at most half the CMN space */
+#define ESPSYNC_MAX_WINDOW (8)
+
+/* Most files a Batch message may hold, its reply has a status for each */
+#ifndef ESPSYNC_BATCH_FILES
+#define ESPSYNC_BATCH_FILES (32)
+#endif
+
+/* Largest chunk of a chunked upload, held in RAM until its checksum is checked */
+#ifndef ESPSYNC_CHUNK_SIZE
+#define ESPSYNC_CHUNK_SIZE (1024)
+#endif
+
+/* Fastest line rate the Baud command may ask for */
+#ifndef ESPSYNC_MAX_BAUD
+#define ESPSYNC_MAX_BAUD (3000000)
+#endif
+
+/* ms to confirm a new line rate, before going back to the old one */
+#ifndef ESPSYNC_BAUD_CONFIRM
+#define ESPSYNC_BAUD_CONFIRM (1000)
+#endif
+
+/* CHK2 checksums a session may agree to use, a bit for each CSUM_ number */
+#ifndef ESPSYNC_CSUMS
+#define ESPSYNC_CSUMS ((1 << CSUM_ADLER32) | (1 << CSUM_CRC32) | (1 << CSUM_CRC32C))
+#endif
+
+/* ms without a message before a session is over, see ESPSYNC_EVENT_SESSION_END */
+#ifndef ESPSYNC_SESSION_IDLE
+#define ESPSYNC_SESSION_IDLE (5000)
+#endif
+
+typedef struct {
+    uint8_t  cmn;
+    uint8_t  fun;
+    uint32_t size;
+} ESPSyncMsgId;
+
+/**
+ * Things the master did, for the application to react to.  Only changes
+ * actually made are reported, not retransmitted requests.
+ */
+#define ESPSYNC_EVENT_SESSION_START (1)  /* First message after being idle */
+#define ESPSYNC_EVENT_SESSION_END   (2)  /* ESPSYNC_SESSION_IDLE ms since the last */
+#define ESPSYNC_EVENT_FILE_RECEIVED (3)  /* name was created or replaced */
+#define ESPSYNC_EVENT_FILE_REMOVED  (4)  /* name was removed */
+#define ESPSYNC_EVENT_FILE_RENAMED  (5)  /* from was renamed to name */
+#define ESPSYNC_EVENT_FORMATTED     (6)  /* Every file is gone */
+
+typedef struct {
+    uint8_t     type;
+    const char *name;   /* NULL if the event is not about a file */
+    const char *from;   /* Only for ESPSYNC_EVENT_FILE_RENAMED */
+} ESPSyncEvent;
+
+typedef void (*ESPSyncDataCallback)(const uint8_t *data, size_t length, void *arg);
+typedef void (*ESPSyncEventCallback)(const ESPSyncEvent *event, void *arg);
 
 class ESPSync
 {
     public:
-        ESPSync(void);
+        ESPSync(uint8_t instance = 0);
+        /*
+         * Each ESPSync sharing a filesystem, Eg, one on each UART,
+         * needs its own instance number, for its temp and resume
+         * files.  Keep it the same across restarts, so an upload
+         * interrupted on a port can be continued on that port.
+         * See ESPSYNC_INSTANCES.
+         */
 
+#if defined(ARDUINO)
         void setSerial(HardwareSerial *streamObject);
         /*
          * Set the Hardware Serial port we are to use.
          */
+#endif
+
+        void setStream(ESPSyncStream *streamObject);
+        /*
+         * Set the stream we are to use, when it is not a
+         * HardwareSerial port.  Eg, a pty on the host build.
+         */
+
+        void setFS(ESPSyncFS *fs);
+        /*
+         * Set the filesystem to sync with.
+         * Defaults to SPIFFS on the ESP8266/ESP32, or LittleFS if
+         * ESPSYNC_LITTLEFS is defined.  See ESPSyncLittleFS.
+         */
 
         bool protocol_active(bool conservative = true);
         /*
@@ -45,49 +175,242 @@ class ESPSync
          * LOW LEVEL, use getData() in preference.
          */
 
+        size_t ProcessBytes(const uint8_t *data, size_t length);
+        /*
+         * Process a buffer through the protocol handler.
+         * Returns the number of bytes consumed, which is less than
+         * length when the handler goes idle part way through, so the
+         * rest may be application data.  Call again with the rest.
+         * It also stops early after each page copied from the base file
+         * of a delta, so call again even with nothing new to give it.
+         * LOW LEVEL, use getData() in preference.
+         */
+
+        void invalidateManifest(void);
+        /*
+         * Call after changing files other than through ESPSync, so the
+         * next listing with checksums rebuilds the manifest.
+         */
+
+        void uploadStats(ESPSyncWriterStats *stats);
+        /*
+         * How the flash writes of the last file received went.
+         * See ESPSYNC_WRITE_OVERLAP().
+         */
+
+        void stats(ESPSyncStats *stats);
+        void resetStats(void);
+        /*
+         * What the protocol has been doing, since the last reset.
+         * Also available to the master, with the Stats command.
+         */
+
+        void onData(ESPSyncDataCallback sink, void *arg = NULL);
+        void onEvent(ESPSyncEventCallback handler, void *arg = NULL);
+        /*
+         * Register a sink for application data, and a handler for
+         * events.  Both are called from poll() or getData().  The name
+         * of an event is only valid during the call.
+         */
+
+        void poll(void);
+        /*
+         * Service the protocol, and hand whatever application data has
+         * arrived to the sink, in spans, rather than calling getData().
+         * Without a sink, application data is thrown away.  Never blocks,
+         * call it every time around the loop.
+         */
+
         bool getData(uint8_t *byte);
         /*
          * Get the next byte from the serial stream, but
          * process it first.  Filter any data which is identified
          * as protocol data.
+         * Never blocks.  While a message (Eg, a file upload) is being
+         * received, each call processes at most one read of the stream
+         * and returns false, so call it every time around the loop.
+         */
+
+        size_t getData(uint8_t *buf, size_t length);
+        /*
+         * As getData(byte), but returns as much application data as is
+         * available, up to length bytes, in runs rather than a byte
+         * at a time.  Returns the number of bytes, 0 if none.
          */
 
     private:
-        HardwareSerial *_streamRef;
+        ESPSyncStream *_streamRef;
+        ESPSyncFS     *_fs;
+        char           _tempname[ESPSYNC_INSTANCE_NAME];
+        char           _resumename[ESPSYNC_INSTANCE_NAME];
+        ESPSyncManifest _manifest;
+#if defined(ARDUINO)
+        ESPSyncSerialStream _serial;
+#endif
         uint8_t   _rxstate;
-        uint16_t  _csum_hi;
-        uint16_t  _csum_lo;
+        uint8_t   _hdr[8];
+        uint32_t  _csum;
 
-        uint8_t   _prev_cmn;
-        uint8_t   _prev_fun;
-        uint32_t  _prev_size;
+        /* Most recently completed messages, to spot retransmissions */
+        ESPSyncMsgId _history[ESPSYNC_MAX_WINDOW];
+        uint8_t      _history_next;
+        uint8_t      _window;
+        const ESPSyncCsum *_ck;    /* CHK2 the session agreed on */
+        const ESPSyncCsum *_rxck;  /* CHK2 of the message being received */
+        const ESPSyncCsum *_txck;  /* CHK2 of the reply being sent */
 
         uint8_t   _this_cmn;
         uint8_t   _this_fun;
         uint32_t  _this_size;
         uint8_t   _data_size;
 
-        uint8_t  _chk_mode;
-
-        uint8_t  *_dbuf;
+        uint8_t  _dbuf[ESPSYNC_TEMP_BUFFER_SIZE];
         bool     _active;
 
+        uint8_t  _rxbuf[ESPSYNC_RX_BUFFER_SIZE];
+        uint16_t _rxhead;
+        uint16_t _rxlen;
+        dQueue   _pending;
+        uint8_t  _txbuf[ESPSYNC_TX_BUFFER_SIZE];
+        uint16_t _txlen;
+        uint32_t _txcsum;    /* CHK2 of the reply being sent */
+        uint32_t _rx_time;   /* When the last message byte arrived */
+        uint32_t _rx_start;  /* When the current message's header arrived, in us */
+        uint32_t _body_left; /* Message body bytes still to come, incl CHK2 */
+
+        /* File being received */
+        int       _rxfile;
+        ESPSyncWriter _writer;
+        uint8_t  *_fbuf;      /* Writer buffer being filled */
+        uint32_t  _fbuf_len;
+        uint32_t  _fpage;
+        uint8_t   _fnsiz;
+        uint8_t   _fmaxpath;
+
+        /* Delta being applied to a base file, or the source of a Copy */
+        int       _basefile;
+        uint16_t  _block;
+        uint32_t  _fcsum;     /* Of the file being rebuilt, or stored compressed */
+        uint32_t  _hcsum;     /* Of the message body, up to the file data */
+        uint32_t  _fcsum_want;
+        uint32_t  _run_left;  /* Bytes left of the current COPY or LITERAL, or a Copy */
+        uint8_t   _op[8];     /* Fixed size field being gathered */
+        uint8_t   _op_len;
+        uint8_t   _op_need;
+
+        /* Compressed file being received */
+        ESPSyncLZ _lz;
+        uint8_t   _lzflags;
+        uint32_t  _lzleft;    /* Decompressed bytes still to come */
+
+        /* Upload kept after the link failed, to be continued */
+        uint8_t   _resume;    /* RESUME_UNKNOWN until looked for */
+        uint32_t  _roffset;   /* Bytes of it kept, before this message */
+        uint32_t  _rtotal;    /* Size of the whole file */
+        uint32_t  _rcsum;     /* Adler-32 of the bytes kept */
+
+        /* File being received in chunks */
+        uint8_t   _chunk[4 + ESPSYNC_CHUNK_SIZE]; /* OFFSET and data of the chunk being received */
+        bool      _chunked;
+        uint16_t  _csize;     /* Largest chunk, agreed with the master */
+        uint32_t  _cfchk;     /* Adler-32 of the whole file */
+
+        /* Batch of files being received */
+        uint8_t   _bstatus[ESPSYNC_BATCH_FILES]; /* ACK or NAK code, of each */
+        uint8_t   _bcount;
+        uint32_t  _bsize;     /* Of the file in the current record */
+
+        ESPSyncStats _stats;
+        uint32_t  _stats_time;  /* When they were reset */
+        uint32_t  _loop_time;   /* Last time getData() looked at the stream, in us */
+
+        ESPSyncDataCallback  _sink;
+        void                *_sink_arg;
+        ESPSyncEventCallback _event;
+        void                *_event_arg;
+        bool      _session;     /* Messages have been arriving */
+        uint32_t  _msg_time;    /* When the last one did, in ms */
+
+        /* Line rate change, waiting to be confirmed */
+        bool      _baud_pending;
+        uint32_t  _baud_old;
+        uint32_t  _baud_time;
+
+        size_t RX_Process(const uint8_t *data, size_t length, bool release);
+        bool   RX_HeaderValid(void);
+        void   RX_Release(uint8_t byte);
+        void   RX_Reject(void);
+        void   RX_Dispatch(void);
+        void   RX_Abort(uint8_t code);
+        void   RX_CheckTimeout(void);
+        void   RX_CheckBaud(void);
+        void   RX_CheckSession(void);
+        void   RX_BadSize(void);
+        size_t RX_FileData(const uint8_t *data, size_t length);
+        size_t RX_Field(const uint8_t *data, size_t length);
+        void   RX_DeltaHead(void);
+        void   RX_DeltaBase(void);
+        void   RX_DeltaOp(void);
+        void   RX_CopyPage(void);
+        void   RX_LZHead(void);
+        void   RX_ResumeHead(void);
+        size_t RX_LZData(const uint8_t *data, size_t length);
+        void   RX_BatchName(void);
+        size_t RX_BatchData(const uint8_t *data, size_t length);
+        void   RX_BatchRecord(void);
+
+        void TX_Flush(void);
+        void TX_Append(const uint8_t *data, size_t size);
         void TX_Header(uint8_t func, uint32_t size_opt);
+        void TX_Empty(uint8_t func);
         void TX_NAK(uint8_t code);
         void TX_ACK(uint32_t timeout);
 
-        void TX_DataChunk(uint32_t *chk, uint8_t size);
+        void TX_Data(const uint8_t *data, size_t size);
+        void TX_End(void);
 
         void TX_DataBuf(uint8_t func, uint8_t size);
+        bool TX_FileData(int fh, uint32_t length);
+        void TX_Served(void);
 
         void PROCESS_SetTime(void);
         void PROCESS_Format(void);
         void PROCESS_Listing(void);
+        void PROCESS_Hash(void);
         void PROCESS_Remove(void);
         void PROCESS_Rename(void);
+        void PROCESS_Session(void);
+        void PROCESS_Baud(void);
+        void PROCESS_Stats(void);
+        void PROCESS_FileStart(void);
         void PROCESS_FileRX(void);
+        void PROCESS_Resume(void);
+        void PROCESS_ChunkStart(void);
+        void PROCESS_ChunkRX(void);
+        void PROCESS_Get(void);
+        void PROCESS_Signature(void);
+        void PROCESS_DeltaRX(void);
+        void PROCESS_LZRX(void);
+        void PROCESS_CopyStart(void);
+        void PROCESS_CopyRX(void);
+        void PROCESS_BatchStart(void);
+        void PROCESS_BatchRX(void);
+        bool FILE_Out(const uint8_t *data, size_t length);
+        void FILE_Flush(void);
+        void FILE_Cleanup(void);
+        bool FILE_Keep(void);
+        bool FILE_Tag(uint32_t csum);
+        bool FILE_Kept(const uint8_t *name, uint8_t nsiz);
+        void FILE_Forget(void);
+        void FILE_Park(void);
+        bool FILE_Unpark(void);
+        uint8_t FILE_Store(const char *name, const uint8_t *date, bool more, int32_t *fsize);
+        bool FILE_Manifest(ESPSyncFSInfo *fs_info, bool rebuild);
+        void FILE_Lock(void);
+        void FILE_Unlock(void);
 
         void MSG_Complete(void);
+        void MSG_Event(uint8_t type, const char *name, const char *from = NULL);
         bool MSG_Retransmit(void);
 
 };
@@ -0,0 +1,266 @@
+/**
+ *  ESP Sync checksums
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncChecksum.h"
+
+#if !defined(ARDUINO) && defined(__SSE2__) && !defined(ESPSYNC_NO_SIMD)
+#define ADLER32_SSE2
+#include <emmintrin.h>
+#endif
+
+#define MOD_ADLER32 (65521U)
+
+/**
+ * Largest n such that 255n(n+1)/2 + (n+1)(MOD_ADLER32-1) fits in 32 bits.
+ * That many bytes can be summed before the modulo has to be taken.
+ */
+#define NMAX_ADLER32 (5552)
+
+void fletcher16(uint16_t* csum, uint8_t byte) {
+    uint8_t sum1 = (*csum) + byte;
+    uint8_t sum2 = ((*csum) >> 8) + sum1;
+    *csum = (sum2 << 8) | sum1;
+}
+
+#if !defined(ARDUINO) || defined(ESPSYNC_CRC_SLICE8)
+#define CRC_SLICE8
+#endif
+
+#define CRC32_POLY  (0xEDB88320)  /* IEEE 802.3, reflected */
+#define CRC32C_POLY (0x82F63B78)  /* Castagnoli, reflected */
+
+#if defined(CRC_SLICE8)
+/**
+ * CRC eight bytes at a time.  Table k gives the CRC of a byte followed
+ * by k zero bytes, so the eight lookups of a block are independent, and
+ * only the last depends on the CRC so far.  8 KB of tables a polynomial,
+ * made the first time each is used.
+ */
+class CRCSlice8
+{
+    public:
+        CRCSlice8(uint32_t poly)
+        {
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (uint8_t k = 0; k < 8; k++) {
+                    c = (c & 1) ? (c >> 1) ^ poly : (c >> 1);
+                }
+                _t[0][n] = c;
+            }
+            for (uint32_t n = 0; n < 256; n++) {
+                for (uint8_t k = 1; k < 8; k++) {
+                    _t[k][n] = (_t[k-1][n] >> 8) ^ _t[0][_t[k-1][n] & 0xFF];
+                }
+            }
+        }
+
+        uint32_t update(uint32_t crc, const uint8_t *buffer, size_t length) const
+        {
+            uint32_t one, two;
+
+            crc = ~crc;
+            while (length >= 8) {
+                one = crc ^ ((uint32_t)buffer[0] | ((uint32_t)buffer[1] << 8) |
+                             ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24));
+                two = (uint32_t)buffer[4] | ((uint32_t)buffer[5] << 8) |
+                      ((uint32_t)buffer[6] << 16) | ((uint32_t)buffer[7] << 24);
+                crc = _t[7][one & 0xFF] ^ _t[6][(one >> 8) & 0xFF] ^
+                      _t[5][(one >> 16) & 0xFF] ^ _t[4][one >> 24] ^
+                      _t[3][two & 0xFF] ^ _t[2][(two >> 8) & 0xFF] ^
+                      _t[1][(two >> 16) & 0xFF] ^ _t[0][two >> 24];
+                buffer += 8;
+                length -= 8;
+            }
+            while (length--) {
+                crc = (crc >> 8) ^ _t[0][(crc ^ *buffer++) & 0xFF];
+            }
+            return ~crc;
+        }
+
+    private:
+        uint32_t _t[8][256];
+};
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buffer, size_t length)
+{
+    static const CRCSlice8 tables(CRC32_POLY);
+    return tables.update(crc, buffer, length);
+}
+
+uint32_t crc32c_update(uint32_t crc, const uint8_t *buffer, size_t length)
+{
+    static const CRCSlice8 tables(CRC32C_POLY);
+    return tables.update(crc, buffer, length);
+}
+#else
+/**
+ * CRC a nibble at a time, each table is only 64 bytes of RAM.
+ */
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static const uint32_t crc32c_nibble[16] = {
+    0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1,
+    0x417B1DBC, 0x5125DAD3, 0x61C69362, 0x7198540D,
+    0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9,
+    0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75
+};
+
+static uint32_t crc_nibble(const uint32_t *table, uint32_t crc,
+                           const uint8_t *buffer, size_t length)
+{
+    crc = ~crc;
+    while (length--) {
+        crc ^= *buffer++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buffer, size_t length)
+{
+    return crc_nibble(crc32_nibble, crc, buffer, length);
+}
+
+uint32_t crc32c_update(uint32_t crc, const uint8_t *buffer, size_t length)
+{
+    return crc_nibble(crc32c_nibble, crc, buffer, length);
+}
+#endif
+
+const ESPSyncCsum espsync_csums[CSUM_ALGORITHMS] = {
+    { ADLER32_INIT, adler32_update },
+    { CRC32_INIT,   crc32_update },
+    { CRC32_INIT,   crc32c_update }
+};
+
+#define DO1(buf,i)  {lo += (buf)[i]; hi += lo;}
+#define DO2(buf,i)  DO1(buf,i); DO1(buf,i+1);
+#define DO4(buf,i)  DO2(buf,i); DO2(buf,i+2);
+#define DO8(buf,i)  DO4(buf,i); DO4(buf,i+4);
+#define DO16(buf)   DO8(buf,0); DO8(buf,8);
+
+#if defined(ADLER32_SSE2)
+/**
+ * Sum a multiple of 16 bytes, no more than NMAX_ADLER32, into lo and hi.
+ *
+ * For each 16 byte block, lo gains the sum of the bytes, and hi gains 16
+ * times the lo from before the block plus the bytes weighted 16 down to 1.
+ */
+static void adler32_sse2(uint32_t *plo, uint32_t *phi, const uint8_t *buffer, size_t length)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i w_lo  = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i w_hi  = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i v_lo   = zero; /* Running sum of bytes */
+    __m128i v_prev = zero; /* Sum of v_lo before each block */
+    __m128i v_hi   = zero; /* Weighted sums of each block */
+    uint32_t blocks = length / 16;
+
+    while (blocks--) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)buffer);
+        buffer += 16;
+
+        v_prev = _mm_add_epi32(v_prev, v_lo);
+        v_lo   = _mm_add_epi32(v_lo, _mm_sad_epu8(bytes, zero));
+        v_hi   = _mm_add_epi32(v_hi, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), w_lo));
+        v_hi   = _mm_add_epi32(v_hi, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), w_hi));
+    }
+
+    v_hi = _mm_add_epi32(v_hi, _mm_slli_epi32(v_prev, 4));
+
+    /* Horizontal sums, the bound on length keeps every lane in 32 bits */
+    v_lo = _mm_add_epi32(v_lo, _mm_shuffle_epi32(v_lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_hi = _mm_add_epi32(v_hi, _mm_shuffle_epi32(v_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    v_hi = _mm_add_epi32(v_hi, _mm_shuffle_epi32(v_hi, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    *phi += (*plo * (uint32_t)length) + (uint32_t)_mm_cvtsi128_si32(v_hi);
+    *plo += (uint32_t)_mm_cvtsi128_si32(v_lo);
+}
+#endif
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *buffer, size_t length)
+{
+    uint32_t lo = adler & 0xFFFF;
+    uint32_t hi = adler >> 16;
+    size_t   n;
+
+    while (length > 0) {
+        n = (length < NMAX_ADLER32) ? length : NMAX_ADLER32;
+        length -= n;
+
+#if defined(ADLER32_SSE2)
+        size_t vec = n & ~(size_t)15;
+        if (vec > 0) {
+            adler32_sse2(&lo, &hi, buffer, vec);
+            buffer += vec;
+            n -= vec;
+        }
+#else
+        while (n >= 16) {
+            DO16(buffer);
+            buffer += 16;
+            n -= 16;
+        }
+#endif
+        while (n > 0) {
+            DO1(buffer,0);
+            buffer++;
+            n--;
+        }
+
+        lo %= MOD_ADLER32;
+        hi %= MOD_ADLER32;
+    }
+
+    return (hi << 16) | lo;
+}
+
+/**
+ * The Adler-32 of B, from those of A and AB:
+ *   lo(AB) = lo(A) + lo(B) - 1
+ *   hi(AB) = hi(A) + hi(B) + len(B) * (lo(A) - 1)
+ */
+uint32_t adler32_suffix(uint32_t whole, uint32_t prefix, uint32_t length)
+{
+    uint32_t lo_a = prefix & 0xFFFF;
+    uint32_t lo   = ((whole & 0xFFFF) + MOD_ADLER32 + 1 - lo_a) % MOD_ADLER32;
+    uint32_t hi   = (whole >> 16) + (2 * MOD_ADLER32) - (prefix >> 16);
+
+    hi -= (uint32_t)(((uint64_t)(length % MOD_ADLER32) * (lo_a + MOD_ADLER32 - 1)) % MOD_ADLER32);
+    return ((hi % MOD_ADLER32) << 16) | lo;
+}
+
+/**
+ * The same relation, the other way round, the Adler-32 of AB.
+ */
+uint32_t adler32_combine(uint32_t first, uint32_t second, uint32_t length)
+{
+    uint32_t rem = length % MOD_ADLER32;
+    uint32_t lo  = first & 0xFFFF;
+    uint32_t hi  = (uint32_t)(((uint64_t)rem * lo) % MOD_ADLER32);
+
+    lo += (second & 0xFFFF) + MOD_ADLER32 - 1;
+    hi += (first >> 16) + (second >> 16) + MOD_ADLER32 - rem;
+    return ((hi % MOD_ADLER32) << 16) | (lo % MOD_ADLER32);
+}
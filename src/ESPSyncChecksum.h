@@ -0,0 +1,88 @@
+/**
+ *  ESP Sync checksums
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCCHECKSUM_H_
+#define __ESPSYNCCHECKSUM_H_
+
+#include "ESPSyncPlatform.h"
+
+/* Starting value of every Adler-32 checksum */
+#define ADLER32_INIT (1)
+
+void fletcher16(uint16_t *csum, uint8_t byte);
+/*
+ * Add a byte to a header checksum.
+ */
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *buffer, size_t length);
+/*
+ * Add a block of bytes to an Adler-32 checksum, returns the new checksum.
+ * The modulo is only taken once per 5552 bytes, and on the host
+ * build, x86 uses SSE2 for blocks of 16 bytes.
+ */
+
+uint32_t adler32_suffix(uint32_t whole, uint32_t prefix, uint32_t length);
+/*
+ * The Adler-32 of the last length bytes of a buffer, given the checksum
+ * of the whole buffer and of the bytes before them.  Eg, of the file
+ * data in a message body, without summing it again.
+ */
+
+uint32_t adler32_combine(uint32_t first, uint32_t second, uint32_t length);
+/*
+ * The Adler-32 of two buffers one after the other, given the checksum
+ * of each, and the length of the second.  As zlib's adler32_combine().
+ */
+
+#define CRC32_INIT (0)
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buffer, size_t length);
+/*
+ * Add a block of bytes to a CRC-32 (IEEE 802.3, as zlib), returns the
+ * new CRC.  Used where Adler-32 alone is too weak, Eg, matching delta
+ * blocks.  On the host build eight bytes at a time, slicing-by-8, on
+ * the ESP8266/ESP32 a nibble at a time, to keep the tables out of RAM,
+ * unless ESPSYNC_CRC_SLICE8 is defined, for 8 KB of tables.
+ */
+
+uint32_t crc32c_update(uint32_t crc, const uint8_t *buffer, size_t length);
+/*
+ * The same, for CRC-32C (Castagnoli, as iSCSI and ext4), which has a
+ * greater Hamming distance than CRC-32 at the lengths of messages.
+ * Starts from CRC32_INIT too.
+ */
+
+/**
+ * The checksums a session can agree to use for CHK2, see the Session
+ * command.  Each is a starting value, and a function adding a block of
+ * bytes, so a message is summed without looking at which it is.
+ */
+#define CSUM_ADLER32    (0)
+#define CSUM_CRC32      (1)
+#define CSUM_CRC32C     (2)
+#define CSUM_ALGORITHMS (3)
+
+typedef uint32_t (*espsync_csum_fn)(uint32_t csum, const uint8_t *buffer, size_t length);
+
+typedef struct {
+    uint32_t        init;
+    espsync_csum_fn update;
+} ESPSyncCsum;
+
+extern const ESPSyncCsum espsync_csums[CSUM_ALGORITHMS];
+
+#endif
@@ -0,0 +1,224 @@
+/**
+ *  ESP Sync filesystem interface
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCFS_H_
+#define __ESPSYNCFS_H_
+
+#include "ESPSyncPlatform.h"
+
+/**
+ * Several ESPSync, each on its own stream, can share a filesystem, each
+ * holding its lock while it uses it.  On the ESP32 they may be serviced
+ * from different tasks, and on the host build from different threads.
+ * The ESP8266 runs everything from loop(), so there is nothing to lock.
+ */
+#if defined(ARDUINO_ARCH_ESP32)
+#define ESPSYNC_FS_LOCK
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#elif !defined(ARDUINO)
+#define ESPSYNC_FS_LOCK
+#include <mutex>
+#endif
+
+/* Longest file name a directory entry can hold, including the NULL */
+#define ESPSYNC_MAX_PATH  (64)
+
+/* ESPSync that may share one filesystem at once */
+#ifndef ESPSYNC_INSTANCES
+#define ESPSYNC_INSTANCES (1)
+#endif
+
+/* Maximum number of files a backend must be able to hold open at once */
+#define ESPSYNC_MAX_OPEN  (2 * ESPSYNC_INSTANCES)
+
+/* Returned by open() on failure */
+#define ESPSYNC_NO_FILE   (-1)
+
+typedef struct {
+    uint32_t totalBytes;
+    uint32_t usedBytes;
+    uint32_t pageSize;
+    uint8_t  maxPathLength;
+} ESPSyncFSInfo;
+
+typedef struct {
+    char     name[ESPSYNC_MAX_PATH];
+    uint32_t size;
+} ESPSyncDirEntry;
+
+/**
+ * What a backend can do beyond a flat SPIFFS, from caps().  The master
+ * is told them in the Session reply.
+ */
+#define ESPSYNC_FS_DIRS  (0x01)  /* Real directories, listed recursively */
+#define ESPSYNC_FS_MTIME (0x02)  /* Keeps the time each file was modified */
+
+/* Deepest directory a backend lists */
+#define ESPSYNC_MAX_DEPTH (8)
+
+static inline bool espsync_date_time(const uint8_t *date, time_t *t)
+{
+    struct tm tm;
+
+    if ((date[0] < 1) || (date[0] > 31) || (date[1] < 1) || (date[1] > 12) ||
+        (date[3] > 23) || (date[4] > 59) || (date[5] > 59)) {
+        return false;
+    }
+    tm.tm_mday = date[0];
+    tm.tm_mon  = date[1] - 1;
+    tm.tm_year = (2019 - 1900) + date[2];
+    tm.tm_hour = date[3];
+    tm.tm_min  = date[4];
+    tm.tm_sec  = date[5];
+    tm.tm_isdst = -1;
+    *t = mktime(&tm);
+    return true;
+}
+
+static inline bool espsync_time_date(time_t t, uint8_t *date)
+{
+    struct tm tm;
+
+    if ((localtime_r(&t, &tm) == NULL) ||
+        (tm.tm_year < (2019 - 1900)) || (tm.tm_year > (2019 - 1900) + 255)) {
+        return false;
+    }
+    date[0] = tm.tm_mday;
+    date[1] = tm.tm_mon + 1;
+    date[2] = tm.tm_year - (2019 - 1900);
+    date[3] = tm.tm_hour;
+    date[4] = tm.tm_min;
+    date[5] = tm.tm_sec;
+    return true;
+}
+/*
+ * Between a local time and a date in the 6 bytes of the Set Time
+ * message, day, month, years since 2019, hour, minute and second.
+ * False if it is not a valid date, or is outside what the 6 bytes hold.
+ */
+
+/**
+ * The filesystem operations the protocol engine needs.
+ * Files are referred to by small integer handles so that a backend
+ * can keep its open files in a fixed table.
+ */
+class ESPSyncFS
+{
+    public:
+#if defined(ARDUINO_ARCH_ESP32)
+        ESPSyncFS(void) { _lock = xSemaphoreCreateRecursiveMutexStatic(&_lock_buf); }
+#endif
+        virtual ~ESPSyncFS(void) {}
+
+#if defined(ARDUINO_ARCH_ESP32)
+        void lock(void)   { xSemaphoreTakeRecursive(_lock, portMAX_DELAY); }
+        void unlock(void) { xSemaphoreGiveRecursive(_lock); }
+#elif defined(ESPSYNC_FS_LOCK)
+        void lock(void)   { _lock.lock(); }
+        void unlock(void) { _lock.unlock(); }
+#else
+        void lock(void)   {}
+        void unlock(void) {}
+#endif
+        /*
+         * Held by an ESPSync while it carries out messages, so only one
+         * uses the filesystem at a time.  It may be taken again by the
+         * holder, Eg, from an event handler.  A writer task writing a
+         * file that is already open does not take it, so a backend must
+         * allow writes to one open file alongside other calls.
+         */
+
+        virtual bool begin(void) = 0;
+        /*
+         * Mount the filesystem.  Returns true if it is usable.
+         * May be called repeatedly.
+         */
+
+        virtual bool info(ESPSyncFSInfo *info) = 0;
+        /*
+         * Get the size and geometry of the filesystem.
+         */
+
+        virtual uint8_t caps(void) { return 0; }
+        /*
+         * ESPSYNC_FS_ flags of what the filesystem can do.  None, by
+         * default, for a flat filesystem without times, like SPIFFS.
+         */
+
+        virtual bool getTime(const char *path, uint8_t *date) { (void)path; (void)date; return false; }
+        virtual bool setTime(const char *path, const uint8_t *date) { (void)path; (void)date; return false; }
+        /*
+         * Get or set when a file was last modified, as a 6 byte date.
+         * Only with ESPSYNC_FS_MTIME.  A backend that stamps files
+         * itself, from the clock, may not be able to set it.
+         */
+
+        virtual bool format(void) = 0;
+        virtual bool exists(const char *path) = 0;
+        virtual bool remove(const char *path) = 0;
+        virtual bool rename(const char *from, const char *to) = 0;
+
+        virtual int open(const char *path, const char *mode) = 0;
+        /*
+         * Open a file, mode is "r", "w" or "a" as for the Arduino FS.
+         * "a" creates the file if need be, and writes go on the end.
+         * Returns a handle, or ESPSYNC_NO_FILE.
+         */
+
+        virtual int32_t read(int fh, uint8_t *buffer, uint32_t length) = 0;
+        virtual int32_t write(int fh, const uint8_t *buffer, uint32_t length) = 0;
+        /*
+         * Read or write the open file.  Returns the number of bytes
+         * transferred, or -1 on error.
+         */
+
+        virtual bool seek(int fh, uint32_t position) = 0;
+        /*
+         * Move to a byte offset from the start of a file open for reading.
+         */
+
+        virtual int32_t size(int fh) = 0;
+        /*
+         * Size of an open file, or -1 on error.
+         */
+
+        virtual void close(int fh) = 0;
+
+        virtual bool openDir(void) = 0;
+        /*
+         * Start an enumeration of all files in the filesystem.  With
+         * ESPSYNC_FS_DIRS, every directory is walked, to ESPSYNC_MAX_DEPTH,
+         * and each file is named by its whole path.
+         */
+
+        virtual bool nextEntry(ESPSyncDirEntry *entry) = 0;
+        /*
+         * Get the next file in the enumeration. Returns false at the end.
+         * Directories themselves are not entries.
+         */
+
+    private:
+#if defined(ARDUINO_ARCH_ESP32)
+        StaticSemaphore_t _lock_buf;
+        SemaphoreHandle_t _lock;
+#elif defined(ESPSYNC_FS_LOCK)
+        std::recursive_mutex _lock;
+#endif
+};
+
+#endif
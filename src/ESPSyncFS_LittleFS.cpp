@@ -0,0 +1,332 @@
+/**
+ *  ESP Sync LittleFS filesystem backend
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncFS_LittleFS.h"
+
+#if defined(ESPSYNC_HAS_LITTLEFS)
+
+#include "ESPSyncManifest.h"
+#include "LittleFS.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <utime.h>
+
+/* Where the ESP32 core mounts it, for the C library calls it lacks */
+#define LITTLEFS_BASE_PATH  "/littlefs"
+#endif
+
+/* Writes are buffered a page at a time, whatever the block size */
+#define LITTLEFS_PAGE_SIZE  (256)
+
+/* LittleFS allows 255, this is what fits a listing entry with a date and checksum */
+#define LITTLEFS_MAX_PATH   (48)
+
+/* The library's own files, "///TEMP" is "/.espsync/TEMP" */
+#define LITTLEFS_PRIVATE    "/.espsync/"
+
+ESPSyncLittleFS::ESPSyncLittleFS(void)
+{
+    _depth = 0;
+}
+
+/**
+ * "///" names can not be stored as they are, LittleFS would take the
+ * slashes as the root directory.
+ */
+const char *ESPSyncLittleFS::LFS_Path(const char *path, char *buf)
+{
+    if (!ESPSYNC_INTERNAL(path)) {
+        return path;
+    }
+    snprintf(buf, ESPSYNC_MAX_PATH, LITTLEFS_PRIVATE "%s", path + 3);
+    return buf;
+}
+
+/**
+ * The ESP8266 makes the directories a file is written into, and removes
+ * them once they are empty.  The ESP32 does only the first, and not for
+ * a rename, so this does the rest.
+ */
+void ESPSyncLittleFS::LFS_Parents(const char *path)
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    char dir[ESPSYNC_MAX_PATH];
+
+    strncpy(dir, path, sizeof(dir)-1);
+    dir[sizeof(dir)-1] = 0x00;
+    for (char *sep = strchr(dir+1, '/'); sep != NULL; sep = strchr(sep+1, '/')) {
+        *sep = 0x00;
+        LittleFS.mkdir(dir);
+        *sep = '/';
+    }
+#else
+    (void)path;
+#endif
+}
+
+void ESPSyncLittleFS::LFS_Prune(const char *path)
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    char  dir[ESPSYNC_MAX_PATH];
+    char *sep;
+
+    strncpy(dir, path, sizeof(dir)-1);
+    dir[sizeof(dir)-1] = 0x00;
+    while (((sep = strrchr(dir, '/')) != NULL) && (sep != dir)) {
+        *sep = 0x00;
+        if (!LittleFS.rmdir(dir)) {
+            break;
+        }
+    }
+#else
+    (void)path;
+#endif
+}
+
+bool ESPSyncLittleFS::begin(void) {
+    return LittleFS.begin();
+}
+
+bool ESPSyncLittleFS::info(ESPSyncFSInfo *info) {
+#if defined(ARDUINO_ARCH_ESP8266)
+    FSInfo fs_info;
+    if (!LittleFS.info(fs_info)) {
+        return false;
+    }
+    info->totalBytes    = fs_info.totalBytes;
+    info->usedBytes     = fs_info.usedBytes;
+#else
+    info->totalBytes    = LittleFS.totalBytes();
+    info->usedBytes     = LittleFS.usedBytes();
+#endif
+    info->pageSize      = LITTLEFS_PAGE_SIZE;
+    info->maxPathLength = LITTLEFS_MAX_PATH;
+    return true;
+}
+
+uint8_t ESPSyncLittleFS::caps(void) {
+    return ESPSYNC_FS_DIRS | ESPSYNC_FS_MTIME;
+}
+
+bool ESPSyncLittleFS::getTime(const char *path, uint8_t *date) {
+    char  buf[ESPSYNC_MAX_PATH];
+    File  f = LittleFS.open(LFS_Path(path, buf), "r");
+    bool  ok = false;
+
+    if (f) {
+        ok = espsync_time_date(f.getLastWrite(), date);
+        f.close();
+    }
+    return ok;
+}
+
+bool ESPSyncLittleFS::setTime(const char *path, const uint8_t *date) {
+#if defined(ARDUINO_ARCH_ESP32)
+    char   full[sizeof(LITTLEFS_BASE_PATH) + ESPSYNC_MAX_PATH];
+    char   buf[ESPSYNC_MAX_PATH];
+    struct utimbuf times;
+    time_t t;
+
+    if (!espsync_date_time(date, &t)) {
+        return false;
+    }
+    snprintf(full, sizeof(full), LITTLEFS_BASE_PATH "%s", LFS_Path(path, buf));
+    times.actime = t;
+    times.modtime = t;
+    return utime(full, &times) == 0;
+#else
+    /* Files are stamped from the clock as they are closed, and only then */
+    (void)path;
+    (void)date;
+    return false;
+#endif
+}
+
+bool ESPSyncLittleFS::format(void) {
+    for (int fh = 0; fh < ESPSYNC_MAX_OPEN; fh++) {
+        close(fh);
+    }
+    return LittleFS.format();
+}
+
+bool ESPSyncLittleFS::exists(const char *path) {
+    char buf[ESPSYNC_MAX_PATH];
+    return LittleFS.exists(LFS_Path(path, buf));
+}
+
+bool ESPSyncLittleFS::remove(const char *path) {
+    char buf[ESPSYNC_MAX_PATH];
+    path = LFS_Path(path, buf);
+    if (!LittleFS.remove(path)) {
+        return false;
+    }
+    LFS_Prune(path);
+    return true;
+}
+
+bool ESPSyncLittleFS::rename(const char *from, const char *to) {
+    char fbuf[ESPSYNC_MAX_PATH];
+    char tbuf[ESPSYNC_MAX_PATH];
+    from = LFS_Path(from, fbuf);
+    to = LFS_Path(to, tbuf);
+    LFS_Parents(to);
+    if (!LittleFS.rename(from, to)) {
+        return false;
+    }
+    LFS_Prune(from);
+    return true;
+}
+
+int ESPSyncLittleFS::open(const char *path, const char *mode) {
+    char buf[ESPSYNC_MAX_PATH];
+    path = LFS_Path(path, buf);
+    for (int fh = 0; fh < ESPSYNC_MAX_OPEN; fh++) {
+        if (!_files[fh]) {
+#if defined(ARDUINO_ARCH_ESP32)
+            _files[fh] = LittleFS.open(path, mode, mode[0] != 'r');
+#else
+            _files[fh] = LittleFS.open(path, mode);
+#endif
+            if (!_files[fh]) {
+                break;
+            }
+            return fh;
+        }
+    }
+    return ESPSYNC_NO_FILE;
+}
+
+int32_t ESPSyncLittleFS::read(int fh, uint8_t *buffer, uint32_t length) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return -1;
+    }
+    return _files[fh].read(buffer, length);
+}
+
+int32_t ESPSyncLittleFS::write(int fh, const uint8_t *buffer, uint32_t length) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return -1;
+    }
+    return _files[fh].write(buffer, length);
+}
+
+bool ESPSyncLittleFS::seek(int fh, uint32_t position) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return false;
+    }
+    return _files[fh].seek(position, SeekSet);
+}
+
+int32_t ESPSyncLittleFS::size(int fh) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return -1;
+    }
+    return _files[fh].size();
+}
+
+void ESPSyncLittleFS::close(int fh) {
+    if ((fh >= 0) && (fh < ESPSYNC_MAX_OPEN)) {
+        _files[fh].close();
+        _files[fh] = File();
+    }
+}
+
+bool ESPSyncLittleFS::openDir(void) {
+    /**
+     * NOTE: Walks every directory, depth first, to ESPSYNC_MAX_DEPTH.
+     * Hidden ones, Eg, the private one, are skipped, as are paths too
+     * long for a listing entry, rather than listing them cut short.
+     */
+#if defined(ARDUINO_ARCH_ESP8266)
+    _dir[0] = LittleFS.openDir("/");
+    _dirname[0] = 0x00;
+    _dirlen[0] = 0;
+    _depth = 1;
+#else
+    while (_depth > 0) {
+        _dir[--_depth].close();
+    }
+    _dir[0] = LittleFS.open("/");
+    if (!_dir[0] || !_dir[0].isDirectory()) {
+        return false;
+    }
+    _depth = 1;
+#endif
+    return true;
+}
+
+bool ESPSyncLittleFS::nextEntry(ESPSyncDirEntry *entry) {
+#if defined(ARDUINO_ARCH_ESP8266)
+    char name[ESPSYNC_MAX_PATH];
+
+    while (_depth > 0) {
+        Dir *dir = &_dir[_depth-1];
+        if (!dir->next()) {
+            _dir[--_depth] = Dir();
+            if (_depth > 0) {
+                _dirname[_dirlen[_depth-1]] = 0x00;
+            }
+            continue;
+        }
+        String fname = dir->fileName();
+        int len = snprintf(name, sizeof(name), "%s/%s", _dirname, fname.c_str());
+        if ((fname[0] == '.') || (len >= LITTLEFS_MAX_PATH)) {
+            continue;
+        }
+        if (dir->isDirectory()) {
+            if (_depth < ESPSYNC_MAX_DEPTH) {
+                _dir[_depth] = LittleFS.openDir(name);
+                strcpy(_dirname, name);
+                _dirlen[_depth++] = len;
+            }
+            continue;
+        }
+        strcpy(entry->name, name);
+        entry->size = dir->fileSize();
+        return true;
+    }
+#else
+    while (_depth > 0) {
+        File f = _dir[_depth-1].openNextFile();
+        if (!f) {
+            _dir[--_depth].close();
+            continue;
+        }
+        const char *path = f.path();
+        const char *base = strrchr(path, '/');
+        if (((base != NULL) && (base[1] == '.')) || (strlen(path) >= LITTLEFS_MAX_PATH)) {
+            f.close();
+            continue;
+        }
+        if (f.isDirectory()) {
+            if (_depth < ESPSYNC_MAX_DEPTH) {
+                _dir[_depth++] = f;
+            } else {
+                f.close();
+            }
+            continue;
+        }
+        strcpy(entry->name, path);
+        entry->size = f.size();
+        f.close();
+        return true;
+    }
+#endif
+    return false;
+}
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ *  ESP Sync LittleFS filesystem backend
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCFS_LITTLEFS_H_
+#define __ESPSYNCFS_LITTLEFS_H_
+
+/**
+ * Not every core has LittleFS, Eg, ESP32 Arduino 1.0.x, so the backend
+ * is only built where it is asked for, or where the sketch includes
+ * "LittleFS.h", as a SPIFFS only sketch does not.
+ */
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266)
+#if defined(ESPSYNC_LITTLEFS)
+#define ESPSYNC_HAS_LITTLEFS
+#elif defined(__has_include)
+#if __has_include("LittleFS.h")
+#define ESPSYNC_HAS_LITTLEFS
+#endif
+#endif
+#endif
+
+#if defined(ESPSYNC_HAS_LITTLEFS)
+
+#include "ESPSyncFS.h"
+#include "FS.h"
+
+/**
+ * LittleFS has real directories, "/dir/name" is a file in "/dir", and
+ * keeps the time each file was written.  It does not stall for garbage
+ * collection the way SPIFFS does.
+ *
+ * The library's own files, named "///...", are kept in "/.espsync",
+ * which is never listed.
+ */
+class ESPSyncLittleFS : public ESPSyncFS
+{
+    public:
+        ESPSyncLittleFS(void);
+
+        bool begin(void);
+        bool info(ESPSyncFSInfo *info);
+        uint8_t caps(void);
+        bool getTime(const char *path, uint8_t *date);
+        bool setTime(const char *path, const uint8_t *date);
+        bool format(void);
+        bool exists(const char *path);
+        bool remove(const char *path);
+        bool rename(const char *from, const char *to);
+
+        int open(const char *path, const char *mode);
+        int32_t read(int fh, uint8_t *buffer, uint32_t length);
+        int32_t write(int fh, const uint8_t *buffer, uint32_t length);
+        bool seek(int fh, uint32_t position);
+        int32_t size(int fh);
+        void close(int fh);
+
+        bool openDir(void);
+        bool nextEntry(ESPSyncDirEntry *entry);
+
+    private:
+        File    _files[ESPSYNC_MAX_OPEN];
+#if defined(ARDUINO_ARCH_ESP8266)
+        Dir     _dir[ESPSYNC_MAX_DEPTH];
+        uint8_t _dirlen[ESPSYNC_MAX_DEPTH]; /* Length of _dirname for each */
+        char    _dirname[ESPSYNC_MAX_PATH]; /* Of the innermost, "" for the root */
+#else
+        File    _dir[ESPSYNC_MAX_DEPTH];
+#endif
+        uint8_t _depth;
+
+        const char *LFS_Path(const char *path, char *buf);
+        void LFS_Parents(const char *path);
+        void LFS_Prune(const char *path);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,151 @@
+/**
+ *  ESP Sync SPIFFS filesystem backend
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266)
+
+#include "ESPSyncFS_SPIFFS.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include "SPIFFS.h"
+
+/* The ESP32 SPIFFS does not report its geometry, these are the IDF defaults */
+#define SPIFFS_PAGE_SIZE     (256)
+#define SPIFFS_MAX_PATH      (32)
+#endif
+
+bool ESPSyncSPIFFS::begin(void) {
+    return SPIFFS.begin();
+}
+
+bool ESPSyncSPIFFS::info(ESPSyncFSInfo *info) {
+#if defined(ARDUINO_ARCH_ESP8266)
+    FSInfo fs_info;
+    if (!SPIFFS.info(fs_info)) {
+        return false;
+    }
+    info->totalBytes    = fs_info.totalBytes;
+    info->usedBytes     = fs_info.usedBytes;
+    info->pageSize      = fs_info.pageSize;
+    info->maxPathLength = fs_info.maxPathLength;
+#else
+    info->totalBytes    = SPIFFS.totalBytes();
+    info->usedBytes     = SPIFFS.usedBytes();
+    info->pageSize      = SPIFFS_PAGE_SIZE;
+    info->maxPathLength = SPIFFS_MAX_PATH;
+#endif
+    return true;
+}
+
+bool ESPSyncSPIFFS::format(void) {
+    return SPIFFS.format();
+}
+
+bool ESPSyncSPIFFS::exists(const char *path) {
+    return SPIFFS.exists(path);
+}
+
+bool ESPSyncSPIFFS::remove(const char *path) {
+    return SPIFFS.remove(path);
+}
+
+bool ESPSyncSPIFFS::rename(const char *from, const char *to) {
+    return SPIFFS.rename(from, to);
+}
+
+int ESPSyncSPIFFS::open(const char *path, const char *mode) {
+    for (int fh = 0; fh < ESPSYNC_MAX_OPEN; fh++) {
+        if (!_files[fh]) {
+            _files[fh] = SPIFFS.open(path, mode);
+            if (!_files[fh]) {
+                break;
+            }
+            return fh;
+        }
+    }
+    return ESPSYNC_NO_FILE;
+}
+
+int32_t ESPSyncSPIFFS::read(int fh, uint8_t *buffer, uint32_t length) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return -1;
+    }
+    return _files[fh].read(buffer, length);
+}
+
+int32_t ESPSyncSPIFFS::write(int fh, const uint8_t *buffer, uint32_t length) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return -1;
+    }
+    return _files[fh].write(buffer, length);
+}
+
+bool ESPSyncSPIFFS::seek(int fh, uint32_t position) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return false;
+    }
+    return _files[fh].seek(position, SeekSet);
+}
+
+int32_t ESPSyncSPIFFS::size(int fh) {
+    if ((fh < 0) || (fh >= ESPSYNC_MAX_OPEN) || !_files[fh]) {
+        return -1;
+    }
+    return _files[fh].size();
+}
+
+void ESPSyncSPIFFS::close(int fh) {
+    if ((fh >= 0) && (fh < ESPSYNC_MAX_OPEN)) {
+        _files[fh].close();
+        _files[fh] = File();
+    }
+}
+
+bool ESPSyncSPIFFS::openDir(void) {
+    /**
+     * NOTE: Does not handle subdirectories, because SPIFFS is FLAT
+     */
+#if defined(ARDUINO_ARCH_ESP8266)
+    _dir = SPIFFS.openDir("/");
+    return true;
+#else
+    _dir = SPIFFS.open("/");
+    return (bool)_dir;
+#endif
+}
+
+bool ESPSyncSPIFFS::nextEntry(ESPSyncDirEntry *entry) {
+#if defined(ARDUINO_ARCH_ESP8266)
+    if (!_dir.next()) {
+        return false;
+    }
+    strncpy(entry->name, _dir.fileName().c_str(), ESPSYNC_MAX_PATH-1);
+    entry->name[ESPSYNC_MAX_PATH-1] = 0x00;
+    entry->size = _dir.fileSize();
+#else
+    File f = _dir.openNextFile();
+    if (!f) {
+        return false;
+    }
+    strncpy(entry->name, f.name(), ESPSYNC_MAX_PATH-1);
+    entry->name[ESPSYNC_MAX_PATH-1] = 0x00;
+    entry->size = f.size();
+    f.close();
+#endif
+    return true;
+}
+
+#endif
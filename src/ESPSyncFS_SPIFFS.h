@@ -0,0 +1,57 @@
+/**
+ *  ESP Sync SPIFFS filesystem backend
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCFS_SPIFFS_H_
+#define __ESPSYNCFS_SPIFFS_H_
+
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266)
+
+#include "ESPSyncFS.h"
+#include "FS.h"
+
+class ESPSyncSPIFFS : public ESPSyncFS
+{
+    public:
+        bool begin(void);
+        bool info(ESPSyncFSInfo *info);
+        bool format(void);
+        bool exists(const char *path);
+        bool remove(const char *path);
+        bool rename(const char *from, const char *to);
+
+        int open(const char *path, const char *mode);
+        int32_t read(int fh, uint8_t *buffer, uint32_t length);
+        int32_t write(int fh, const uint8_t *buffer, uint32_t length);
+        bool seek(int fh, uint32_t position);
+        int32_t size(int fh);
+        void close(int fh);
+
+        bool openDir(void);
+        bool nextEntry(ESPSyncDirEntry *entry);
+
+    private:
+        File _files[ESPSYNC_MAX_OPEN];
+#if defined(ARDUINO_ARCH_ESP8266)
+        Dir  _dir;
+#else
+        File _dir;
+#endif
+};
+
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ *  ESP Sync LZ decompressor
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncLZ.h"
+
+#define LZ_MIN_MATCH  (3)
+#define LZ_LONG_MATCH (15)  /* Length nibble followed by an extra byte */
+
+ESPSyncLZ::ESPSyncLZ(void)
+{
+    _mask = 0;
+    _total = 0;
+    _flags = 0;
+    _nflags = 0;
+    _ntok = 0;
+    _mlen = 0;
+    _moff = 0;
+    _error = false;
+}
+
+ESPSyncLZ::~ESPSyncLZ(void)
+{
+    end();
+}
+
+bool ESPSyncLZ::begin(uint8_t bits)
+{
+    if (bits > ESPSYNC_LZ_WINDOW_BITS) {
+        return false;
+    }
+    _mask = (1 << bits) - 1;
+    _total = 0;
+    _nflags = 0;
+    _ntok = 0;
+    _mlen = 0;
+    _error = false;
+    return true;
+}
+
+size_t ESPSyncLZ::decode(const uint8_t *in, size_t inLength,
+                         uint8_t *out, size_t outLength, size_t *produced)
+{
+    size_t  used = 0;
+    size_t  made = 0;
+    uint8_t byte;
+
+    while (!_error && (made < outLength)) {
+        if (_mlen > 0) {
+            /* Part way through a match, it can overlap what it makes */
+            byte = _win[(_total - _moff) & _mask];
+            _mlen--;
+        } else if (used == inLength) {
+            break;
+        } else if (_nflags == 0) {
+            _flags = in[used++];
+            _nflags = 8;
+            continue;
+        } else if ((_flags & 1) == 0) {
+            byte = in[used++];
+            _flags >>= 1;
+            _nflags--;
+        } else {
+            _tok[_ntok++] = in[used++];
+            if ((_ntok < 2) || ((_ntok == 2) && ((_tok[0] >> 4) == LZ_LONG_MATCH))) {
+                continue;
+            }
+            _moff = (((uint16_t)(_tok[0] & 0x0F) << 8) | _tok[1]) + 1;
+            _mlen = (_tok[0] >> 4) + LZ_MIN_MATCH + ((_ntok == 3) ? _tok[2] : 0);
+            _ntok = 0;
+            _flags >>= 1;
+            _nflags--;
+            if ((_moff > (uint32_t)_mask + 1) || (_moff > _total)) {
+                _error = true;
+            }
+            continue;
+        }
+
+        _win[_total & _mask] = byte;
+        _total++;
+        out[made++] = byte;
+    }
+
+    *produced = made;
+    return used;
+}
+
+bool ESPSyncLZ::idle(void)
+{
+    return (_mlen == 0) && (_ntok == 0);
+}
+
+bool ESPSyncLZ::error(void)
+{
+    return _error;
+}
+
+void ESPSyncLZ::end(void)
+{
+    _mask = 0;
+}
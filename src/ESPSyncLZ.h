@@ -0,0 +1,88 @@
+/**
+ *  ESP Sync LZ decompressor
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCLZ_H_
+#define __ESPSYNCLZ_H_
+
+#include "ESPSyncPlatform.h"
+
+/**
+ * An LZSS stream, in the style of heatshrink.  A flag byte says which
+ * of the next 8 items are literal bytes (0) or matches (1).  A match is
+ *   LLLL OOOO  OOOO OOOO  [EXTRA]
+ * copying L+3 bytes from O+1 bytes back.  L of 15 is followed by a byte
+ * to add, so a match is 3 to 273 bytes.  The compressor only refers back
+ * as far as the window, 2^bits bytes, so that is all the RAM decoding needs.
+ */
+#define ESPSYNC_LZ_MIN_BITS (8)
+#define ESPSYNC_LZ_MAX_BITS (12)  /* Most the format can refer back */
+
+/* Largest window the slave will decode, 1KB, held in the decoder */
+#ifndef ESPSYNC_LZ_WINDOW_BITS
+#define ESPSYNC_LZ_WINDOW_BITS (10)
+#endif
+
+class ESPSyncLZ
+{
+    public:
+        ESPSyncLZ(void);
+        ~ESPSyncLZ(void);
+
+        bool begin(uint8_t bits);
+        /*
+         * Start a stream compressed with a window of 2^bits bytes.
+         * Returns false if that is larger than ESPSYNC_LZ_WINDOW_BITS.
+         */
+
+        size_t decode(const uint8_t *in, size_t inLength,
+                      uint8_t *out, size_t outLength, size_t *produced);
+        /*
+         * Decompress as much as possible of in, into out.
+         * Returns the bytes of in used, and sets produced to the bytes
+         * written to out.  Stops when out is full or in is used up, a
+         * stream can be split anywhere.  Check error() afterwards.
+         */
+
+        bool idle(void);
+        /*
+         * True between items, where a complete stream must end.
+         */
+
+        bool error(void);
+        /*
+         * The stream refers back further than it can.
+         */
+
+        void end(void);
+        /*
+         * Finish with the stream.
+         */
+
+    private:
+        uint8_t   _win[1 << ESPSYNC_LZ_WINDOW_BITS];
+        uint16_t  _mask;
+        uint32_t  _total;   /* Bytes decoded, to check matches against */
+        uint8_t   _flags;
+        uint8_t   _nflags;  /* Items left that _flags describes */
+        uint8_t   _tok[3];  /* Match being gathered */
+        uint8_t   _ntok;
+        uint16_t  _mlen;    /* Bytes left to copy of the current match */
+        uint16_t  _moff;
+        bool      _error;
+};
+
+#endif
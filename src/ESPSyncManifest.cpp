@@ -0,0 +1,409 @@
+/**
+ *  ESP Sync file checksum manifest
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncManifest.h"
+#include "ESPSyncChecksum.h"
+
+#define MANIFEST_NAME     "///MANIFEST"
+#define MANIFEST_NEW_NAME "///MANIFEST.NEW"
+
+/* Trailer is "ESM", version, COUNT(4) and DIGEST(4) */
+#define MANIFEST_VERSION  (1)
+#define MANIFEST_TRAILER  (12)
+
+/* Fixed part of an entry, NSIZ then SIZE, DATE and CSUM after the name */
+#define ENTRY_FIXED       (1 + 4 + 6 + 4)
+
+/* Bytes of a file read at once, when calculating its checksum */
+#define CSUM_READ_SIZE    (64)
+
+#define GET32(buf) (((uint32_t)(buf)[0] << 24) | ((uint32_t)(buf)[1] << 16) | \
+                    ((uint32_t)(buf)[2] << 8) | (buf)[3])
+#define PUT32(buf,value) {(buf)[0] = (value) >> 24; (buf)[1] = ((value) >> 16) & 0xFF; \
+                          (buf)[2] = ((value) >> 8) & 0xFF; (buf)[3] = (value) & 0xFF;}
+
+uint32_t file_adler32(ESPSyncFS *fs, int fh) {
+    uint32_t fcsum = ADLER32_INIT;
+    uint8_t  fbuf[CSUM_READ_SIZE];
+    int32_t  frd;
+
+    while ((frd = fs->read(fh, fbuf, sizeof(fbuf))) > 0) {
+        fcsum = adler32_update(fcsum, fbuf, frd);
+    }
+    return fcsum;
+}
+
+uint32_t manifest_hash(const char *name, uint32_t size, uint32_t csum)
+{
+    uint8_t  sbuf[8];
+    uint32_t crc = crc32_update(CRC32_INIT, (const uint8_t*)name, strlen(name));
+
+    PUT32(sbuf, size);
+    PUT32(sbuf + 4, csum);
+    return crc32_update(crc, sbuf, 8);
+}
+
+/**
+ * Digest of one file's name and size.  The manifest's digest is the
+ * sum of these, so it does not depend on the order files are listed.
+ */
+static uint32_t entry_digest(const char *name, uint32_t size)
+{
+    uint8_t  sbuf[4];
+    uint32_t crc = crc32_update(CRC32_INIT, (const uint8_t*)name, strlen(name));
+
+    PUT32(sbuf, size);
+    return crc32_update(crc, sbuf, 4);
+}
+
+ESPSyncManifest::ESPSyncManifest(void)
+{
+    _fs = NULL;
+    _fh = ESPSYNC_NO_FILE;
+    _left = 0;
+    _holding = false;
+    _nheld = 0;
+}
+
+void ESPSyncManifest::setFS(ESPSyncFS *fs)
+{
+    _fs = fs;
+}
+
+/**
+ * Read the trailer of an open manifest, then go back to the first entry.
+ */
+bool ESPSyncManifest::MAN_Trailer(int fh, uint32_t *count, uint32_t *digest, uint32_t *length)
+{
+    uint8_t trailer[MANIFEST_TRAILER];
+    int32_t size = _fs->size(fh);
+
+    if ((size < MANIFEST_TRAILER) ||
+        !_fs->seek(fh, size - MANIFEST_TRAILER) ||
+        (_fs->read(fh, trailer, MANIFEST_TRAILER) != MANIFEST_TRAILER) ||
+        (trailer[0] != 'E') || (trailer[1] != 'S') || (trailer[2] != 'M') ||
+        (trailer[3] != MANIFEST_VERSION) ||
+        !_fs->seek(fh, 0)) {
+        return false;
+    }
+    *count  = GET32(trailer + 4);
+    *digest = GET32(trailer + 8);
+    *length = size - MANIFEST_TRAILER;
+    return true;
+}
+
+bool ESPSyncManifest::MAN_Read(int fh, ESPSyncManifestEntry *entry)
+{
+    uint8_t buf[ESPSYNC_MAX_PATH + ENTRY_FIXED];
+    uint8_t nsiz;
+
+    if ((_left < ENTRY_FIXED) || (_fs->read(fh, &nsiz, 1) != 1) ||
+        (nsiz == 0) || (nsiz >= ESPSYNC_MAX_PATH) ||
+        ((uint32_t)nsiz + ENTRY_FIXED > _left) ||
+        (_fs->read(fh, buf, nsiz + ENTRY_FIXED - 1) != nsiz + ENTRY_FIXED - 1)) {
+        return false;
+    }
+    _left -= nsiz + ENTRY_FIXED;
+
+    memcpy(entry->name, buf, nsiz);
+    entry->name[nsiz] = 0x00;
+    entry->size = GET32(buf + nsiz);
+    memcpy(entry->date, buf + nsiz + 4, 6);
+    entry->csum = GET32(buf + nsiz + 10);
+    return true;
+}
+
+bool ESPSyncManifest::MAN_Write(int fh, const ESPSyncManifestEntry *entry)
+{
+    uint8_t buf[ESPSYNC_MAX_PATH + ENTRY_FIXED];
+    size_t  nsiz = strlen(entry->name);
+
+    buf[0] = nsiz;
+    memcpy(buf + 1, entry->name, nsiz);
+    PUT32(buf + 1 + nsiz, entry->size);
+    memcpy(buf + 5 + nsiz, entry->date, 6);
+    PUT32(buf + 11 + nsiz, entry->csum);
+    return _fs->write(fh, buf, nsiz + ENTRY_FIXED) == (int32_t)(nsiz + ENTRY_FIXED);
+}
+
+/**
+ * Add the trailer to a new manifest, and make it the manifest.
+ * The new manifest is closed.
+ */
+bool ESPSyncManifest::MAN_Finish(int fh, uint32_t count, uint32_t digest)
+{
+    uint8_t trailer[MANIFEST_TRAILER] = { 'E', 'S', 'M', MANIFEST_VERSION };
+    bool    ok;
+
+    PUT32(trailer + 4, count);
+    PUT32(trailer + 8, digest);
+    ok = (_fs->write(fh, trailer, MANIFEST_TRAILER) == MANIFEST_TRAILER);
+    _fs->close(fh);
+
+    if (ok && _fs->exists(MANIFEST_NAME)) {
+        ok = _fs->remove(MANIFEST_NAME);
+    }
+    if (ok) {
+        ok = _fs->rename(MANIFEST_NEW_NAME, MANIFEST_NAME);
+    }
+    if (!ok) {
+        _fs->remove(MANIFEST_NEW_NAME);
+    }
+    return ok;
+}
+
+bool ESPSyncManifest::valid(uint32_t *files)
+{
+    ESPSyncDirEntry dir;
+    uint32_t count, digest, length;
+    uint32_t n = 0;
+    uint32_t d = 0;
+    bool     ok;
+
+    int fh = _fs->open(MANIFEST_NAME, "r");
+    ok = (fh != ESPSYNC_NO_FILE) && MAN_Trailer(fh, &count, &digest, &length);
+    if (fh != ESPSYNC_NO_FILE) {
+        _fs->close(fh);
+    }
+
+    /* The walk is still wanted for the count, even with no manifest */
+    if ((ok || (files != NULL)) && _fs->openDir()) {
+        while (_fs->nextEntry(&dir)) {
+            if (!ESPSYNC_INTERNAL(dir.name)) {
+                n++;
+                d += entry_digest(dir.name, dir.size);
+            }
+        }
+    }
+    if (files != NULL) {
+        *files = n;
+    }
+    return ok && (n == count) && (d == digest);
+}
+
+bool ESPSyncManifest::rebuild(void)
+{
+    ESPSyncDirEntry dir;
+    ESPSyncManifestEntry entry;
+    uint32_t count = 0;
+    uint32_t digest = 0;
+    bool     ok = true;
+
+    int out = _fs->open(MANIFEST_NEW_NAME, "w");
+    if (out == ESPSYNC_NO_FILE) {
+        return false;
+    }
+
+    if (_fs->openDir()) {
+        while (ok && _fs->nextEntry(&dir)) {
+            if (ESPSYNC_INTERNAL(dir.name)) {
+                continue;
+            }
+            int fh = _fs->open(dir.name, "r");
+            if (fh == ESPSYNC_NO_FILE) {
+                ok = false;
+                break;
+            }
+            strcpy(entry.name, dir.name);
+            entry.size = dir.size;
+            entry.csum = file_adler32(_fs, fh);
+            _fs->close(fh);
+            /* Only the filesystem knows when a file was changed behind our back */
+            if (!(_fs->caps() & ESPSYNC_FS_MTIME) || !_fs->getTime(entry.name, entry.date)) {
+                memset(entry.date, 0, sizeof(entry.date));
+            }
+
+            ok = MAN_Write(out, &entry);
+            count++;
+            digest += entry_digest(entry.name, entry.size);
+        }
+        /* Finish the enumeration, if it stopped early */
+        while (_fs->nextEntry(&dir)) {
+        }
+    }
+
+    if (!ok) {
+        _fs->close(out);
+        _fs->remove(MANIFEST_NEW_NAME);
+        return false;
+    }
+    return MAN_Finish(out, count, digest);
+}
+
+void ESPSyncManifest::invalidate(void)
+{
+    if (_fs->exists(MANIFEST_NAME)) {
+        _fs->remove(MANIFEST_NAME);
+    }
+}
+
+/**
+ * Copy the manifest, leaving out drop, renaming from to to, then
+ * replacing or adding the nadd entries of add.  Each is optional.
+ */
+bool ESPSyncManifest::MAN_Rewrite(const char *drop, const char *from, const char *to,
+                                  const ESPSyncManifestEntry *add, uint8_t nadd)
+{
+    ESPSyncManifestEntry entry;
+    uint32_t count = 0;
+    uint32_t digest = 0;
+    uint32_t old_count, old_digest;
+    bool     ok;
+
+    int in = _fs->open(MANIFEST_NAME, "r");
+    if (in == ESPSYNC_NO_FILE) {
+        /* None to keep up to date, the next listing builds one */
+        return true;
+    }
+    ok = MAN_Trailer(in, &old_count, &old_digest, &_left);
+
+    int out = ok ? _fs->open(MANIFEST_NEW_NAME, "w") : ESPSYNC_NO_FILE;
+    ok = ok && (out != ESPSYNC_NO_FILE);
+
+    while (ok && (_left > 0)) {
+        uint8_t x;
+        ok = MAN_Read(in, &entry);
+        if (!ok || ((drop != NULL) && (strcmp(entry.name, drop) == 0))) {
+            continue;
+        }
+        for (x = 0; (x < nadd) && (strcmp(entry.name, add[x].name) != 0); x++) {
+        }
+        if (x < nadd) {
+            continue;
+        }
+        if ((from != NULL) && (strcmp(entry.name, from) == 0)) {
+            strcpy(entry.name, to);
+        }
+        ok = MAN_Write(out, &entry);
+        count++;
+        digest += entry_digest(entry.name, entry.size);
+    }
+    _fs->close(in);
+
+    for (uint8_t x = 0; ok && (x < nadd); x++) {
+        ok = MAN_Write(out, &add[x]);
+        count++;
+        digest += entry_digest(add[x].name, add[x].size);
+    }
+
+    if (ok) {
+        ok = MAN_Finish(out, count, digest);
+    } else if (out != ESPSYNC_NO_FILE) {
+        _fs->close(out);
+        _fs->remove(MANIFEST_NEW_NAME);
+    }
+
+    if (!ok) {
+        /* Better none than a wrong one */
+        invalidate();
+    }
+    return ok;
+}
+
+bool ESPSyncManifest::update(const ESPSyncManifestEntry *entry)
+{
+    uint8_t x;
+
+    if (!_holding) {
+        return MAN_Rewrite(NULL, NULL, NULL, entry, 1);
+    }
+
+    /* The same file sent twice only needs its last entry */
+    for (x = 0; (x < _nheld) && (strcmp(_held[x].name, entry->name) != 0); x++) {
+    }
+    if ((x == ESPSYNC_MANIFEST_HELD) && !MAN_Flush()) {
+        return false;
+    }
+    if (x >= _nheld) {
+        x = _nheld++;
+    }
+    _held[x] = *entry;
+    return true;
+}
+
+bool ESPSyncManifest::remove(const char *name)
+{
+    return MAN_Flush() && MAN_Rewrite(name, NULL, NULL, NULL, 0);
+}
+
+bool ESPSyncManifest::rename(const char *from, const char *to)
+{
+    if (strlen(to) >= ESPSYNC_MAX_PATH) {
+        invalidate();
+        return false;
+    }
+    return MAN_Flush() && MAN_Rewrite(to, from, to, NULL, 0);
+}
+
+/**
+ * Write any held updates.
+ */
+bool ESPSyncManifest::MAN_Flush(void)
+{
+    bool ok = true;
+
+    if (_nheld > 0) {
+        ok = MAN_Rewrite(NULL, NULL, NULL, _held, _nheld);
+        _nheld = 0;
+    }
+    return ok;
+}
+
+bool ESPSyncManifest::hold(void)
+{
+    if (!_holding) {
+        _holding = true;
+        _nheld = 0;
+    }
+    return true;
+}
+
+bool ESPSyncManifest::release(void)
+{
+    bool ok = MAN_Flush();
+
+    _holding = false;
+    return ok;
+}
+
+bool ESPSyncManifest::open(uint32_t *count)
+{
+    uint32_t digest;
+
+    _fh = _fs->open(MANIFEST_NAME, "r");
+    if (_fh == ESPSYNC_NO_FILE) {
+        return false;
+    }
+    if (!MAN_Trailer(_fh, count, &digest, &_left)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool ESPSyncManifest::next(ESPSyncManifestEntry *entry)
+{
+    return (_fh != ESPSYNC_NO_FILE) && (_left > 0) && MAN_Read(_fh, entry);
+}
+
+void ESPSyncManifest::close(void)
+{
+    if (_fh != ESPSYNC_NO_FILE) {
+        _fs->close(_fh);
+        _fh = ESPSYNC_NO_FILE;
+    }
+}
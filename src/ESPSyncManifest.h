@@ -0,0 +1,129 @@
+/**
+ *  ESP Sync file checksum manifest
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCMANIFEST_H_
+#define __ESPSYNCMANIFEST_H_
+
+#include "ESPSyncPlatform.h"
+#include "ESPSyncFS.h"
+
+/**
+ * Names starting with this are the protocol's own files.  They are
+ * never listed, and can not be sent.
+ */
+#define ESPSYNC_INTERNAL_PREFIX "///"
+#define ESPSYNC_INTERNAL(name)  (strncmp((name), ESPSYNC_INTERNAL_PREFIX, 3) == 0)
+
+uint32_t file_adler32(ESPSyncFS *fs, int fh);
+/*
+ * Adler-32 of the rest of an open file.
+ */
+
+uint32_t manifest_hash(const char *name, uint32_t size, uint32_t csum);
+/*
+ * Hash of one file, for the Hash command.  CRC-32 of its name, then its
+ * size and Adler-32 in network byte order.  A set of files hashes to
+ * the sum of these, so the order the files are found in does not matter.
+ */
+
+typedef struct {
+    char     name[ESPSYNC_MAX_PATH];
+    uint32_t size;
+    uint8_t  date[6];   /* As the Set Time message, all 0 if not known */
+    uint32_t csum;      /* Adler-32 of the file */
+} ESPSyncManifestEntry;
+
+/* Updates held in RAM, while hold()ing them, before they are written */
+#ifndef ESPSYNC_MANIFEST_HELD
+#define ESPSYNC_MANIFEST_HELD (8)
+#endif
+
+/**
+ * The size, date and checksum of every file, kept in a file, so a
+ * listing does not have to read every file to checksum it.
+ *
+ * It is a list of entries, then a trailer with the number of entries
+ * and a digest of their names and sizes.  The same digest of the
+ * directory shows if the manifest is stale, without reading any files.
+ * A file changed in place, to the same size, is only found by a rebuild.
+ */
+class ESPSyncManifest
+{
+    public:
+        ESPSyncManifest(void);
+
+        void setFS(ESPSyncFS *fs);
+
+        bool valid(uint32_t *files = NULL);
+        /*
+         * The manifest exists, and has the same files and sizes as
+         * the directory.  files gets the number of files in the
+         * directory, found by the same walk, whether or not it does.
+         */
+
+        bool rebuild(void);
+        /*
+         * Checksum every file, and write a new manifest.
+         */
+
+        void invalidate(void);
+        /*
+         * Throw the manifest away, the next listing rebuilds it.
+         * Call this after changing files other than through ESPSync.
+         */
+
+        bool update(const ESPSyncManifestEntry *entry);
+        bool remove(const char *name);
+        bool rename(const char *from, const char *to);
+        /*
+         * Record a change made to a file.  Does nothing if there is no
+         * manifest, if recording fails the manifest is thrown away.
+         */
+
+        bool hold(void);
+        bool release(void);
+        /*
+         * Between these, updates are kept in RAM and written together,
+         * ESPSYNC_MANIFEST_HELD at a time, rather than rewriting the
+         * manifest for each file.  For many uploads in a row.
+         */
+
+        bool open(uint32_t *count);
+        bool next(ESPSyncManifestEntry *entry);
+        void close(void);
+        /*
+         * Read the entries.
+         */
+
+    private:
+        ESPSyncFS *_fs;
+        int        _fh;
+        uint32_t   _left;   /* Bytes of entries left to read */
+        ESPSyncManifestEntry _held[ESPSYNC_MANIFEST_HELD];
+        bool       _holding;
+        uint8_t    _nheld;
+
+        bool MAN_Trailer(int fh, uint32_t *count, uint32_t *digest, uint32_t *length);
+        bool MAN_Read(int fh, ESPSyncManifestEntry *entry);
+        bool MAN_Write(int fh, const ESPSyncManifestEntry *entry);
+        bool MAN_Finish(int fh, uint32_t count, uint32_t digest);
+        bool MAN_Rewrite(const char *drop, const char *from, const char *to,
+                         const ESPSyncManifestEntry *add, uint8_t nadd);
+        bool MAN_Flush(void);
+};
+
+#endif
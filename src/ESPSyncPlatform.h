@@ -0,0 +1,61 @@
+/**
+ *  ESP Sync platform portability
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCPLATFORM_H_
+#define __ESPSYNCPLATFORM_H_
+
+/**
+ * The protocol engine only needs fixed size integers, string functions
+ * and time.  On an Arduino build these come from Arduino.h, on the host
+ * build they come straight from the C library.
+ */
+#if defined(ARDUINO)
+#include "Arduino.h"
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#include <time.h>
+
+#if defined(ARDUINO)
+#define espsync_millis() millis()
+#define espsync_micros() micros()
+#else
+static inline uint32_t espsync_millis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static inline uint32_t espsync_micros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+#endif
+/*
+ * Free running millisecond and microsecond counters, used for
+ * receive timeouts and statistics.
+ */
+
+#endif
@@ -0,0 +1,68 @@
+/**
+ *  ESP Sync runtime statistics
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCSTATS_H_
+#define __ESPSYNCSTATS_H_
+
+#include "ESPSyncPlatform.h"
+
+/**
+ * Histograms of times have a bucket for each decade of microseconds,
+ * under 10us, under 100us, and so on, the last is 10s or longer.
+ */
+#define ESPSYNC_STATS_BUCKETS  (8)
+
+#define ESPSYNC_STATS_REJECTS  (8)   /* One for each header RXSTATE */
+#define ESPSYNC_STATS_NAKS     (8)   /* NAK codes 0x21 to 0x28 */
+#define ESPSYNC_STATS_COMMANDS (32)  /* Commands 0x60 to 0x6F, then 0x80 to 0x8F */
+
+/**
+ * Everything is a uint32_t, in the order of the Stats reply.
+ */
+typedef struct {
+    uint32_t period;      /* ms since the statistics were reset */
+    uint32_t rxBytes;     /* Bytes getData() read from the stream */
+    uint32_t rxApp;       /* of which it passed through to the application */
+    uint32_t rxDropped;   /* Application bytes lost, there was no room to hold them */
+    uint32_t rejects[ESPSYNC_STATS_REJECTS]; /* Headers rejected, by the state that failed */
+    uint32_t naks[ESPSYNC_STATS_NAKS];       /* NAKs sent, by code */
+    uint32_t retransmits; /* Requests seen again, and not carried out again */
+    uint32_t flashBytes;  /* Written to files received */
+    uint32_t write[ESPSYNC_STATS_BUCKETS];   /* Time of each flash write */
+    uint32_t loop[ESPSYNC_STATS_BUCKETS];    /* Time between getData() looking at the stream */
+    uint32_t service[ESPSYNC_STATS_COMMANDS][ESPSYNC_STATS_BUCKETS];
+                          /* Header received to reply sent, of each command */
+} ESPSyncStats;
+
+#define ESPSYNC_STATS_WORDS (sizeof(ESPSyncStats) / sizeof(uint32_t))
+
+static inline void espsync_histogram(uint32_t *hist, uint32_t us)
+{
+    uint8_t  bucket = 0;
+    uint32_t limit = 10;
+
+    while ((bucket < ESPSYNC_STATS_BUCKETS - 1) && (us >= limit)) {
+        bucket++;
+        limit *= 10;
+    }
+    hist[bucket]++;
+}
+/*
+ * Count a time in a histogram.
+ */
+
+#endif
@@ -0,0 +1,107 @@
+/**
+ *  ESP Sync stream interface
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCSTREAM_H_
+#define __ESPSYNCSTREAM_H_
+
+#include "ESPSyncPlatform.h"
+
+/**
+ * The minimal byte stream the protocol engine talks through.
+ * It mirrors the parts of the Arduino Stream class that are used, so
+ * that the engine can run over a UART on the ESP, or over a pty or
+ * socket on the host build.
+ */
+class ESPSyncStream
+{
+    public:
+        virtual ~ESPSyncStream(void) {}
+
+        virtual int available(void) = 0;
+        /*
+         * Number of bytes that can be read without blocking.
+         */
+
+        virtual int read(void) = 0;
+        /*
+         * Read a single byte, or -1 if none is available.
+         */
+
+        virtual size_t readBytes(uint8_t *buffer, size_t length) = 0;
+        /*
+         * Read up to length bytes, waiting at most the timeout
+         * between bytes.  Returns the number of bytes read.
+         */
+
+        virtual void setTimeout(unsigned long timeout) = 0;
+        /*
+         * Set the readBytes() timeout in milliseconds.
+         */
+
+        virtual size_t write(uint8_t byte) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+        /*
+         * Write one or many bytes, returns the number of bytes written.
+         */
+
+        virtual uint32_t baud(void) { return 0; }
+        virtual bool setBaud(uint32_t baud) { (void)baud; return false; }
+        /*
+         * The line rate, 0 if the stream has none that can be changed.
+         * setBaud() waits for everything written to be sent first.
+         */
+};
+
+#if defined(ARDUINO)
+/**
+ * Adapts any Arduino Stream (HardwareSerial, etc) to ESPSyncStream.
+ */
+class ESPSyncSerialStream : public ESPSyncStream
+{
+    public:
+        ESPSyncSerialStream(void) { _serial = NULL; _uart = NULL; }
+
+        void begin(Stream *serial) { _serial = serial; _uart = NULL; }
+        void begin(HardwareSerial *uart) { _serial = uart; _uart = uart; }
+
+        int available(void) { return _serial->available(); }
+        int read(void) { return _serial->read(); }
+        size_t readBytes(uint8_t *buffer, size_t length) {
+            return _serial->readBytes(buffer, length);
+        }
+        void setTimeout(unsigned long timeout) { _serial->setTimeout(timeout); }
+        size_t write(uint8_t byte) { return _serial->write(byte); }
+        size_t write(const uint8_t *buffer, size_t size) {
+            return _serial->write(buffer, size);
+        }
+        uint32_t baud(void) { return (_uart != NULL) ? _uart->baudRate() : 0; }
+        bool setBaud(uint32_t baud) {
+            if (_uart == NULL) {
+                return false;
+            }
+            _uart->flush();
+            _uart->updateBaudRate(baud);
+            return true;
+        }
+
+    private:
+        Stream         *_serial;
+        HardwareSerial *_uart;
+};
+#endif
+
+#endif
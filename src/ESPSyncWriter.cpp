@@ -0,0 +1,331 @@
+/**
+ *  ESP Sync pipelined file writer
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "ESPSyncWriter.h"
+
+#define NO_BUFFER (0xFF)
+
+#define WRITER_BUFFERS (ESPSYNC_WRITER_BUFFERS)
+
+#if defined(ESPSYNC_WRITER_TASK)
+/* Runs on the core the Arduino loop does not, so flash writes really
+   do overlap. */
+#define WRITER_TASK_PRIORITY (1)
+#define WRITER_TASK_CORE     (0)
+#endif
+
+ESPSyncWriter::ESPSyncWriter(void)
+{
+    _fs = NULL;
+    _fh = ESPSYNC_NO_FILE;
+    for (uint8_t x = 0; x < WRITER_BUFFERS; x++) {
+        _len[x] = 0;
+    }
+    _fill = NO_BUFFER;
+    _running = false;
+    _error = false;
+    memset(&_stats, 0, sizeof(_stats));
+    _totals = NULL;
+    _bytes = 0;
+    memset(_write, 0, sizeof(_write));
+#if defined(ESPSYNC_WRITER_TASK)
+    _freeq = NULL;
+#elif defined(ESPSYNC_WRITER_THREAD)
+    _stop = false;
+#endif
+}
+
+ESPSyncWriter::~ESPSyncWriter(void)
+{
+    end();
+#if defined(ESPSYNC_WRITER_TASK)
+    if (_freeq != NULL) {
+        /* Idle, so it is waiting on the queue */
+        vTaskDelete(_task);
+        vQueueDelete(_freeq);
+        vQueueDelete(_fullq);
+    }
+#elif defined(ESPSYNC_WRITER_THREAD)
+    if (_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+        }
+        _cond.notify_all();
+        _thread.join();
+    }
+#endif
+}
+
+bool ESPSyncWriter::begin(ESPSyncFS *fs, int fh, uint32_t pageSize)
+{
+    if (pageSize > ESPSYNC_PAGE_SIZE) {
+        return false;
+    }
+    _fs = fs;
+    _fh = fh;
+    _fill = NO_BUFFER;
+    _error = false;
+    memset(&_stats, 0, sizeof(_stats));
+
+    /**
+     * The task or thread is only started once, from memory that is part
+     * of the writer, then waits for buffers between files.
+     */
+#if defined(ESPSYNC_WRITER_TASK)
+    if (_freeq == NULL) {
+        _freeq = xQueueCreateStatic(ESPSYNC_WRITE_BUFFERS, sizeof(uint8_t),
+                                    _freeq_store, &_freeq_buf);
+        _fullq = xQueueCreateStatic(ESPSYNC_WRITE_BUFFERS, sizeof(uint8_t),
+                                    _fullq_store, &_fullq_buf);
+        for (uint8_t x = 0; x < ESPSYNC_WRITE_BUFFERS; x++) {
+            xQueueSend(_freeq, &x, 0);
+        }
+        _task = xTaskCreateStaticPinnedToCore(WRITE_Task, "espsync_wr", ESPSYNC_WRITER_STACK,
+                                              this, WRITER_TASK_PRIORITY, _task_stack,
+                                              &_task_buf, WRITER_TASK_CORE);
+    }
+#elif defined(ESPSYNC_WRITER_THREAD)
+    if (!_thread.joinable()) {
+        for (uint8_t x = 0; x < ESPSYNC_WRITE_BUFFERS; x++) {
+            _free[x] = x;
+        }
+        _nfree = ESPSYNC_WRITE_BUFFERS;
+        _free_head = 0;
+        _nfull = 0;
+        _full_head = 0;
+        _stop = false;
+        _thread = std::thread(&ESPSyncWriter::WRITE_Thread, this);
+    }
+#endif
+
+    _running = true;
+    return true;
+}
+
+/**
+ * Write one buffer to the file, timing it.
+ */
+bool ESPSyncWriter::WRITE_Buffer(uint8_t index)
+{
+    uint32_t start = espsync_micros();
+    uint32_t us;
+
+    if (!_error && (_fs->write(_fh, _buf[index], _len[index]) != (int32_t)_len[index])) {
+        _error = true;
+    }
+    us = espsync_micros() - start;
+    _stats.writeUs += us;
+    _stats.pages++;
+    _bytes += _len[index];
+    espsync_histogram(_write, us);
+    return !_error;
+}
+
+uint8_t *ESPSyncWriter::get(void)
+{
+    if (!_running || _error) {
+        return NULL;
+    }
+    if (_fill != NO_BUFFER) {
+        return _buf[_fill];
+    }
+
+#if defined(ESPSYNC_WRITER_TASK)
+    uint8_t index;
+    if (xQueueReceive(_freeq, &index, 0) != pdTRUE) {
+        uint32_t start = espsync_micros();
+        xQueueReceive(_freeq, &index, portMAX_DELAY);
+        _stats.waitUs += espsync_micros() - start;
+    }
+    _fill = index;
+#elif defined(ESPSYNC_WRITER_THREAD)
+    std::unique_lock<std::mutex> lock(_lock);
+    if (_nfree == 0) {
+        uint32_t start = espsync_micros();
+        _cond.wait(lock, [this] { return _nfree > 0; });
+        _stats.waitUs += espsync_micros() - start;
+    }
+    _fill = _free[_free_head];
+    _free_head = (_free_head + 1) % ESPSYNC_WRITE_BUFFERS;
+    _nfree--;
+#else
+    _fill = 0;
+#endif
+
+    return _error ? NULL : _buf[_fill];
+}
+
+void ESPSyncWriter::put(uint32_t length)
+{
+    if (_fill == NO_BUFFER) {
+        return;
+    }
+    _len[_fill] = length;
+
+#if defined(ESPSYNC_WRITER_TASK)
+    xQueueSend(_fullq, &_fill, portMAX_DELAY);
+#elif defined(ESPSYNC_WRITER_THREAD)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _full[(_full_head + _nfull) % ESPSYNC_WRITE_BUFFERS] = _fill;
+        _nfull++;
+    }
+    _cond.notify_all();
+#else
+    /* No writer task, so reception waits for the whole write */
+    uint32_t start = espsync_micros();
+    WRITE_Buffer(_fill);
+    _stats.waitUs += espsync_micros() - start;
+#endif
+
+    _fill = NO_BUFFER;
+}
+
+/**
+ * Wait for every queued write to finish, so every buffer but the one
+ * being filled is free.
+ */
+void ESPSyncWriter::WRITE_Idle(void)
+{
+    uint8_t idle = (_fill == NO_BUFFER) ? WRITER_BUFFERS : WRITER_BUFFERS - 1;
+#if defined(ESPSYNC_WRITER_TASK)
+    uint8_t held[ESPSYNC_WRITE_BUFFERS];
+    for (uint8_t x = 0; x < idle; x++) {
+        xQueueReceive(_freeq, &held[x], portMAX_DELAY);
+    }
+    for (uint8_t x = 0; x < idle; x++) {
+        xQueueSend(_freeq, &held[x], portMAX_DELAY);
+    }
+#elif defined(ESPSYNC_WRITER_THREAD)
+    std::unique_lock<std::mutex> lock(_lock);
+    _cond.wait(lock, [this, idle] { return _nfree == idle; });
+#else
+    (void)idle;
+#endif
+}
+
+/**
+ * Add what has been written to the totals.  Only once the writes are
+ * idle, as the caller may be reading or resetting the totals at any
+ * other time.
+ */
+void ESPSyncWriter::WRITE_Totals(void)
+{
+    if (_totals != NULL) {
+        _totals->flashBytes += _bytes;
+        for (uint8_t x = 0; x < ESPSYNC_STATS_BUCKETS; x++) {
+            _totals->write[x] += _write[x];
+        }
+    }
+    _bytes = 0;
+    memset(_write, 0, sizeof(_write));
+}
+
+bool ESPSyncWriter::next(int fh)
+{
+    bool ok;
+
+    if (!_running) {
+        return false;
+    }
+    WRITE_Idle();
+    WRITE_Totals();
+
+    ok = !_error;
+    _fh = fh;
+    _error = false;
+    return ok;
+}
+
+bool ESPSyncWriter::end(void)
+{
+    if (!_running) {
+        return !_error;
+    }
+    WRITE_Idle();
+    WRITE_Totals();
+
+    /* A buffer got, but never put, goes back for the next file */
+    if (_fill != NO_BUFFER) {
+#if defined(ESPSYNC_WRITER_TASK)
+        xQueueSend(_freeq, &_fill, portMAX_DELAY);
+#elif defined(ESPSYNC_WRITER_THREAD)
+        std::lock_guard<std::mutex> lock(_lock);
+        _free[(_free_head + _nfree) % ESPSYNC_WRITE_BUFFERS] = _fill;
+        _nfree++;
+#endif
+    }
+    _fill = NO_BUFFER;
+    _running = false;
+    return !_error;
+}
+
+void ESPSyncWriter::stats(ESPSyncWriterStats *stats)
+{
+    *stats = _stats;
+}
+
+#if defined(ESPSYNC_WRITER_TASK)
+/**
+ * Writes each full buffer, then hands it back, for as long as the
+ * writer exists.
+ */
+void ESPSyncWriter::WRITE_Task(void *writer)
+{
+    ESPSyncWriter *w = (ESPSyncWriter*)writer;
+    uint8_t index;
+
+    for (;;) {
+        xQueueReceive(w->_fullq, &index, portMAX_DELAY);
+        w->WRITE_Buffer(index);
+        xQueueSend(w->_freeq, &index, portMAX_DELAY);
+    }
+}
+#elif defined(ESPSYNC_WRITER_THREAD)
+/**
+ * Writes each full buffer, then hands it back, until told to stop
+ * and everything queued is written.
+ */
+void ESPSyncWriter::WRITE_Thread(void)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+
+    for (;;) {
+        _cond.wait(lock, [this] { return (_nfull > 0) || _stop; });
+        if (_nfull == 0) {
+            break;
+        }
+        uint8_t index = _full[_full_head];
+        _full_head = (_full_head + 1) % ESPSYNC_WRITE_BUFFERS;
+        _nfull--;
+
+        lock.unlock();
+        WRITE_Buffer(index);
+        lock.lock();
+
+        _free[(_free_head + _nfree) % ESPSYNC_WRITE_BUFFERS] = index;
+        _nfree++;
+        _cond.notify_all();
+    }
+}
+#endif
+
+void ESPSyncWriter::setTotals(ESPSyncStats *totals)
+{
+    _totals = totals;
+}
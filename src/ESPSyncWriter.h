@@ -0,0 +1,170 @@
+/**
+ *  ESP Sync pipelined file writer
+ *
+ * Copyright (c) 2019 Sakura Industries Limited.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ESPSYNCWRITER_H_
+#define __ESPSYNCWRITER_H_
+
+#include "ESPSyncPlatform.h"
+#include "ESPSyncFS.h"
+#include "ESPSyncStats.h"
+
+/* Page buffers in the pipeline, one filling while the others are written */
+#ifndef ESPSYNC_WRITE_BUFFERS
+#define ESPSYNC_WRITE_BUFFERS (2)
+#endif
+
+/* Largest page buffered, larger pages are written a part at a time */
+#ifndef ESPSYNC_PAGE_SIZE
+#define ESPSYNC_PAGE_SIZE (256)
+#endif
+#define ESPSYNC_WRITE_PAGE(size) (((size) < ESPSYNC_PAGE_SIZE) ? (size) : ESPSYNC_PAGE_SIZE)
+
+/**
+ * Writes are done by a FreeRTOS task on the ESP32 and a thread on the
+ * host build.  The ESP8266 has neither, so writes happen in put().
+ */
+#if defined(ARDUINO_ARCH_ESP32)
+#define ESPSYNC_WRITER_TASK
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#elif !defined(ARDUINO)
+#define ESPSYNC_WRITER_THREAD
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+/* Without a writer task, one buffer is all that can be used */
+#if defined(ESPSYNC_WRITER_TASK) || defined(ESPSYNC_WRITER_THREAD)
+#define ESPSYNC_WRITER_BUFFERS (ESPSYNC_WRITE_BUFFERS)
+#else
+#define ESPSYNC_WRITER_BUFFERS (1)
+#endif
+
+#if defined(ESPSYNC_WRITER_TASK)
+/* SPIFFS writes need a reasonable stack, in bytes on the ESP32 */
+#define ESPSYNC_WRITER_STACK (4096)
+#endif
+
+typedef struct {
+    uint32_t pages;     /* Buffers written */
+    uint32_t writeUs;   /* Time spent writing them */
+    uint32_t waitUs;    /* Time reception waited for a free buffer */
+} ESPSyncWriterStats;
+
+/**
+ * Overlap of reception with flash writes, in percent.
+ * 100 means reception never waited for a write, 0 means every write
+ * stalled reception, which is always so without a writer task.
+ */
+#define ESPSYNC_WRITE_OVERLAP(stats) \
+    (((stats).writeUs == 0) ? 100 : \
+     ((stats).waitUs >= (stats).writeUs) ? 0 : \
+     (uint32_t)((((uint64_t)((stats).writeUs - (stats).waitUs)) * 100) / (stats).writeUs))
+
+class ESPSyncWriter
+{
+    public:
+        ESPSyncWriter(void);
+        ~ESPSyncWriter(void);
+
+        bool begin(ESPSyncFS *fs, int fh, uint32_t pageSize);
+        /*
+         * Start writing to an open file, in pages of pageSize, no more
+         * than ESPSYNC_PAGE_SIZE.  The buffers are part of the writer,
+         * and its task or thread is started the first time, then kept.
+         */
+
+        uint8_t *get(void);
+        /*
+         * Get an empty buffer to fill.  Waits for one, if every buffer
+         * is being written.  Returns NULL if a write has failed.
+         */
+
+        void put(uint32_t length);
+        /*
+         * Queue the buffer from get() to be written.
+         */
+
+        bool next(int fh);
+        /*
+         * Wait for every queued write, then carry on with fh, keeping the
+         * buffers and writer task.  Returns false if any write to the
+         * last file failed.  For many files in a row.
+         */
+
+        bool end(void);
+        /*
+         * Wait for every queued write.  Returns false if any write
+         * failed.  The file is left open.
+         */
+
+        void stats(ESPSyncWriterStats *stats);
+        /*
+         * Statistics of the last file written.
+         */
+
+        void setTotals(ESPSyncStats *totals);
+        /*
+         * Also count every write, of every file, in totals.  They are
+         * added by next() and end(), from the caller's side, so totals
+         * is never touched by the writer task.
+         */
+
+    private:
+        ESPSyncFS *_fs;
+        int        _fh;
+        uint8_t    _buf[ESPSYNC_WRITER_BUFFERS][ESPSYNC_PAGE_SIZE];
+        uint32_t   _len[ESPSYNC_WRITER_BUFFERS];
+        uint8_t    _fill;       /* Buffer being filled, if not NO_BUFFER */
+        bool       _running;
+        volatile bool _error;
+        ESPSyncWriterStats _stats;
+        ESPSyncStats *_totals;
+        uint32_t   _bytes;      /* Written, and not yet in _totals */
+        uint32_t   _write[ESPSYNC_STATS_BUCKETS];
+
+        bool WRITE_Buffer(uint8_t index);
+        void WRITE_Idle(void);
+        void WRITE_Totals(void);
+
+#if defined(ESPSYNC_WRITER_TASK)
+        QueueHandle_t _freeq;
+        QueueHandle_t _fullq;
+        TaskHandle_t  _task;
+        StaticQueue_t _freeq_buf;
+        StaticQueue_t _fullq_buf;
+        uint8_t       _freeq_store[ESPSYNC_WRITE_BUFFERS];
+        uint8_t       _fullq_store[ESPSYNC_WRITE_BUFFERS];
+        StaticTask_t  _task_buf;
+        StackType_t   _task_stack[ESPSYNC_WRITER_STACK];
+        static void WRITE_Task(void *writer);
+#elif defined(ESPSYNC_WRITER_THREAD)
+        std::thread             _thread;
+        std::mutex              _lock;
+        std::condition_variable _cond;
+        uint8_t  _free[ESPSYNC_WRITE_BUFFERS]; /* Ring of free buffers */
+        uint8_t  _full[ESPSYNC_WRITE_BUFFERS]; /* Ring of buffers to write */
+        uint8_t  _nfree, _free_head;
+        uint8_t  _nfull, _full_head;
+        bool     _stop;
+        void WRITE_Thread(void);
+#endif
+};
+
+#endif